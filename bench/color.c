@@ -0,0 +1,101 @@
+#define _GNU_SOURCE
+#include "objcache.h"
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*Strided scan over the same buffer of many slabs. Without coloring the buffer `k` of every slab sits at the
+ * same offset from a page boundary and all of them compete for the same L1D sets. With coloring they are
+ * spread over `unused / 64 + 1` sets.*/
+
+#define OBJ_SIZE 704
+#define SLABS 64
+#define ROUNDS 200000
+
+typedef struct obj {
+  long hot;
+  char pad[OBJ_SIZE - sizeof(long)];
+} obj_t;
+
+/*Opens an L1D read miss counter for the calling thread. Returns -1 if perf events aren't available.*/
+static int l1d_misses_open(void) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(char *name, unsigned int flags) {
+  objc_cache_t *cache = objc_cache_create_ex(name, sizeof(obj_t), 0, NULL, NULL, OBJC_CACHE_ORDER(0) | flags);
+  objc_cache_info_t info = objc_cache_info(cache);
+  int per_slab = info.total_buf;
+  int n = per_slab * SLABS;
+  obj_t **objs = malloc(n * sizeof(obj_t *));
+  /*A new cache fills its slabs one after the other so `objs[s * per_slab + k]` is buffer `k` of slab `s`.*/
+  for (int i = 0; i < n; i++) {
+    objs[i] = objc_cache_alloc(cache);
+    objs[i]->hot = i;
+  }
+
+  int fd = l1d_misses_open();
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  double start = now();
+  long sum = 0;
+  for (int r = 0; r < ROUNDS; r++) {
+    for (int k = 0; k < per_slab; k++) {
+      for (int s = 0; s < SLABS; s++)
+        sum += objs[s * per_slab + k]->hot;
+    }
+  }
+  double elapsed = now() - start;
+  long long misses = -1;
+  if (fd >= 0) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+      misses = -1;
+    close(fd);
+  }
+
+  long accesses = (long)ROUNDS * n;
+  printf("%-8s  unused %4u  %8.2f ns/access", name, info.unused, elapsed * 1e9 / accesses);
+  if (misses >= 0)
+    printf("  %6.3f L1D misses/access\n", (double)misses / accesses);
+  else
+    printf("  L1D misses n/a\n");
+
+  for (int i = 0; i < n; i++)
+    objc_free(cache, objs[i]);
+  objc_cache_destroy(cache);
+  free(objs);
+  /*Keeps the scan from being optimized out.*/
+  if (sum == 42)
+    printf("\n");
+}
+
+int main(void) {
+  printf("strided scan: %d slabs of %zu byte objects, %d rounds\n", SLABS, sizeof(obj_t), ROUNDS);
+  run("nocolor", OBJC_CACHE_NOCOLOR);
+  run("color", 0);
+  return 0;
+}
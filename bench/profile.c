@@ -0,0 +1,59 @@
+#include "objcache.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*Overhead of the sampling heap profiler on the magazine fast path: alloc/free of batches of objects with the
+ * profiler stopped and sampling at decreasing intervals. Half of every batch stays allocated until the next round
+ * so that frees also pay the lookup of caches with sampled objects in use.*/
+
+#define BATCH 1024
+#define ROUNDS 4000
+#define SIZE 64
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(size_t sample_bytes) {
+  objc_cache_t *cache = objc_cache_create("profile", SIZE, 0, NULL, NULL);
+  objc_cache_set_magsize(cache, 64);
+  void *objs[BATCH], *kept[BATCH / 2] = {0};
+  if (sample_bytes)
+    objc_profile_start(sample_bytes);
+  double start = now();
+  for (int r = 0; r < ROUNDS; r++) {
+    for (int i = 0; i < BATCH; i++)
+      objs[i] = objc_cache_alloc(cache);
+    for (int i = 0; i < BATCH / 2; i++) {
+      if (kept[i])
+        objc_free(cache, kept[i]);
+      kept[i] = objs[2 * i];
+      objc_free(cache, objs[2 * i + 1]);
+    }
+  }
+  double elapsed = now() - start;
+  objc_profile_stop();
+  objc_profile_stats_t st = objc_profile_stats();
+  if (sample_bytes)
+    printf("every %7zu bytes  %6.2f ns/op  %8llu samples\n", sample_bytes,
+           elapsed * 1e9 / (2.0 * BATCH * ROUNDS), (unsigned long long)st.samples);
+  else
+    printf("stopped             %6.2f ns/op\n", elapsed * 1e9 / (2.0 * BATCH * ROUNDS));
+  for (int i = 0; i < BATCH / 2; i++)
+    objc_free(cache, kept[i]);
+  objc_cache_destroy(cache);
+}
+
+int main(void) {
+  printf("alloc + free of %d byte objects, %d rounds of %d\n", SIZE, ROUNDS, BATCH);
+  run(0);
+  run(512 * 1024);
+  run(64 * 1024);
+  run(4096);
+  run(0);
+  return 0;
+}
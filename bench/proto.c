@@ -0,0 +1,119 @@
+#include "objcache.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*Prototype caches against constructor caches and a cache without a constructor.
+ *
+ * steady: alloc/free rounds over slabs created and constructed by an untimed warm-up round, so the timed part only
+ * runs the alloc path: the constructor bit test of the other caches, nothing for the prototype cache. The working
+ * set fits in the CPU caches and the fastest round counts.
+ *
+ * fresh: every round creates a cache and allocates all objects from new slabs, where the constructor runs per
+ * object and the prototype is stamped per slab. Released slabs are given back to the kernel, so this also pays the
+ * page faults of the slabs, which dominate: the cache without a constructor shows that floor.*/
+
+#define STEADY_OBJS 1024
+#define STEADY_ROUNDS 2000
+#define FRESH_OBJS 200000
+#define FRESH_ROUNDS 20
+
+typedef struct obj {
+  uint64_t magic;
+  uint32_t refs;
+  uint32_t flags;
+  char name[48];
+  uint64_t table[24];
+} obj_t;
+
+static obj_t image;
+
+static void ctor(void *p, size_t size) {
+  obj_t *o = p;
+  o->magic = 0x0b1ec7ca5eULL;
+  o->refs = 1;
+  o->flags = 0;
+  memset(o->name, 0, sizeof(o->name));
+  strcpy(o->name, "unnamed");
+  for (int i = 0; i < 24; i++)
+    o->table[i] = UINT64_MAX;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*`mode` 0: no constructor, 1: constructor, 2: prototype image.*/
+static objc_cache_t *create(char *name, int mode) {
+  return mode == 2 ? objc_cache_create_proto(name, sizeof(obj_t), 0, &image, NULL, 0)
+                   : objc_cache_create(name, sizeof(obj_t), 0, mode ? ctor : NULL, NULL);
+}
+
+/*Allocates `n` objects into `objs` and returns the time it took.*/
+static double alloc_all(objc_cache_t *cache, void **objs, int n) {
+  double start = now();
+  for (int i = 0; i < n; i++)
+    objs[i] = objc_cache_alloc(cache);
+  return now() - start;
+}
+
+static void free_all(objc_cache_t *cache, void **objs, int n, int mode) {
+  if (mode && ((obj_t *)objs[n - 1])->magic != image.magic)
+    printf("bad object\n");
+  for (int i = 0; i < n; i++)
+    objc_free(cache, objs[i]);
+}
+
+/*The three caches take turns round by round so they see the same machine noise, and each reports its fastest round.*/
+static void steady(void) {
+  static char *names[] = {"none", "ctor", "proto"};
+  void **objs = malloc(STEADY_OBJS * sizeof(void *));
+  objc_cache_t *caches[3];
+  double best[3];
+  for (int m = 0; m < 3; m++) {
+    caches[m] = create(names[m], m);
+    alloc_all(caches[m], objs, STEADY_OBJS);
+    free_all(caches[m], objs, STEADY_OBJS, m);
+    best[m] = 1e9;
+  }
+  for (int r = 0; r < STEADY_ROUNDS; r++)
+    for (int m = 0; m < 3; m++) {
+      double elapsed = alloc_all(caches[m], objs, STEADY_OBJS);
+      free_all(caches[m], objs, STEADY_OBJS, m);
+      if (elapsed < best[m])
+        best[m] = elapsed;
+    }
+  for (int m = 0; m < 3; m++) {
+    printf("steady  %-6s  %6.2f ns/alloc\n", names[m], best[m] * 1e9 / STEADY_OBJS);
+    objc_cache_destroy(caches[m]);
+  }
+  free(objs);
+}
+
+static void fresh(char *name, int mode) {
+  void **objs = malloc(FRESH_OBJS * sizeof(void *));
+  double elapsed = 0;
+  for (int r = 0; r < FRESH_ROUNDS; r++) {
+    objc_cache_t *cache = create(name, mode);
+    elapsed += alloc_all(cache, objs, FRESH_OBJS);
+    free_all(cache, objs, FRESH_OBJS, mode);
+    objc_cache_destroy(cache);
+  }
+  printf("fresh   %-6s  %6.2f ns/alloc\n", name, elapsed * 1e9 / ((double)FRESH_OBJS * FRESH_ROUNDS));
+  free(objs);
+}
+
+int main(void) {
+  ctor(&image, sizeof(image));
+  printf("objects of %zu bytes: steady %d x %d rounds, fresh %d x %d rounds\n", sizeof(obj_t), STEADY_OBJS,
+         STEADY_ROUNDS, FRESH_OBJS, FRESH_ROUNDS);
+  steady();
+  fresh("none", 0);
+  fresh("ctor", 1);
+  fresh("proto", 2);
+  return 0;
+}
@@ -0,0 +1,77 @@
+#include "objcache.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*Latency of the first allocations of a cache with a constructor, right after creation and after
+ * `objc_cache_reserve`. Without the reservation every slab boundary pays for the page faults of the new slab and
+ * every allocation for the first constructor call of its buffer. With it the tail goes away but the median goes up:
+ * the objects were constructed long before, by other threads, and are no longer in the CPU caches.
+ *
+ * All objects are then freed and allocated again. That steady state is the same for both caches, the reservation
+ * only changes the first pass.*/
+
+#define OBJS 200000
+#define THREADS 4
+
+typedef struct obj {
+  uint64_t table[32];
+} obj_t;
+
+static void ctor(void *p, size_t size) {
+  obj_t *o = p;
+  for (int i = 0; i < 32; i++)
+    o->table[i] = i * 0x9e3779b97f4a7c15ULL;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/*Allocates `OBJS` objects into `objs`, timing each allocation, and prints the percentiles.*/
+static void alloc_timed(objc_cache_t *cache, void **objs, uint64_t *lat, char *name, char *pass) {
+  for (int i = 0; i < OBJS; i++) {
+    uint64_t t = now_ns();
+    objs[i] = objc_cache_alloc(cache);
+    lat[i] = now_ns() - t;
+  }
+  qsort(lat, OBJS, sizeof(uint64_t), cmp);
+  printf("%-8s %-6s p50 %5llu ns   p99 %6llu ns   p99.9 %7llu ns   max %8llu ns\n", name, pass,
+         (unsigned long long)lat[OBJS / 2], (unsigned long long)lat[OBJS * 99 / 100],
+         (unsigned long long)lat[OBJS * 999 / 1000], (unsigned long long)lat[OBJS - 1]);
+}
+
+static void run(char *name, int reserve) {
+  objc_cache_t *cache = objc_cache_create(name, sizeof(obj_t), 0, ctor, NULL);
+  uint64_t start = now_ns();
+  if (reserve)
+    objc_cache_reserve(cache, OBJS, THREADS);
+  printf("%-8s reserve %.2f ms\n", name, (now_ns() - start) / 1e6);
+  void **objs = malloc(OBJS * sizeof(void *));
+  uint64_t *lat = malloc(OBJS * sizeof(uint64_t));
+  alloc_timed(cache, objs, lat, name, "first");
+  for (int i = 0; i < OBJS; i++)
+    objc_free(cache, objs[i]);
+  alloc_timed(cache, objs, lat, name, "steady");
+  for (int i = 0; i < OBJS; i++)
+    objc_free(cache, objs[i]);
+  objc_cache_destroy(cache);
+  free(objs);
+  free(lat);
+}
+
+int main(void) {
+  printf("first %d allocations of %zu bytes, reserve with %d threads\n", OBJS, sizeof(obj_t), THREADS);
+  run("cold", 0);
+  run("reserved", 1);
+  return 0;
+}
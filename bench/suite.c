@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+#include "objcache.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*Microbenchmarks of objcache against glibc malloc/free over a sweep of object sizes. Every run is done in its own
+ * child process so that the RSS of one run doesn't leak into the next. Each run is executed twice: once untimed
+ * for the throughput and once with every operation timed for the latency percentiles.
+ *
+ * Output is CSV on stdout:
+ * bench,allocator,size,threads,ops,ops_per_sec,p50_ns,p99_ns,p999_ns,rss_kb
+ * where `rss_kb` is the RSS growth of the child at the point where the most objects are live. `objcache_prof` is
+ * `objcache_mag` with the heap profiler sampling every `PROF_SAMPLE` bytes, the difference is its overhead.
+ *
+ * Usage: bench_suite [ops] where `ops` (default 1000000) is the number of operations of each run.*/
+
+#define BATCH 1000
+#define CHURN_LIVE 10000
+#define PC_CONSUMERS 3
+#define PC_RING 4096
+#define MAG_SIZE 64
+#define PROF_SAMPLE (512 * 1024)
+
+typedef struct allocator {
+  const char *name;
+  objc_cache_t *cache;
+  int ctor; // run the benchmark constructor/destructor, by hand for malloc
+} allocator_t;
+
+static size_t obj_size;
+static size_t rss_base, rss_peak;
+
+/*Expensive constructor: the object carries a lock and a fully initialized payload, like a connection or request
+ * object would. objcache only runs it the first time a buffer is handed out.*/
+static void ctor(void *p, size_t size) {
+  pthread_mutex_init((pthread_mutex_t *)p, NULL);
+  char *payload = (char *)p + sizeof(pthread_mutex_t);
+  for (size_t i = 0; i < size - sizeof(pthread_mutex_t); i++)
+    payload[i] = (char)(i * 31);
+}
+
+static void dtor(void *p, size_t size) { pthread_mutex_destroy((pthread_mutex_t *)p); }
+
+static inline void *bench_alloc(allocator_t *a) {
+  if (a->cache)
+    return objc_cache_alloc(a->cache);
+  void *p = malloc(obj_size);
+  if (a->ctor)
+    ctor(p, obj_size);
+  return p;
+}
+
+static inline void bench_free(allocator_t *a, void *p) {
+  if (a->cache) {
+    objc_free(a->cache, p);
+    return;
+  }
+  if (a->ctor)
+    dtor(p, obj_size);
+  free(p);
+}
+
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t rss_kb(void) {
+  FILE *f = fopen("/proc/self/statm", "r");
+  unsigned long size, resident = 0;
+  if (f) {
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+      resident = 0;
+    fclose(f);
+  }
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void rss_sample(void) {
+  size_t rss = rss_kb();
+  if (rss > rss_peak)
+    rss_peak = rss;
+}
+
+/*Runs `stmt` and stores its duration in `lat[i]` when latencies are recorded.*/
+#define TIMED(lat, i, stmt)                                                                                      \
+  do {                                                                                                           \
+    if (lat) {                                                                                                   \
+      uint64_t t0 = now_ns();                                                                                    \
+      stmt;                                                                                                      \
+      (lat)[(i)++] = now_ns() - t0;                                                                              \
+    } else {                                                                                                     \
+      stmt;                                                                                                      \
+    }                                                                                                            \
+  } while (0)
+
+/*Touches the object so that the allocation is not optimized out and its memory is really used.*/
+static inline void touch(void *p) { *(volatile char *)p = 1; }
+
+/*Every benchmark runs `ops` operations, one alloc or one free each (one alloc + free pair for ping-pong), and
+ * records the latency of each in `lat` if it is not NULL. Returns the number of latencies recorded.*/
+
+static size_t bench_pingpong(allocator_t *a, size_t ops, uint64_t *lat) {
+  size_t n = 0;
+  for (size_t i = 0; i < ops; i++) {
+    void *p;
+    TIMED(lat, n, p = bench_alloc(a); touch(p); bench_free(a, p));
+  }
+  rss_sample();
+  return n;
+}
+
+static size_t bench_batch(allocator_t *a, size_t ops, uint64_t *lat, int fifo) {
+  void **objs = malloc(BATCH * sizeof(void *));
+  size_t n = 0;
+  for (size_t done = 0; done < ops; done += 2 * BATCH) {
+    for (int i = 0; i < BATCH; i++) {
+      TIMED(lat, n, objs[i] = bench_alloc(a));
+      touch(objs[i]);
+    }
+    if (done == 0)
+      rss_sample();
+    for (int i = 0; i < BATCH; i++) {
+      void *p = objs[fifo ? i : BATCH - 1 - i];
+      TIMED(lat, n, bench_free(a, p));
+    }
+  }
+  free(objs);
+  return n;
+}
+
+static size_t bench_lifo(allocator_t *a, size_t ops, uint64_t *lat) { return bench_batch(a, ops, lat, 0); }
+
+static size_t bench_fifo(allocator_t *a, size_t ops, uint64_t *lat) { return bench_batch(a, ops, lat, 1); }
+
+/*A pool of live objects where every step replaces a random one, so object lifetimes are random.*/
+static size_t bench_churn(allocator_t *a, size_t ops, uint64_t *lat) {
+  void **live = calloc(CHURN_LIVE, sizeof(void *));
+  uint64_t x = 88172645463325252ULL;
+  size_t n = 0;
+  for (size_t i = 0; i < ops; i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    void **slot = &live[x % CHURN_LIVE];
+    if (*slot) {
+      TIMED(lat, n, bench_free(a, *slot));
+      *slot = NULL;
+    } else {
+      TIMED(lat, n, *slot = bench_alloc(a));
+      touch(*slot);
+    }
+  }
+  rss_sample();
+  for (int i = 0; i < CHURN_LIVE; i++) {
+    if (live[i])
+      bench_free(a, live[i]);
+  }
+  free(live);
+  return n;
+}
+
+/*Single producer, single consumer ring.*/
+typedef struct ring {
+  _Atomic size_t head;
+  char pad[64];
+  _Atomic size_t tail;
+  void *objs[PC_RING];
+} ring_t;
+
+static struct {
+  allocator_t *a;
+  ring_t rings[PC_CONSUMERS];
+  atomic_int done;
+} pc;
+
+static void *consumer(void *arg) {
+  ring_t *ring = arg;
+  for (;;) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&ring->head, memory_order_acquire)) {
+      if (atomic_load(&pc.done) && tail == atomic_load(&ring->head))
+        return NULL;
+      sched_yield();
+      continue;
+    }
+    void *p = ring->objs[tail % PC_RING];
+    if (pc.a->cache)
+      objc_free_remote(pc.a->cache, p);
+    else
+      bench_free(pc.a, p);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  }
+}
+
+/*One thread allocates and hands the objects over to consumer threads which free them. Only the allocations of
+ * the producer are timed.*/
+static size_t bench_prodcons(allocator_t *a, size_t ops, uint64_t *lat) {
+  memset(&pc, 0, sizeof(pc));
+  pc.a = a;
+  pthread_t threads[PC_CONSUMERS];
+  for (int i = 0; i < PC_CONSUMERS; i++)
+    pthread_create(&threads[i], NULL, consumer, &pc.rings[i]);
+
+  size_t n = 0;
+  for (size_t i = 0; i < ops; i++) {
+    ring_t *ring = &pc.rings[i % PC_CONSUMERS];
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == PC_RING)
+      sched_yield();
+    void *p;
+    TIMED(lat, n, p = bench_alloc(a));
+    touch(p);
+    ring->objs[head % PC_RING] = p;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    if (i == ops / 2)
+      rss_sample();
+  }
+  atomic_store(&pc.done, 1);
+  for (int i = 0; i < PC_CONSUMERS; i++)
+    pthread_join(threads[i], NULL);
+  return n;
+}
+
+typedef struct bench {
+  const char *name;
+  size_t (*run)(allocator_t *a, size_t ops, uint64_t *lat);
+  int ctor;
+  int threads;
+} bench_t;
+
+static const bench_t benches[] = {
+    {"pingpong", bench_pingpong, 0, 1}, {"lifo", bench_lifo, 0, 1},
+    {"fifo", bench_fifo, 0, 1},         {"churn", bench_churn, 0, 1},
+    {"ctor", bench_lifo, 1, 1},         {"prodcons", bench_prodcons, 0, 1 + PC_CONSUMERS},
+};
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/*Runs the benchmark in the calling (child) process and prints its CSV line.*/
+static void run(const bench_t *b, const char *alloc_name, size_t size, size_t ops) {
+  allocator_t a = {.name = alloc_name, .ctor = b->ctor};
+  obj_size = size;
+  if (strncmp(alloc_name, "objcache", 8) == 0) {
+    a.cache = objc_cache_create((char *)b->name, size, 0, b->ctor ? ctor : NULL, b->ctor ? dtor : NULL);
+    if (strcmp(alloc_name, "objcache_mag") == 0 || strcmp(alloc_name, "objcache_prof") == 0)
+      objc_cache_set_magsize(a.cache, MAG_SIZE);
+    if (strcmp(alloc_name, "objcache_prof") == 0)
+      objc_profile_start(PROF_SAMPLE);
+  }
+  /*Batches can round the number of operations up.*/
+  size_t max_lat = ops + 2 * BATCH;
+  uint64_t *lat = malloc(max_lat * sizeof(uint64_t));
+  /*Fault the pages of the latency buffer in so that they don't count in the RSS of the run. A memset to 0 would
+   * be folded with the malloc into a calloc that leaves the pages untouched.*/
+  size_t page = sysconf(_SC_PAGESIZE) / sizeof(uint64_t);
+  for (size_t i = 0; i < max_lat; i += page)
+    ((volatile uint64_t *)lat)[i] = 1;
+  rss_base = rss_peak = rss_kb();
+
+  uint64_t start = now_ns();
+  b->run(&a, ops, NULL);
+  double secs = (now_ns() - start) / 1e9;
+
+  size_t n = b->run(&a, ops, lat);
+  qsort(lat, n, sizeof(uint64_t), cmp_u64);
+  printf("%s,%s,%zu,%d,%zu,%.0f,%llu,%llu,%llu,%zu\n", b->name, alloc_name, size, b->threads, ops, ops / secs,
+         (unsigned long long)lat[n / 2], (unsigned long long)lat[n * 99 / 100],
+         (unsigned long long)lat[n * 999 / 1000], rss_peak - rss_base);
+  fflush(stdout);
+  if (a.cache)
+    objc_cache_destroy(a.cache);
+  free(lat);
+}
+
+int main(int argc, char **argv) {
+  size_t ops = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  size_t sizes[] = {16, 64, 256, 1024, 4096};
+  const char *allocators[] = {"malloc", "objcache", "objcache_mag", "objcache_prof"};
+
+  printf("bench,allocator,size,threads,ops,ops_per_sec,p50_ns,p99_ns,p999_ns,rss_kb\n");
+  fflush(stdout);
+  for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+      /*The constructor needs room for its lock.*/
+      if (benches[b].ctor && sizes[s] < 64)
+        continue;
+      for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+          run(&benches[b], allocators[i], sizes[s], ops);
+          exit(0);
+        }
+        int status;
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+          fprintf(stderr, "%s/%s/%zu failed\n", benches[b].name, allocators[i], sizes[s]);
+          return 1;
+        }
+      }
+    }
+  }
+  return 0;
+}
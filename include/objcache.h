@@ -4,28 +4,353 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct objc_cache objc_cache_t;
 
 typedef struct objc_cache_info {
-  int cache;                  // size of cache in bytes
-  uint16_t unused;            // size of unused bytes in current free slab
-  uint8_t slabctl;            // size of slabctl
-  unsigned short buffer_size; // size of obj + bufctl
-  unsigned short total_buf;   // total number of buffers that fits in a slab
-  unsigned short slab_count;  // number of slabs created in the cache
+  int cache;                // size of cache in bytes
+  uint32_t unused;          // size of unused bytes in a slab
+  uint8_t slabctl;          // size of slabctl
+  unsigned int buffer_size; // size of obj + bufctl
+  unsigned int total_buf;   // total number of buffers that fits in a slab
+  unsigned int slab_count;  // number of slabs created in the cache
+  size_t slab_size;         // size of a slab in bytes
+  unsigned int align;       // alignment of the objects
+  unsigned int padding;     // bytes of each buffer lost to alignment, `padding * total_buf` per slab
 } objc_cache_info_t;
 
+/*Flags for `objc_cache_create_ex`.
+ * OBJC_CACHE_ORDER(n): use slabs of `4K << n` bytes (0 <= n <= 9) instead of picking the order that wastes the
+ *                      least memory.
+ * OBJC_CACHE_HUGEPAGE: use 2M slabs backed by transparent huge pages.
+ * OBJC_CACHE_HUGETLB:  use 2M slabs backed by explicit huge pages (hugetlbfs), falling back to transparent huge
+ *                      pages if none are available.
+ * OBJC_CACHE_OFFSLAB:  keep the slab control and the free list outside of the slab so that objects are packed
+ *                      without any bufctl. This is the default for objects of at least 512 bytes.
+ * OBJC_CACHE_NOCOLOR:  don't color the slabs, every slab starts its first buffer at offset 0.
+ * OBJC_CACHE_BUFCTL:   always append a bufctl to small objects. By default small objects are packed at their size
+ *                      with a 1 or 2 byte index free list in the slab header whenever more objects fit that way.
+ * OBJC_CACHE_ISOLATE:  give every object its own cache lines to avoid false sharing. Buffers are rounded up to
+ *                      `align` bytes, at least 64, and no free list metadata is kept in them. Pass an `align`
+ *                      of 128 to also isolate objects from the adjacent line prefetcher.*/
+#define OBJC_CACHE_ORDER(n) ((unsigned int)(n) + 1)
+#define OBJC_CACHE_ORDER_MASK 0xfu
+#define OBJC_CACHE_HUGEPAGE (1u << 4)
+#define OBJC_CACHE_HUGETLB (1u << 5)
+#define OBJC_CACHE_OFFSLAB (1u << 6)
+#define OBJC_CACHE_NOCOLOR (1u << 7)
+#define OBJC_CACHE_BUFCTL (1u << 8)
+#define OBJC_CACHE_ISOLATE (1u << 9)
+
+/*Constants of the slab layout, shared by the library and by the compile time layouts of objcache.hpp. The size of
+ * the slab control is checked against the library's struct when the library is built.*/
+#define OBJC_PAGE_SIZE 4096                   // slabs are `OBJC_PAGE_SIZE << order` bytes
+#define OBJC_MAX_ORDER 9                      // largest slab order, 2M slabs
+#define OBJC_SLABCTL_SIZE 72                  // bytes of the slab control at the end of a slab
+#define OBJC_SLAB_MIN_OBJS 8                  // automatic slab sizing aims for at least 8 objects per slab
+#define OBJC_SLAB_WASTE 16                    // and no more than 1/16 of the slab unused
+#define OBJC_LARGE_OBJECT (OBJC_PAGE_SIZE / 8) // objects of at least 1/8 page get off-slab metadata
+#define OBJC_CACHELINE 64                     // isolated objects get whole cache lines
+
+/*Policy used to pick the partial slab new objects are allocated from.
+ * OBJC_SLAB_LIFO:  the slab that most recently became partial.
+ * OBJC_SLAB_DENSE: the most allocated partial slab, which keeps fragmentation down.*/
+typedef enum objc_slab_policy { OBJC_SLAB_LIFO, OBJC_SLAB_DENSE } objc_slab_policy_t;
+
+/*Counters of a cache, see `objc_cache_stats`. The event counters are only maintained when the library is built
+ * with `OBJC_STATS` and are 0 otherwise. Objects freed with `objc_free_remote` are counted once they are taken
+ * back by the cache.*/
+typedef struct objc_cache_stats {
+  uint64_t allocs;           // objects allocated
+  uint64_t frees;            // objects freed
+  uint64_t mag_allocs;       // allocations served by the thread's magazines
+  uint64_t mag_frees;        // frees cached in the thread's magazines
+  uint64_t partial_hits;     // allocations from a partial slab
+  uint64_t free_hits;        // allocations that had to take a free slab
+  uint64_t slabs_created;    // slabs created
+  uint64_t slabs_released;   // slabs given back to the page arena
+  uint64_t ctor_calls;       // constructor invocations
+  uint64_t bitmap_hits;      // allocations of a buffer that was already constructed
+  uint64_t remote_frees;     // objects taken back from the remote free lists
+  uint64_t live;             // objects currently allocated by the application
+  uint64_t inuse;            // buffers allocated from the slabs, `live` plus the magazine rounds
+  uint64_t peak_inuse;       // highest `inuse` since the cache was created
+  unsigned int slabs_full;   // number of slabs in each list
+  unsigned int slabs_partial;
+  unsigned int slabs_free;
+  uint64_t partial_inuse;    // buffers allocated in the partial slabs
+  double partial_occupancy;  // `partial_inuse` over the capacity of the partial slabs, 0 without partial slabs
+} objc_cache_stats_t;
+
+/*Output formats of `objc_stats_dump`.
+ * OBJC_STATS_TEXT: one line per cache of space separated `key=value` pairs, starting with `cache=<name>`.
+ * OBJC_STATS_JSON: a single JSON object `{"caches": [{"name": ..., ...}, ...]}`.*/
+typedef enum objc_stats_format { OBJC_STATS_TEXT, OBJC_STATS_JSON } objc_stats_format_t;
+
+/*Usage of the page arena that all caches carve their slabs from.*/
+typedef struct objc_arena_stats {
+  size_t reserved;  // virtual memory reserved with mmap
+  size_t committed; // bytes currently handed out as slabs
+  size_t free;      // bytes in the page free lists, their memory is released to the OS
+} objc_arena_stats_t;
+
+typedef struct objc_epoch_stats {
+  uint64_t epoch;        // current global epoch
+  uint64_t pending;      // objects retired with `objc_free_deferred` and not freed yet, over all threads
+  uint64_t peak_pending; // highest `pending` so far
+  uint64_t retired;      // objects retired so far
+  uint64_t reclaimed;    // objects freed after their grace period so far
+  uint64_t overflows;    // retirements past the per-thread limit from inside a read section
+} objc_epoch_stats_t;
+
+/*Output formats of `objc_profile_dump`.
+ * OBJC_PROFILE_PPROF: legacy heap profile text (`heap_v2`) read by pprof, with the sampled objects in use and
+ * allocated per call stack and the mappings of the process for symbolization. pprof scales the samples itself.
+ * OBJC_PROFILE_FOLDED: one `frame;frame;...;[cache] bytes` line per call stack, outermost frame first, with the
+ * estimated bytes in use, the input of flame graph tools.
+ * OBJC_PROFILE_FOLDED_ALLOC: the same with the estimated bytes allocated since the profiler started.*/
+typedef enum objc_profile_format {
+  OBJC_PROFILE_PPROF,
+  OBJC_PROFILE_FOLDED,
+  OBJC_PROFILE_FOLDED_ALLOC
+} objc_profile_format_t;
+
+typedef struct objc_profile_stats {
+  uint64_t sample_bytes; // mean number of bytes allocated between two samples
+  uint64_t samples;      // objects sampled since the start
+  uint64_t live;         // sampled objects not freed yet
+  uint64_t sites;        // distinct call stacks
+  uint64_t dropped;      // samples lost because the tables were full
+} objc_profile_stats_t;
+
 typedef void (*constructor)(void *, size_t);
 typedef void (*destructor)(void *, size_t);
 
+/*Creates a cache of objects of `size` bytes aligned to `align`, which must be 0 or a power of two up to 4K. With 0
+ * objects are aligned to a pointer, or to the next power of two of their size if smaller. Returns NULL if the
+ * arguments are invalid or the cache can't be created.*/
 objc_cache_t *objc_cache_create(char *name, size_t size, int align, constructor c, destructor d);
 
+/*Same as `objc_cache_create` with `OBJC_CACHE_*` flags.*/
+objc_cache_t *objc_cache_create_ex(char *name, size_t size, int align, constructor c, destructor d,
+                                   unsigned int flags);
+
+/*Creates a cache whose constructed state is a copy of the `size` bytes at `proto`. Every new slab is stamped with
+ * the image in bulk and marked constructed as a whole, so no constructor runs on allocation. The image is copied,
+ * `proto` can be freed after the call. `d` runs on every buffer when its slab is released.*/
+objc_cache_t *objc_cache_create_proto(char *name, size_t size, int align, const void *proto, destructor d,
+                                      unsigned int flags);
+
+/*Opens a persistent cache whose slabs live in the file at `path`, created with room for `max_size` bytes if it
+ * doesn't exist (a `memfd` can be passed as `/proc/self/fd/N`). Slabs, constructed objects and live objects found in
+ * the file are used as they are: constructors only run on buffers that were never constructed in any run. The file
+ * is mapped at the address it had in the previous run when possible, only then do pointers stored in the objects
+ * stay valid. `objc_cache_root` finds a root object in any case. Returns NULL if the file can't be mapped, wasn't
+ * closed with `objc_cache_close`, fails its checksum or was created for another object size or alignment.*/
+objc_cache_t *objc_cache_open(char *name, const char *path, size_t size, int align, constructor c, destructor d,
+                              size_t max_size);
+
+/*Closes a persistent cache: objects held in magazines go back to their slabs, the checksum and the clean flag are
+ * written and the file is unmapped. No destructor runs. No other thread may use the cache anymore. On other caches
+ * this is `objc_cache_destroy`.*/
+void objc_cache_close(objc_cache_t *cache);
+
+/*Records `obj` (or NULL) as the root object of a persistent cache, to be found again with `objc_cache_root` after a
+ * restart. Does nothing on other caches.*/
+void objc_cache_set_root(objc_cache_t *cache, void *obj);
+void *objc_cache_root(objc_cache_t *cache);
+
+/*Enables the per-thread magazine layer with magazines of `mag_size` objects. It must be called before the first
+ * allocation. Returns 0 on success and -1 otherwise.*/
+int objc_cache_set_magsize(objc_cache_t *cache, int mag_size);
+
+/*Sets the partial slab policy of the cache. It must be called before the first allocation. Returns 0 on success
+ * and -1 otherwise.*/
+int objc_cache_set_policy(objc_cache_t *cache, objc_slab_policy_t policy);
+
+/*Answer of a relocation callback.
+ * OBJC_MOVE_YES:   the object was copied to the new buffer and every reference to it updated, the old buffer is
+ *                  freed and must be left in its constructed state as with `objc_free`.
+ * OBJC_MOVE_NO:    the object can't be moved now, the new buffer is given back.
+ * OBJC_MOVE_FREED: the object isn't in use anymore and was (or is being) freed by its owner, the new buffer is
+ *                  given back.*/
+typedef enum objc_move { OBJC_MOVE_YES, OBJC_MOVE_NO, OBJC_MOVE_FREED } objc_move_t;
+
+/*Relocation callback: moves the object at `old_obj` to the constructed buffer `new_obj` of `size` bytes.*/
+typedef objc_move_t (*objc_move_fn)(void *old_obj, void *new_obj, size_t size, void *arg);
+
+/*Makes the cache movable: `objc_cache_defrag` relocates its objects with `fn(old_obj, new_obj, size, arg)`. It must
+ * be called before the first allocation. Returns 0 on success and -1 otherwise.*/
+int objc_cache_set_move(objc_cache_t *cache, objc_move_fn fn, void *arg);
+
 void *objc_cache_alloc(objc_cache_t *cache);
 
 void objc_free(objc_cache_t *cache, void *obj);
 
+/*Frees `obj` without taking the cache lock, for threads freeing objects allocated by another thread. The object is
+ * pushed on a lock-free list of its slab with a single CAS and taken back by the allocating side once its partial
+ * slabs run out. `objc_free` does the same when the cache lock is contended. Large object caches
+ * (`OBJC_CACHE_OFFSLAB`) fall back to `objc_free`'s locked path.*/
+void objc_free_remote(objc_cache_t *cache, void *obj);
+
+/*Makes sure `n_objects` objects can be allocated without creating a slab or running a constructor. The missing
+ * slabs are created up front, their pages prefaulted and the constructor run on all their buffers by `n_threads`
+ * threads (the calling thread included), then they are added to the free slabs. The background reaper keeps up to
+ * `n_objects` worth of free slabs from then on, `objc_cache_reap` still releases them. This removes the slab
+ * creation and constructor spikes from the tail latency, but the median of the first allocations goes up: their
+ * objects were constructed ahead of time, often by another thread, and are no longer in the CPU caches when handed
+ * out. Returns 0 on success and -1 if not all slabs could be created.*/
+int objc_cache_reserve(objc_cache_t *cache, size_t n_objects, int n_threads);
+
+/*Allocates `n` objects into `out`, taking whole runs of free buffers from a slab at once. The constructor runs
+ * only on buffers that were never constructed, same as `objc_cache_alloc`. Returns the number of objects
+ * allocated, which is less than `n` only if the cache ran out of memory.*/
+int objc_cache_alloc_bulk(objc_cache_t *cache, int n, void **out);
+
+/*Frees the `n` objects of `objs`. Objects of the same slab that are next to each other in `objs`, such as the
+ * ones returned by `objc_cache_alloc_bulk`, are returned to their slab in one go.*/
+void objc_free_bulk(objc_cache_t *cache, int n, void **objs);
+
+/*Gives the free slabs of the cache back to the OS, keeping `keep` free slabs around for future allocations. The
+ * destructor runs on every constructed buffer of a released slab. Returns the number of bytes released.*/
+size_t objc_cache_reap(objc_cache_t *cache, int keep);
+
+/*Defragments a movable cache: the live objects of the sparsest partial slabs are moved into the denser partial slabs
+ * and the slabs emptied that way are released. Slabs are only emptied when the other partial slabs have room for all
+ * their objects, no new slab is ever created. The pass stops after `max_moves` objects moved or `max_us`
+ * microseconds, 0 for no limit. The callback runs with the cache locked: it must not allocate from the cache nor
+ * wait on anything a thread allocating from it may hold, and should answer `OBJC_MOVE_NO` instead. Returns the
+ * number of bytes released.*/
+size_t objc_cache_defrag(objc_cache_t *cache, unsigned int max_moves, unsigned int max_us);
+
+/*Starts a background thread that trims every cache each `interval_ms` milliseconds down to its working set: the free
+ * slabs that a cache didn't touch during the last interval are released, the ones it went through are kept for the
+ * next burst. If `rss_limit` is not 0 the thread also checks the resident set size of the process before every pass
+ * (see `objc_pressure_rss`) and while it is above the limit every cache releases all its free slabs, as with
+ * `objc_cache_reap(cache, 0)`. Destructors of released slabs run on the reaper thread, they may create and destroy
+ * other caches but not the one being trimmed. Returns 0 on success and -1 if the reaper is already running.*/
+int objc_reaper_start(unsigned int interval_ms, size_t rss_limit);
+
+/*Stops the reaper thread and waits for it to exit.*/
+void objc_reaper_stop(void);
+
+/*Replaces the memory pressure check of the reaper. `fn(arg)` runs before every pass and returns non-zero when memory
+ * is short, for instance after reading `memory.pressure` of the cgroup. A NULL `fn` disables the check.*/
+void objc_reaper_set_pressure(int (*fn)(void *arg), void *arg);
+
+/*Pressure check comparing the resident set size read from `/proc/self/statm` with the `size_t` limit in bytes
+ * `arg` points to.*/
+int objc_pressure_rss(void *arg);
+
+/*Runs one reaper pass over all caches on the calling thread, trimming them to their working set or, if `pressure`
+ * is set, releasing all their free slabs. Returns the number of bytes released.*/
+size_t objc_reaper_run(int pressure);
+
+/*Called on every allocated object of a walk. Returning non-zero stops the walk.*/
+typedef int (*objc_walk_fn)(void *obj, void *arg);
+
+/*Iterator over the allocated objects of a cache.*/
+typedef struct objc_walk objc_walk_t;
+
+/*Calls `fn(obj, arg)` on every allocated object of the cache, slab by slab in address order. Free slabs are skipped
+ * and only the allocated buffers of partial slabs are visited. The cache is locked during the walk: `fn` must not
+ * allocate from the cache, and may free the objects it visits with `objc_free` except in `OBJC_CACHE_OFFSLAB`
+ * caches. Objects held in the depot are given back to their slabs first, but objects freed into a thread's own
+ * magazines are still allocated for the slab layer and are visited. Returns 0 once every object was visited, the
+ * value returned by `fn` if it stopped the walk, or -1 if the walk can't allocate its state.*/
+int objc_cache_walk(objc_cache_t *cache, objc_walk_fn fn, void *arg);
+
+/*Same as `objc_cache_walk` with the slabs split in `nthreads` ranges walked by as many threads, the calling thread
+ * included. `fn` must be thread safe.*/
+int objc_cache_walk_parallel(objc_cache_t *cache, objc_walk_fn fn, void *arg, int nthreads);
+
+/*Chunked walk: `objc_walk_begin` locks the cache and returns an iterator (NULL if it can't be allocated),
+ * `objc_walk_next` copies up to `n` of the next allocated objects in address order into `objs` and returns how
+ * many, 0 at the end, and `objc_walk_end` unlocks the cache and frees the iterator. The same rules as
+ * `objc_cache_walk` apply between begin and end.*/
+objc_walk_t *objc_walk_begin(objc_cache_t *cache);
+int objc_walk_next(objc_walk_t *walk, void **objs, int n);
+void objc_walk_end(objc_walk_t *walk);
+
+/*Destroys the cache and releases all its slabs. The file of a persistent cache is left empty.*/
 void objc_cache_destroy(objc_cache_t *cache);
 
 objc_cache_info_t objc_cache_info(objc_cache_t *cache);
 
+objc_arena_stats_t objc_arena_stats(void);
+
+/*Starts recording every alloc and free of all caches into a trace file at `path` holding the last `capacity`
+ * operations. The file is mapped in memory so the trace is kept even if the process dies. Replay it with
+ * `objc_replay`. Returns 0 on success and -1 if the file can't be created or a trace is already active.*/
+int objc_trace_start(const char *path, size_t capacity);
+
+/*Stops recording and flushes the trace file.*/
+void objc_trace_stop(void);
+
+/*General purpose allocation from a family of size class caches (8 bytes to 4K, about 1.5x apart) created on
+ * first use. Blocks are aligned to 16 bytes, or 8 for blocks of at most 8 bytes. Larger blocks are passed on to
+ * libc's malloc. `objc_free_ptr` finds the cache of a block from its address and `objc_free_sized` from the size
+ * it was allocated (or reallocated) with.*/
+void *objc_malloc(size_t size);
+void *objc_calloc(size_t n, size_t size);
+void *objc_realloc(void *ptr, size_t size);
+void objc_free_ptr(void *ptr);
+void objc_free_sized(void *ptr, size_t size);
+/*Returns the number of usable bytes of a block of `objc_malloc`.*/
+size_t objc_malloc_usable_size(void *ptr);
+
+/*Read sections for lock-free readers. An object passed to `objc_free_deferred` is freed only once every thread that
+ * was in a read section at that time has left it, so readers can keep dereferencing the nodes they found. Read
+ * sections nest and must not block for long: frees deferred by all threads wait for them.*/
+void objc_read_enter(void);
+void objc_read_exit(void);
+
+/*Frees `obj` to `cache` after the grace period of the readers. Objects are kept per thread in batches and returned
+ * to their slabs with `objc_free_bulk`. A thread holding too many of them outside of a read section waits for the
+ * readers. The cache must not be destroyed while objects deferred to it are pending, see `objc_epoch_synchronize`.*/
+void objc_free_deferred(objc_cache_t *cache, void *obj);
+
+/*Waits for the grace period and frees everything the calling thread deferred. Does nothing inside a read section.
+ * Threads do the same when they exit.*/
+void objc_epoch_synchronize(void);
+
+/*Returns the counters of the deferred frees.*/
+objc_epoch_stats_t objc_epoch_stats(void);
+
+/*Starts the sampling heap profiler. Allocations are sampled about once every `sample_bytes` bytes allocated by a
+ * thread, at random so that every byte has the same chance to be picked, and the call stack of a sampled object is
+ * recorded along with its cache. The profile keeps, per call stack, the sampled objects still in use and all the
+ * ones sampled so far. Allocations that are not sampled only pay the decrement of a per-thread counter and frees
+ * only look the object up in caches that have sampled objects in use. Starting discards the previous profile.
+ * Returns 0 on success and -1 if the profiler is running already or `sample_bytes` is 0.*/
+int objc_profile_start(size_t sample_bytes);
+
+/*Stops sampling. The profile is kept, and follows the frees of its objects, until the next start.*/
+void objc_profile_stop(void);
+
+/*Writes the profile to `out`. Returns 0 on success and -1 if it can't be written.*/
+int objc_profile_dump(FILE *out, objc_profile_format_t format);
+
+/*Dumps the profile to the file at `path` every time the process receives `signo`. The dump is written by a thread
+ * of the profiler, the handler only wakes it up. Calling it again changes the path and the format. Returns 0 on
+ * success and -1 if the handler can't be installed.*/
+int objc_profile_signal(int signo, const char *path, objc_profile_format_t format);
+
+/*Returns the counters of the profiler.*/
+objc_profile_stats_t objc_profile_stats(void);
+
+/*Returns the counters of the cache. Per-thread counters are added up on every call.*/
+objc_cache_stats_t objc_cache_stats(objc_cache_t *cache);
+
+/*Writes the counters of every live cache to `out`. Keys always come in the same order so the output can be
+ * scraped.*/
+void objc_stats_dump(FILE *out, objc_stats_format_t format);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif // !OBJCACHE_H
@@ -0,0 +1,321 @@
+#ifndef OBJCACHE_HPP
+#define OBJCACHE_HPP
+
+#include "objcache.h"
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <type_traits>
+
+/*Typed C++17 front-end of objcache, header only.
+ * objc::cache<T>:      a cache of constructed `T` objects with the slab layout computed at compile time.
+ * objc::resource:      a `std::pmr::memory_resource` serving small blocks from per-size caches.
+ * objc::allocator<T>:  an STL allocator over a resource, for node-based containers.*/
+
+namespace objc {
+
+/*Slab layout of a cache, the same as the one `objc_cache_create_ex` picks at runtime. `total_buf` is 0 if no
+ * slab can hold the object.*/
+struct layout {
+  std::size_t size;
+  std::size_t align;
+  std::size_t buffer_size;
+  std::size_t total_buf;
+  std::size_t slab_size;
+  std::size_t unused;
+  int idx_size; // bytes of index free list per buffer, 0 with a bufctl in every buffer
+};
+
+namespace detail {
+
+/*Layout constants of objcache.h, the library checks the slabctl size when it is built.*/
+constexpr std::size_t page_size = OBJC_PAGE_SIZE;
+constexpr int max_order = OBJC_MAX_ORDER;
+constexpr std::size_t slabctl_size = OBJC_SLABCTL_SIZE;
+constexpr std::size_t bufctl_size = sizeof(void *);
+constexpr std::size_t large_object = OBJC_LARGE_OBJECT;
+constexpr std::size_t cacheline = OBJC_CACHELINE;
+constexpr std::size_t slab_min_objs = OBJC_SLAB_MIN_OBJS;
+constexpr std::size_t slab_waste = OBJC_SLAB_WASTE;
+
+constexpr std::size_t align_up(std::size_t n, std::size_t a) { return (n + a - 1) & ~(a - 1); }
+
+constexpr std::size_t bm_bytes(std::size_t n) { return (n + 7) / 8; }
+
+/*Alignment used by `objc_cache_create_ex` when `align` is 0.*/
+constexpr std::size_t default_align(std::size_t size) {
+  std::size_t align = sizeof(void *);
+  while (align / 2 >= size)
+    align /= 2;
+  return align;
+}
+
+constexpr std::size_t slab_fit(std::size_t avail, std::size_t buffer_size, std::size_t idx_size) {
+  std::size_t total_buf = avail / (buffer_size + idx_size);
+  while (total_buf && total_buf * buffer_size + bm_bytes(total_buf) + align_up(total_buf * idx_size, sizeof(void *)) >
+                          avail)
+    total_buf--;
+  return total_buf;
+}
+
+/*See `slab_layout` of src/objcache.c.*/
+constexpr layout slab_layout(std::size_t size, std::size_t align, unsigned int flags, int order) {
+  layout l{size, align, align_up(size, align), 0, page_size << order, 0, 0};
+  if (flags & OBJC_CACHE_OFFSLAB) {
+    l.total_buf = l.slab_size / l.buffer_size;
+    l.unused = l.slab_size - l.total_buf * l.buffer_size;
+    return l;
+  }
+
+  std::size_t avail = l.slab_size - slabctl_size;
+  l.buffer_size = align_up(align_up(size, sizeof(void *)) + bufctl_size, align);
+  l.total_buf = (flags & OBJC_CACHE_ISOLATE) ? 0 : slab_fit(avail, l.buffer_size, 0);
+  if (!(flags & OBJC_CACHE_BUFCTL) || (flags & OBJC_CACHE_ISOLATE)) {
+    std::size_t compact_size = align_up(size, align);
+    for (int idx_size = 1; idx_size <= 2; idx_size++) {
+      std::size_t compact_buf = slab_fit(avail, compact_size, idx_size);
+      if (compact_buf >= (idx_size == 1 ? UINT8_MAX : UINT16_MAX))
+        continue;
+      if (compact_buf > l.total_buf) {
+        l.total_buf = compact_buf;
+        l.buffer_size = compact_size;
+        l.idx_size = idx_size;
+      }
+      break;
+    }
+  }
+  std::size_t slabctl_offset = avail - align_up(l.total_buf * l.idx_size, sizeof(void *));
+  l.unused = slabctl_offset - bm_bytes(l.total_buf) - l.total_buf * l.buffer_size;
+  return l;
+}
+
+} // namespace detail
+
+/*Computes the layout `objc_cache_create_ex(name, size, align, c, d, flags)` gives its slabs.*/
+constexpr layout cache_layout(std::size_t size, std::size_t align = 0, unsigned int flags = 0) {
+  layout none{size, align, 0, 0, 0, 0, 0};
+  if (!size || align > detail::page_size || (align & (align - 1)))
+    return none;
+  if (!align)
+    align = detail::default_align(size);
+  if (size >= detail::large_object)
+    flags |= OBJC_CACHE_OFFSLAB;
+  if ((flags & OBJC_CACHE_ISOLATE) && align < detail::cacheline)
+    align = detail::cacheline;
+
+  if (flags & (OBJC_CACHE_HUGEPAGE | OBJC_CACHE_HUGETLB))
+    return detail::slab_layout(size, align, flags, detail::max_order);
+  if (flags & OBJC_CACHE_ORDER_MASK) {
+    int order = (flags & OBJC_CACHE_ORDER_MASK) - 1;
+    return order > detail::max_order ? none : detail::slab_layout(size, align, flags, order);
+  }
+  /*See `slab_order` of src/objcache.c. Slab sizes are powers of two so the fractions of unused bytes can be
+   * compared exactly by cross multiplying.*/
+  layout best = none;
+  for (int order = 0; order <= detail::max_order; order++) {
+    layout l = detail::slab_layout(size, align, flags, order);
+    if (!l.total_buf)
+      continue;
+    if (l.total_buf >= detail::slab_min_objs && l.unused * detail::slab_waste <= l.slab_size)
+      return l;
+    if (!best.total_buf || l.unused * best.slab_size < best.unused * l.slab_size)
+      best = l;
+  }
+  return best;
+}
+
+/*Cache of `T` objects. Following the object caching model, an object is constructed with `T()` the first time
+ * its buffer is handed out and destroyed with `~T()` only when its slab goes back to the OS, so it must be freed
+ * in its constructed state. Trivial constructors and destructors are not registered at all, the others are
+ * instantiated for `T` and only run on unconstructed buffers, never on the allocation fast path. `Flags` are
+ * the flags of `objc_cache_create_ex`.*/
+template <class T, unsigned int Flags = 0> class cache {
+public:
+  static constexpr std::size_t alignment =
+      alignof(T) > detail::default_align(sizeof(T)) ? alignof(T) : detail::default_align(sizeof(T));
+  static_assert(alignment <= detail::page_size, "objc::cache supports alignments up to 4K");
+  static constexpr layout slab = cache_layout(sizeof(T), alignment, Flags);
+  static_assert(slab.total_buf > 0, "T doesn't fit in a slab with these flags");
+
+  /*Returns the object to its cache.*/
+  struct deleter {
+    cache *owner;
+    void operator()(T *obj) const noexcept { owner->free(obj); }
+  };
+  using handle = std::unique_ptr<T, deleter>;
+
+  /*`name` must outlive the cache. Throws `std::bad_alloc` if the cache can't be created.*/
+  explicit cache(const char *name)
+      : cache_(objc_cache_create_ex(const_cast<char *>(name), sizeof(T), alignment, ctor(), dtor(), Flags)) {
+    if (!cache_)
+      throw std::bad_alloc();
+    assert(objc_cache_info(cache_).total_buf == slab.total_buf &&
+           objc_cache_info(cache_).buffer_size == slab.buffer_size);
+  }
+
+  ~cache() { objc_cache_destroy(cache_); }
+
+  cache(const cache &) = delete;
+  cache &operator=(const cache &) = delete;
+
+  /*Returns a constructed object or nullptr if memory is exhausted.*/
+  T *alloc() noexcept { return static_cast<T *>(objc_cache_alloc(cache_)); }
+
+  void free(T *obj) noexcept { objc_free(cache_, obj); }
+
+  /*Returns an object that goes back to the cache when the handle is destroyed. Throws `std::bad_alloc` if
+   * memory is exhausted.*/
+  handle make() {
+    T *obj = alloc();
+    if (!obj)
+      throw std::bad_alloc();
+    return handle(obj, deleter{this});
+  }
+
+  /*The underlying C cache, for `objc_cache_set_magsize` and the like.*/
+  objc_cache_t *get() const noexcept { return cache_; }
+
+private:
+  static void construct(void *p, size_t) noexcept { ::new (p) T(); }
+  static void destruct(void *p, size_t) noexcept { static_cast<T *>(p)->~T(); }
+
+  static constexpr constructor ctor() {
+    return std::is_trivially_default_constructible_v<T> ? nullptr : construct;
+  }
+  static constexpr destructor dtor() { return std::is_trivially_destructible_v<T> ? nullptr : destruct; }
+
+  objc_cache_t *cache_;
+};
+
+/*Memory resource serving blocks of up to `max_size` bytes from one cache per size class: multiples of 16 up to
+ * 256 bytes and of 64 up to 1K. Blocks are aligned to 16 bytes. Larger blocks and stricter alignments go to the
+ * upstream resource. Caches are created on first use.*/
+class resource : public std::pmr::memory_resource {
+public:
+  static constexpr std::size_t max_size = 1024;
+  static constexpr std::size_t block_align = 16;
+
+  explicit resource(std::pmr::memory_resource *upstream = std::pmr::new_delete_resource()) noexcept
+      : upstream_(upstream) {
+    for (auto &c : caches_)
+      c.store(nullptr, std::memory_order_relaxed);
+  }
+
+  ~resource() override {
+    for (auto &c : caches_) {
+      if (objc_cache_t *cache = c.load(std::memory_order_relaxed))
+        objc_cache_destroy(cache);
+    }
+  }
+
+  resource(const resource &) = delete;
+  resource &operator=(const resource &) = delete;
+
+  std::pmr::memory_resource *upstream() const noexcept { return upstream_; }
+
+  /*Returns the cache serving blocks of `bytes` bytes, nullptr if there isn't one (yet).*/
+  objc_cache_t *cache(std::size_t bytes) const noexcept {
+    return bytes && bytes <= max_size ? caches_[size_class(bytes)].load(std::memory_order_acquire) : nullptr;
+  }
+
+  static constexpr std::size_t nclasses = 256 / 16 + (max_size - 256) / 64;
+
+  static constexpr std::size_t size_class(std::size_t bytes) {
+    return bytes <= 256 ? (bytes - 1) / 16 : 256 / 16 + (bytes - 256 - 1) / 64;
+  }
+
+  static constexpr std::size_t class_size(std::size_t i) { return i < 256 / 16 ? (i + 1) * 16 : 256 + (i - 15) * 64; }
+
+protected:
+  void *do_allocate(std::size_t bytes, std::size_t align) override {
+    if (!bytes)
+      bytes = 1;
+    if (bytes > max_size || align > block_align)
+      return upstream_->allocate(bytes, align);
+    void *p = objc_cache_alloc(class_cache(size_class(bytes)));
+    if (!p)
+      throw std::bad_alloc();
+    return p;
+  }
+
+  void do_deallocate(void *p, std::size_t bytes, std::size_t align) override {
+    if (!bytes)
+      bytes = 1;
+    if (bytes > max_size || align > block_align)
+      upstream_->deallocate(p, bytes, align);
+    else
+      objc_free(caches_[size_class(bytes)].load(std::memory_order_relaxed), p);
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+
+private:
+  objc_cache_t *class_cache(std::size_t i) {
+    objc_cache_t *cache = caches_[i].load(std::memory_order_acquire);
+    if (cache)
+      return cache;
+    std::lock_guard<std::mutex> guard(lock_);
+    cache = caches_[i].load(std::memory_order_relaxed);
+    if (!cache) {
+      std::snprintf(names_[i], sizeof(names_[i]), "objc_pmr_%zu", class_size(i));
+      cache = objc_cache_create(names_[i], class_size(i), block_align, nullptr, nullptr);
+      if (!cache)
+        throw std::bad_alloc();
+      caches_[i].store(cache, std::memory_order_release);
+    }
+    return cache;
+  }
+
+  std::pmr::memory_resource *upstream_;
+  std::array<std::atomic<objc_cache_t *>, nclasses> caches_;
+  char names_[nclasses][24];
+  std::mutex lock_;
+};
+
+static_assert(resource::class_size(resource::nclasses - 1) == resource::max_size);
+
+/*Process-wide resource used by `allocator<T>` by default. It is never destroyed so that containers with static
+ * storage duration can still give their nodes back at exit.*/
+inline resource *default_resource() {
+  static resource *res = new resource();
+  return res;
+}
+
+/*STL allocator over a memory resource, `default_resource()` unless given one. Containers allocating one node at
+ * a time (`std::list`, `std::map`, the nodes of `std::unordered_map`) get their nodes from objcache.*/
+template <class T> class allocator {
+public:
+  using value_type = T;
+
+  allocator() noexcept : res_(default_resource()) {}
+  explicit allocator(std::pmr::memory_resource *res) noexcept : res_(res) {}
+  template <class U> allocator(const allocator<U> &other) noexcept : res_(other.resource()) {}
+
+  T *allocate(std::size_t n) {
+    if (n > SIZE_MAX / sizeof(T))
+      throw std::bad_array_new_length();
+    return static_cast<T *>(res_->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T *p, std::size_t n) noexcept { res_->deallocate(p, n * sizeof(T), alignof(T)); }
+
+  std::pmr::memory_resource *resource() const noexcept { return res_; }
+
+  template <class U> bool operator==(const allocator<U> &other) const noexcept {
+    return res_ == other.resource() || res_->is_equal(*other.resource());
+  }
+  template <class U> bool operator!=(const allocator<U> &other) const noexcept { return !(*this == other); }
+
+private:
+  std::pmr::memory_resource *res_;
+};
+
+} // namespace objc
+
+#endif // !OBJCACHE_HPP
@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+#include "objc_internal.h"
+#include "objcache.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+/*LD_PRELOAD interposer: LD_PRELOAD=build/libobjcache_preload.so <program>
+ *
+ * Blocks of up to `OBJC_MALLOC_MAX` bytes with the default alignment come from the `objc_malloc` size classes,
+ * everything else is forwarded to the next allocator in the symbol lookup order (normally glibc). `free` and
+ * friends tell the two apart with `arena_contains`, a single bit test.
+ *
+ * objcache itself allocates with malloc: the cache structs, the magazines and the per-thread caches. While
+ * objcache code runs the thread is flagged and those allocations go to the next allocator, so objcache never
+ * recurses into itself. Slabs and their metadata come from the page arena which never mallocs. The next
+ * allocator is looked up with `dlsym`, which may itself allocate: those blocks are served from a static bootstrap
+ * buffer and never freed.
+ *
+ * Objcache locks are not reset in the child of a fork, so a program that forks while other threads allocate can
+ * deadlock in the child.*/
+
+#define EXPORT __attribute__((visibility("default")))
+#define BOOT_SIZE (64 * 1024)
+
+static void *(*next_malloc)(size_t);
+static void (*next_free)(void *);
+static void *(*next_calloc)(size_t, size_t);
+static void *(*next_realloc)(void *, size_t);
+static int (*next_posix_memalign)(void **, size_t, size_t);
+static size_t (*next_malloc_usable_size)(void *);
+
+static __thread int in_objc;  // set while objcache runs on this thread
+static atomic_int resolving;  // set while the next allocator is looked up
+static char boot_buf[BOOT_SIZE] __attribute__((aligned(16)));
+static atomic_size_t boot_used;
+
+static inline int is_boot(void *ptr) { return (char *)ptr >= boot_buf && (char *)ptr < boot_buf + BOOT_SIZE; }
+
+/*Zeroed blocks from the bootstrap buffer, only used while `dlsym` runs.*/
+static void *boot_alloc(size_t size) {
+  size_t off = atomic_fetch_add(&boot_used, ALIGN_UP(size, 16));
+  if (off + size > BOOT_SIZE)
+    return NULL;
+  return boot_buf + off;
+}
+
+static void lookup(void) {
+  atomic_store(&resolving, 1);
+  next_malloc = dlsym(RTLD_NEXT, "malloc");
+  next_free = dlsym(RTLD_NEXT, "free");
+  next_calloc = dlsym(RTLD_NEXT, "calloc");
+  next_realloc = dlsym(RTLD_NEXT, "realloc");
+  next_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+  next_malloc_usable_size = dlsym(RTLD_NEXT, "malloc_usable_size");
+  atomic_store(&resolving, 0);
+}
+
+static void resolve(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, lookup);
+}
+
+/*Returns 1 if the call must go to the next allocator or the bootstrap buffer.*/
+static inline int forward(void) {
+  if (in_objc)
+    return 1;
+  if (!next_malloc) {
+    if (atomic_load(&resolving))
+      return 1;
+    resolve();
+  }
+  return 0;
+}
+
+#define OBJC_CALL(stmt)                                                                                          \
+  do {                                                                                                           \
+    int saved = in_objc;                                                                                         \
+    in_objc = 1;                                                                                                 \
+    stmt;                                                                                                        \
+    in_objc = saved;                                                                                             \
+  } while (0)
+
+EXPORT void *malloc(size_t size) {
+  if (forward() || size > OBJC_MALLOC_MAX)
+    return next_malloc ? next_malloc(size) : boot_alloc(size);
+  void *ptr;
+  OBJC_CALL(ptr = objc_malloc(size));
+  if (!ptr)
+    errno = ENOMEM;
+  return ptr;
+}
+
+EXPORT void free(void *ptr) {
+  if (!ptr || is_boot(ptr))
+    return;
+  if (arena_contains(ptr)) {
+    OBJC_CALL(objc_free_ptr(ptr));
+    return;
+  }
+  if (!next_free)
+    resolve();
+  next_free(ptr);
+}
+
+EXPORT void *calloc(size_t n, size_t size) {
+  if (size && n > SIZE_MAX / size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (forward() || n * size > OBJC_MALLOC_MAX)
+    return next_calloc ? next_calloc(n, size) : boot_alloc(n * size);
+  void *ptr;
+  OBJC_CALL(ptr = objc_calloc(n, size));
+  if (!ptr)
+    errno = ENOMEM;
+  return ptr;
+}
+
+EXPORT void *realloc(void *ptr, size_t size) {
+  if (!ptr)
+    return malloc(size);
+  if (is_boot(ptr)) {
+    /*The size of a bootstrap block isn't known, it can't be larger than what is left of the buffer.*/
+    void *new_ptr = malloc(size);
+    if (new_ptr) {
+      size_t avail = boot_buf + BOOT_SIZE - (char *)ptr;
+      memcpy(new_ptr, ptr, size < avail ? size : avail);
+    }
+    return new_ptr;
+  }
+  if (!arena_contains(ptr)) {
+    if (!next_realloc)
+      resolve();
+    return next_realloc(ptr, size);
+  }
+  void *new_ptr;
+  OBJC_CALL(new_ptr = objc_realloc(ptr, size));
+  if (!new_ptr && size)
+    errno = ENOMEM;
+  return new_ptr;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t align, size_t size) {
+  if (align < sizeof(void *) || (align & (align - 1)))
+    return EINVAL;
+  /*Size class blocks are 16 byte aligned except the 8 byte class.*/
+  if (forward() || align > 16 || size > OBJC_MALLOC_MAX) {
+    if (!next_posix_memalign) {
+      *memptr = align <= 16 ? boot_alloc(size) : NULL;
+      return *memptr ? 0 : ENOMEM;
+    }
+    return next_posix_memalign(memptr, align, size);
+  }
+  void *ptr;
+  OBJC_CALL(ptr = objc_malloc(size > align ? size : align));
+  if (!ptr)
+    return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+EXPORT size_t malloc_usable_size(void *ptr) {
+  if (!ptr || is_boot(ptr))
+    return 0;
+  if (arena_contains(ptr)) {
+    size_t size;
+    OBJC_CALL(size = objc_malloc_usable_size(ptr));
+    return size;
+  }
+  if (!next_malloc_usable_size)
+    resolve();
+  return next_malloc_usable_size(ptr);
+}
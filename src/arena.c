@@ -0,0 +1,198 @@
+#include "objc_internal.h"
+#include "objcache.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/*Page arena shared by all caches. Large regions of virtual memory are reserved with `mmap` and slabs are carved
+ * out of them by bumping a pointer. A slab of `PAGE_SIZE << order` bytes is always aligned to its own size so
+ * that `GET_SLABBASE` keeps working. Pages returned to the arena are released to the OS with
+ * `MADV_DONTNEED` and recycled through a free list per order.
+ *
+ * 2M slabs backed by explicit huge pages are mapped individually with `MAP_HUGETLB` and unmapped when they
+ * are returned since hugetlb pages can't be released with `MADV_DONTNEED`.
+ *
+ * The arena never calls malloc. Even the free lists live in memory mapped by the arena itself.
+ *
+ * Whether an address belongs to the arena is answered by a bitmap with one bit per 2M granule of the user address
+ * space, set for the granules of every region. The bitmap is a lazily committed mapping of 8M so only the pages
+ * around the regions ever use memory.*/
+
+/*Stack of free blocks of one order.*/
+typedef struct arena_stack {
+  void **items;
+  size_t n;
+  size_t cap; // capacity in number of items
+} arena_stack_t;
+
+static struct {
+  pthread_mutex_t lock;
+  char *cur; // bump pointer into the current region
+  char *end;
+  arena_stack_t free[OBJC_ARENA_MAX_ORDER + 1];
+  char *regions[OBJC_ARENA_MAX_REGIONS]; // base of every reserved region
+  int nregions;
+  size_t reserved;
+  size_t committed;
+  size_t free_bytes;
+} arena = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+#define ORDER_SIZE(order) ((size_t)PAGE_SIZE << (order))
+#define MAP_SHIFT 21 // a region is aligned to 2M so it covers whole granules
+#define MAP_BITS (1UL << (47 - MAP_SHIFT))
+
+static _Atomic uint64_t *_Atomic arena_map; // bit `addr >> MAP_SHIFT` is set if `addr` is in a region
+
+static void *os_map(size_t size) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+static int stack_push(arena_stack_t *st, void *p) {
+  if (st->n == st->cap) {
+    size_t cap = st->cap ? st->cap * 2 : PAGE_SIZE / sizeof(void *);
+    void **items = os_map(cap * sizeof(void *));
+    if (!items)
+      return -1;
+    if (st->items) {
+      memcpy(items, st->items, st->n * sizeof(void *));
+      munmap(st->items, st->cap * sizeof(void *));
+    }
+    st->items = items;
+    st->cap = cap;
+  }
+  st->items[st->n++] = p;
+  return 0;
+}
+
+/*Puts `[start, end)` in the free lists as the largest naturally aligned blocks that fit. Used for the pages
+ * skipped while aligning the bump pointer and for the tail of a retired region.*/
+static void free_range(char *start, char *end) {
+  while (start < end) {
+    int order = OBJC_ARENA_MAX_ORDER;
+    while (order > 0 && (((uintptr_t)start & (ORDER_SIZE(order) - 1)) || start + ORDER_SIZE(order) > end))
+      order--;
+    if (stack_push(&arena.free[order], start) != 0)
+      return; // the pages are leaked but stay reserved
+    arena.free_bytes += ORDER_SIZE(order);
+    start += ORDER_SIZE(order);
+  }
+}
+
+/*Reserves a new region aligned to the largest slab size. The tail of the previous region is kept in the free
+ * lists.*/
+static int reserve_region(void) {
+  size_t align = ORDER_SIZE(OBJC_ARENA_MAX_ORDER);
+  if (arena.nregions == OBJC_ARENA_MAX_REGIONS)
+    return -1;
+  if (!arena_map) {
+    _Atomic uint64_t *map = os_map(MAP_BITS / 8);
+    if (!map)
+      return -1;
+    atomic_store_explicit(&arena_map, map, memory_order_release);
+  }
+  char *p = os_map(OBJC_ARENA_REGION + align);
+  if (!p)
+    return -1;
+
+  /*Trim the mapping so that the region starts at an `align` boundary.*/
+  char *start = (char *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+  if (start > p)
+    munmap(p, start - p);
+  munmap(start + OBJC_ARENA_REGION, (p + align) - start);
+
+  free_range(arena.cur, arena.end);
+  arena.cur = start;
+  arena.end = start + OBJC_ARENA_REGION;
+  for (uintptr_t g = (uintptr_t)start >> MAP_SHIFT; g < ((uintptr_t)start + OBJC_ARENA_REGION) >> MAP_SHIFT; g++)
+    atomic_fetch_or_explicit(&arena_map[g / 64], 1ULL << (g % 64), memory_order_relaxed);
+  arena.regions[arena.nregions++] = start;
+  arena.reserved += OBJC_ARENA_REGION;
+  return 0;
+}
+
+void *arena_alloc(int order) {
+  size_t size = ORDER_SIZE(order);
+  void *p = NULL;
+
+  pthread_mutex_lock(&arena.lock);
+  /*Take the smallest free block that is large enough. A larger block is split and its unused upper halves go
+   * back in the free lists.*/
+  int from = order;
+  while (from <= OBJC_ARENA_MAX_ORDER && !arena.free[from].n)
+    from++;
+  if (from <= OBJC_ARENA_MAX_ORDER) {
+    arena_stack_t *st = &arena.free[from];
+    p = st->items[--st->n];
+    arena.free_bytes -= ORDER_SIZE(from);
+    free_range((char *)p + size, (char *)p + ORDER_SIZE(from));
+  } else {
+    char *start = (char *)(((uintptr_t)arena.cur + size - 1) & ~(uintptr_t)(size - 1));
+    if (!arena.cur || start + size > arena.end) {
+      if (reserve_region() != 0)
+        goto out;
+      start = arena.cur;
+    }
+    free_range(arena.cur, start);
+    arena.cur = start + size;
+    p = start;
+  }
+  arena.committed += size;
+out:
+  pthread_mutex_unlock(&arena.lock);
+  return p;
+}
+
+/*Returns 1 if `p` points into one of the regions reserved by the arena. Regions are never given back so the bits
+ * of the map are only ever set and no lock is needed. A pointer handed out from a region was published after
+ * its bits were set.*/
+int arena_contains(void *p) {
+  uintptr_t g = (uintptr_t)p >> MAP_SHIFT;
+  _Atomic uint64_t *map = atomic_load_explicit(&arena_map, memory_order_acquire);
+  if (!map || g >= MAP_BITS)
+    return 0;
+  return (atomic_load_explicit(&map[g / 64], memory_order_relaxed) >> (g % 64)) & 1;
+}
+
+/*Maps a 2M slab backed by an explicit huge page. Returns NULL if no huge page is available.*/
+void *arena_alloc_huge(void) {
+  size_t size = ORDER_SIZE(OBJC_ARENA_MAX_ORDER);
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  pthread_mutex_lock(&arena.lock);
+  arena.reserved += size;
+  arena.committed += size;
+  pthread_mutex_unlock(&arena.lock);
+  return p;
+}
+
+void arena_free(void *p, int order) {
+  size_t size = ORDER_SIZE(order);
+
+  if (!arena_contains(p)) {
+    /*Explicit huge page slab.*/
+    munmap(p, size);
+    pthread_mutex_lock(&arena.lock);
+    arena.reserved -= size;
+    arena.committed -= size;
+    pthread_mutex_unlock(&arena.lock);
+    return;
+  }
+  /*The pages stay reserved for future slabs but their memory goes back to the OS.*/
+  madvise(p, size, MADV_DONTNEED);
+
+  pthread_mutex_lock(&arena.lock);
+  if (stack_push(&arena.free[order], p) == 0)
+    arena.free_bytes += size;
+  arena.committed -= size;
+  pthread_mutex_unlock(&arena.lock);
+}
+
+objc_arena_stats_t objc_arena_stats(void) {
+  pthread_mutex_lock(&arena.lock);
+  objc_arena_stats_t stats = {.reserved = arena.reserved, .committed = arena.committed, .free = arena.free_bytes};
+  pthread_mutex_unlock(&arena.lock);
+  return stats;
+}
@@ -0,0 +1,215 @@
+#include "objc_internal.h"
+#include "objcache.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+/*Epoch based reclamation. A global epoch only moves forward once every thread inside a read section has seen its
+ * current value, so when it has moved twice past the epoch an object was retired in, no reader can still hold a
+ * reference to the object. Every thread keeps three bags of retired objects, one per epoch modulo 3: the bag of
+ * epoch `e` is reused at epoch `e + 3`, by which time it is safe to free, and is then returned to the slabs with
+ * `objc_free_bulk`, one call per run of objects of the same cache.
+ *
+ * Retired objects are bounded per thread by `OBJC_EPOCH_MAX_PENDING`. Past it a thread outside of a read section
+ * waits for the grace period, a thread inside one can't (it would wait for itself) and goes over the limit.*/
+
+#define OBJC_EPOCH_BATCH 64         // retired objects between two attempts to move the epoch
+#define OBJC_EPOCH_MAX_PENDING 8192 // retired objects a thread holds before it waits for readers
+
+typedef struct epoch_entry {
+  objc_cache_t *cache;
+  void *obj;
+} epoch_entry_t;
+
+typedef struct epoch_bag {
+  uint64_t epoch; // epoch the objects were retired in
+  int count;
+  int cap;
+  epoch_entry_t *entries;
+} epoch_bag_t;
+
+typedef struct epoch_thread {
+  _Atomic uint64_t epoch; // epoch seen when the read section was entered, 0 outside of read sections
+  int nest;               // depth of nested read sections
+  int registered;
+  int since_advance;      // objects retired since the last attempt to move the epoch
+  int pending;            // objects in the bags
+  epoch_bag_t bags[3];
+  struct epoch_thread *next; // list of the threads, protected by `threads_lock`
+  struct epoch_thread *prev;
+} epoch_thread_t;
+
+static _Atomic uint64_t global_epoch = 1;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static epoch_thread_t *threads;
+static pthread_key_t thread_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static __thread epoch_thread_t self;
+
+static _Atomic uint64_t pending_total, pending_peak, retired_total, reclaimed_total, overflows;
+
+static void thread_exit(void *arg);
+
+static void key_init(void) { pthread_key_create(&thread_key, thread_exit); }
+
+static void thread_register(epoch_thread_t *t) {
+  pthread_once(&key_once, key_init);
+  pthread_setspecific(thread_key, t);
+  pthread_mutex_lock(&threads_lock);
+  t->prev = NULL;
+  t->next = threads;
+  if (threads)
+    threads->prev = t;
+  threads = t;
+  pthread_mutex_unlock(&threads_lock);
+  t->registered = 1;
+}
+
+/*Moves the global epoch forward if every thread in a read section has seen it. Returns the global epoch.*/
+static uint64_t epoch_advance(void) {
+  uint64_t g = atomic_load(&global_epoch);
+  pthread_mutex_lock(&threads_lock);
+  for (epoch_thread_t *t = threads; t; t = t->next) {
+    uint64_t e = atomic_load(&t->epoch);
+    if (e && e != g) {
+      pthread_mutex_unlock(&threads_lock);
+      return g;
+    }
+  }
+  pthread_mutex_unlock(&threads_lock);
+  if (atomic_compare_exchange_strong(&global_epoch, &g, g + 1))
+    return g + 1;
+  return g;
+}
+
+static void bag_free(epoch_thread_t *t, epoch_bag_t *bag) {
+  int i = 0;
+  while (i < bag->count) {
+    objc_cache_t *cache = bag->entries[i].cache;
+    void *objs[OBJC_EPOCH_BATCH];
+    int n = 0;
+    for (; i < bag->count && n < OBJC_EPOCH_BATCH && bag->entries[i].cache == cache; i++)
+      objs[n++] = bag->entries[i].obj;
+    objc_free_bulk(cache, n, objs);
+  }
+  t->pending -= bag->count;
+  atomic_fetch_sub(&pending_total, bag->count);
+  atomic_fetch_add(&reclaimed_total, bag->count);
+  bag->count = 0;
+}
+
+/*Frees the bags retired two or more epochs before `g`.*/
+static void bags_reclaim(epoch_thread_t *t, uint64_t g) {
+  for (int i = 0; i < 3; i++) {
+    if (t->bags[i].count && t->bags[i].epoch + 2 <= g)
+      bag_free(t, &t->bags[i]);
+  }
+}
+
+/*Waits until everything the thread retired can be freed and frees it. Readers of other threads have to leave their
+ * read sections.*/
+static void epoch_wait(epoch_thread_t *t) {
+  while (t->pending) {
+    bags_reclaim(t, epoch_advance());
+    if (t->pending)
+      sched_yield();
+  }
+}
+
+static void thread_exit(void *arg) {
+  epoch_thread_t *t = arg;
+  epoch_wait(t);
+  pthread_mutex_lock(&threads_lock);
+  if (t->prev)
+    t->prev->next = t->next;
+  else
+    threads = t->next;
+  if (t->next)
+    t->next->prev = t->prev;
+  pthread_mutex_unlock(&threads_lock);
+  for (int i = 0; i < 3; i++)
+    free(t->bags[i].entries);
+}
+
+void objc_read_enter(void) {
+  epoch_thread_t *t = &self;
+  if (t->nest++)
+    return;
+  if (!t->registered)
+    thread_register(t);
+  /*The store has to be visible to `epoch_advance` before any shared pointer is read.*/
+  atomic_store(&t->epoch, atomic_load(&global_epoch));
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+void objc_read_exit(void) {
+  epoch_thread_t *t = &self;
+  if (--t->nest == 0)
+    atomic_store_explicit(&t->epoch, 0, memory_order_release);
+}
+
+void objc_free_deferred(objc_cache_t *cache, void *obj) {
+  epoch_thread_t *t = &self;
+  if (!t->registered)
+    thread_register(t);
+  uint64_t g = atomic_load(&global_epoch);
+  epoch_bag_t *bag = &t->bags[g % 3];
+  /*The bag was filled three or more epochs ago.*/
+  if (bag->count && bag->epoch != g)
+    bag_free(t, bag);
+  if (bag->count == bag->cap) {
+    int cap = bag->cap ? 2 * bag->cap : OBJC_EPOCH_BATCH;
+    epoch_entry_t *entries = realloc(bag->entries, cap * sizeof(epoch_entry_t));
+    if (!entries) {
+      /*Nowhere to keep the object: wait for the readers and free it right away, unless this thread is one of
+       * them in which case the object is leaked rather than freed under a reader.*/
+      if (t->nest)
+        return;
+      epoch_wait(t);
+      while (epoch_advance() < g + 2)
+        sched_yield();
+      objc_free(cache, obj);
+      return;
+    }
+    bag->entries = entries;
+    bag->cap = cap;
+  }
+  bag->epoch = g;
+  bag->entries[bag->count++] = (epoch_entry_t){cache, obj};
+  t->pending++;
+  atomic_fetch_add(&retired_total, 1);
+  uint64_t pending = atomic_fetch_add(&pending_total, 1) + 1;
+  uint64_t peak = atomic_load_explicit(&pending_peak, memory_order_relaxed);
+  while (pending > peak && !atomic_compare_exchange_weak(&pending_peak, &peak, pending))
+    ;
+
+  if (++t->since_advance >= OBJC_EPOCH_BATCH) {
+    t->since_advance = 0;
+    bags_reclaim(t, epoch_advance());
+  }
+  if (t->pending >= OBJC_EPOCH_MAX_PENDING) {
+    if (t->nest)
+      atomic_fetch_add(&overflows, 1);
+    else
+      epoch_wait(t);
+  }
+}
+
+void objc_epoch_synchronize(void) {
+  epoch_thread_t *t = &self;
+  if (t->nest)
+    return;
+  uint64_t g = atomic_load(&global_epoch);
+  while (epoch_advance() < g + 2)
+    sched_yield();
+  epoch_wait(t);
+}
+
+objc_epoch_stats_t objc_epoch_stats(void) {
+  return (objc_epoch_stats_t){.epoch = atomic_load(&global_epoch),
+                              .pending = atomic_load(&pending_total),
+                              .peak_pending = atomic_load(&pending_peak),
+                              .retired = atomic_load(&retired_total),
+                              .reclaimed = atomic_load(&reclaimed_total),
+                              .overflows = atomic_load(&overflows)};
+}
@@ -2,13 +2,106 @@
 #define OBJC_INTERNAL_H
 
 #include "objcache.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-#define PAGE_SIZE 4 * 1024 // 4K
+#define PAGE_SIZE OBJC_PAGE_SIZE
 #define GET_SLABCTL(cache, slab) ((objc_slabctl_t *)((char *)(slab) + (cache)->slabctl_offset))
-#define GET_SLABBASE(ptr) ((void *)((uintptr_t)(ptr) & ~(PAGE_SIZE - 1)))
+#define OBJC_ARENA_MAX_ORDER OBJC_MAX_ORDER // largest block of the page arena is `PAGE_SIZE << 9` i.e. 2M
+#define OBJC_ARENA_REGION (64UL << 20)    // size of the virtual regions reserved by the page arena
+#define OBJC_ARENA_MAX_REGIONS 1024       // at most 64G of slabs
+#define BM_BYTES(n) (((n) + 7) / 8)       // size of the constructed state bitmap for `n` buffers
+#define OBJC_PARTIAL_BINS 8               // occupancy bins of the partial slabs for `OBJC_SLAB_DENSE`
+#define OBJC_HASH_MIN_BUCKETS 512         // initial size of the off-slab hash table
+#define OBJC_IDX_NONE UINT32_MAX          // end of an index free list
+#define ALIGN_UP(n, a) (((n) + (a) - 1) & ~((size_t)(a) - 1)) // `a` must be a power of two
+#define GET_SLABBASE(cache, ptr) ((void *)((uintptr_t)(ptr) & ~((uintptr_t)(cache)->slab_size - 1)))
+#define OBJC_MALLOC_ORDER 4               // all `objc_malloc` size classes use 64K slabs
+#define OBJC_MALLOC_MAX 4096              // largest size class, larger blocks come from libc
+#define OBJC_MALLOC_CLASSES 17            // 8, 16, 32, then 2^k and 1.5 * 2^k up to `OBJC_MALLOC_MAX`
+#define OBJC_MALLOC_MAGSIZE 32            // magazine size of the size class caches
+
+/*Statistics counters compile to nothing without `OBJC_STATS`. `STAT_INC`/`STAT_ADD` update a counter of the cache
+ * under one of its locks and `STAT_TINC` a counter of the calling thread's tcache that other threads only read.*/
+#ifdef OBJC_STATS
+#define STAT_ADD(cache, field, n) ((cache)->stats.field += (n))
+#define STAT_TINC(counter)                                                                                       \
+  atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + 1, memory_order_relaxed)
+#else
+#define STAT_ADD(cache, field, n) ((void)0)
+#define STAT_TINC(counter) ((void)0)
+#endif
+#define STAT_INC(cache, field) STAT_ADD(cache, field, 1)
+
+#define OBJC_CACHE_NOTRACE (1u << 31) // internal caches, left out of allocation traces
+#define OBJC_CACHE_ONSLAB (1u << 30)  // keep the slabctl in the slab even for large objects
+#define OBJC_CACHE_COMPACT (1u << 29) // always the index free list layout, for persistent caches
+
+/*Allocation trace file: a header describing the traced caches followed, at `rec_offset`, by a ring of
+ * `capacity` records. Record `i` of the trace is at `i % capacity` and the ring holds the records from
+ * `head - capacity` (or 0) to `head`.*/
+#define OBJC_TRACE_MAGIC 0x3143525443424a4fULL // "OBJCTRC1"
+#define OBJC_TRACE_VERSION 1
+#define OBJC_TRACE_MAX_CACHES 256
+
+enum { OBJC_TRACE_ALLOC = 1, OBJC_TRACE_FREE = 2 };
+
+typedef struct objc_trace_rec {
+  uint64_t obj;   // address of the object, identifies it while it is allocated
+  uint32_t delta; // ns since the previous record of the same thread
+  uint16_t cache; // index + 1 of the cache in the header
+  uint8_t op;     // OBJC_TRACE_ALLOC or OBJC_TRACE_FREE
+  uint8_t thread; // recording thread, numbered from 1 in the order of their first record
+} objc_trace_rec_t;
+
+typedef struct objc_trace_cache {
+  uint64_t size;
+  uint32_t align;
+  uint32_t flags;
+  char name[48];
+} objc_trace_cache_t;
+
+typedef struct objc_trace_hdr {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t rec_size;
+  uint64_t rec_offset;
+  uint64_t capacity;
+  _Atomic uint64_t head; // number of records written since the start of the trace
+  uint32_t ncaches;
+  uint32_t pad;
+  objc_trace_cache_t caches[OBJC_TRACE_MAX_CACHES];
+} objc_trace_hdr_t;
+
+extern atomic_int trace_active;
+
+/*Records `op` on `obj` if a trace is being recorded.*/
+#define TRACE(cache, op, obj)                                                                                    \
+  do {                                                                                                           \
+    if (atomic_load_explicit(&trace_active, memory_order_relaxed))                                              \
+      trace_record(cache, op, obj);                                                                              \
+  } while (0)
+
+extern __thread int64_t profile_countdown;
+
+/*Bytes a thread allocates before its next sample. Most allocations only pay the decrement, `profile_sample`
+ * decides whether the profiler is running and draws the next countdown.*/
+#define PROFILE_ALLOC(cache, obj)                                                                                \
+  do {                                                                                                           \
+    if (__builtin_expect((profile_countdown -= (cache)->size) < 0, 0))                                           \
+      profile_sample(cache, obj);                                                                                \
+  } while (0)
+
+/*Only caches with sampled objects in use look the freed object up.*/
+#define PROFILE_FREE(cache, obj)                                                                                 \
+  do {                                                                                                           \
+    if (atomic_load_explicit(&(cache)->prof_live, memory_order_relaxed))                                        \
+      profile_free(cache, obj);                                                                                  \
+  } while (0)
 
 typedef struct objc_bufctl {
   void *next;
@@ -16,24 +109,215 @@ typedef struct objc_bufctl {
 
 typedef struct objc_slabctl {
   int ref_count;
+  uint32_t free_idx;      // head of the index free list of off-slab and compact caches
   objc_bufctl_t *freebuf; // pointer to the bufctl
-  uint8_t *bm_const;      // pointer to the bitmap to track constructed state
-  struct objc_slabctl *next;
+  uint8_t *bm_const;      // pointer to the bitmap to track constructed state, stored in the slab
+  unsigned int color;     // offset of the first buffer from the slab base
+  struct objc_slabctl *next; // next slab in the full/partial/free list
   struct objc_slabctl *prev;
+  /*Remote free list, pushed to without the cache lock. Its head is a bufctl or, for caches with an index free
+   * list, the index of the buffer + 1. 0 if the list is empty. The objects on it still count in `ref_count`.*/
+  _Atomic uintptr_t remote;
+  struct objc_slabctl *remote_next; // next slab in the cache's `remote_pending` stack
+  struct objc_cache *cache;         // cache owning the slab
 } objc_slabctl_t;
 
+/*objcache.hpp lays out slabs at compile time with this size.*/
+_Static_assert(sizeof(objc_slabctl_t) == OBJC_SLABCTL_SIZE, "update OBJC_SLABCTL_SIZE in objcache.h");
+
+/*Slab control of a large object cache. It lives outside of the slab, is allocated from the cache's
+ * `slabctl_cache` and is found through the cache's hash table. It is followed by the constructed state bitmap
+ * and the index free list where `idx_list[i]` is the index of the free buffer after buffer `i`.*/
+typedef struct objc_offslab {
+  objc_slabctl_t ctl;
+  char *base;                 // base address of the slab
+  struct objc_offslab *hnext; // next slabctl in the hash chain
+} objc_offslab_t;
+
+/*A magazine is a fixed capacity stack of constructed objects (Bonwick & Adams, "Magazines and Vmem").
+ * `rounds` is the number of objects currently loaded into the magazine.*/
+typedef struct objc_magazine {
+  struct objc_magazine *next; // link in the depot's full/empty list
+  int rounds;
+  void *objs[];
+} objc_magazine_t;
+
+/*Per-thread magazine pair of a cache. It plays the role of the per-CPU cache of the paper. Only the
+ * owning thread touches `loaded` and `previous` so no locking is needed on a magazine hit.*/
+typedef struct objc_tcache {
+  objc_cache_t *cache;
+  objc_magazine_t *loaded;
+  objc_magazine_t *previous;
+  struct objc_tcache *next; // list of all tcaches of the cache, protected by `depot_lock`
+  struct objc_tcache *prev;
+  _Atomic uint64_t allocs;  // magazine hits of the thread, only written by the thread
+  _Atomic uint64_t frees;
+} objc_tcache_t;
+
+/*Persistent cache files*/
+#define OBJC_PCACHE_MAGIC 0x6f626a6370636830ULL // "objcpch0"
+#define OBJC_PCACHE_VERSION 1
+
+typedef struct objc_phdr objc_phdr_t;
+
 typedef struct objc_cache {
   char *name;
   size_t size;
   int align;
   constructor c;
   destructor d;
-  void *free_slab;            // pointer to the start of the slab
-  unsigned short buffer_size; // size of obj + bufctl
-  unsigned short total_buf;   // total number of buffers that fits in a slab
-  size_t slabctl_offset;      // offset where slabctl lives inside the page
-  unsigned short unused;      // unused bytes
-  unsigned short slab_count;  // number of slabs created in the cache
+  void *proto;                // constructed image stamped into every buffer of a new slab, NULL without one
+  objc_move_fn move;          // relocation callback of movable caches, NULL otherwise
+  void *move_arg;
+  objc_slabctl_t *slabs_full;                        // slabs with all buffers allocated
+  objc_slabctl_t *slabs_partial[OBJC_PARTIAL_BINS]; // slabs with some buffers allocated
+  objc_slabctl_t *slabs_free;                        // slabs with all buffers free
+  unsigned int partial_mask;                         // bit `i` is set if `slabs_partial[i]` is not empty
+  objc_slab_policy_t policy;                         // how the partial slab to allocate from is picked
+  unsigned int flags;         // OBJC_CACHE_* flags given at creation
+  unsigned int buffer_size;   // size of obj + bufctl, rounded up to `align`
+  unsigned int bufctl_offset; // offset of the bufctl from the start of the buffer
+  unsigned int total_buf;     // total number of buffers that fits in a slab
+  int slab_order;             // slab is `PAGE_SIZE << slab_order` bytes
+  size_t slab_size;           // size of a slab, a power of two between 4K and 2M
+  size_t slabctl_offset;      // offset where slabctl lives inside the slab
+  size_t bm_offset;           // offset where the constructed state bitmap lives inside the slab
+  unsigned int unused;        // unused bytes
+  unsigned int color_next;    // color of the next slab
+  unsigned int color_max;     // largest color, the unused bytes rounded down to `color_step`
+  unsigned int color_step;    // a cache line or `align` if larger
+  unsigned int slab_count;    // number of slabs created in the cache
+  unsigned int free_slabs;    // number of slabs on `slabs_free`
+  unsigned int free_min;      // lowest `free_slabs` since the reaper last trimmed the cache
+  unsigned int reserve_slabs; // free slabs the reaper keeps, set by `objc_cache_reserve`
+  pthread_mutex_t lock;       // protects the slab layer
+  objc_slabctl_t *_Atomic remote_pending; // slabs with a non-empty remote free list
+
+  /*Index free list, used by large objects and by small objects packed without a bufctl*/
+  int idx_size;                // size of an entry of the index free list: 1, 2 or 4 bytes, 0 if bufctls are used
+  ptrdiff_t idx_offset;        // offset of the index free list from the slabctl
+
+  /*Large objects (OBJC_CACHE_OFFSLAB)*/
+  objc_cache_t *slabctl_cache; // cache of the off-slab `objc_offslab_t`
+  objc_offslab_t **htab;       // hash table from slab base to slabctl
+  size_t hbuckets;             // number of buckets, a power of two
+  size_t hcount;               // number of slabctls in the hash table
+
+  /*Persistent caches (`objc_cache_open`)*/
+  objc_phdr_t *phdr;           // header of the mapped file, NULL if the slabs come from the page arena
+  size_t pmap_size;            // size of the mapping
+  size_t pslot_hint;           // first slot that may be free
+
+  /*Magazine layer*/
+  int mag_size;                  // capacity of a magazine, 0 disables the magazine layer
+  pthread_key_t tkey;            // key for the per-thread `objc_tcache_t`
+  pthread_mutex_t depot_lock;    // protects the depot lists and `tcaches`
+  objc_magazine_t *depot_full;   // magazines with `mag_size` rounds
+  objc_magazine_t *depot_empty;  // magazines with 0 rounds
+  objc_tcache_t *tcaches;        // all tcaches created for the cache
+
+  /*Statistics. The slab layer counters are protected by `lock`. `mag_allocs` and `mag_frees` hold the magazine
+   * hits of the threads that exited and are protected by `depot_lock`. The other fields are unused.*/
+  objc_cache_stats_t stats;
+  struct objc_cache *reg_next; // list of all live caches, protected by the registry lock
+  struct objc_cache *reg_prev;
+  int reg_pins;                // walks of `registry_foreach_unlocked` on the cache, protected by the registry lock
+  _Atomic uint16_t trace_id;   // id of the cache in the active trace, 0 if it isn't traced
+  _Atomic uint32_t prof_live;  // sampled objects of the cache in use, protected by the profiler lock
 } objc_cache_t;
 
+int getobj_idx(objc_cache_t *cache, objc_slabctl_t *slabctl, void *obj);
+uint8_t *bm_create(objc_cache_t *cache, void *slab);
+void bm_set(uint8_t *bm_const, int idx);
+void bm_clear(uint8_t *bm_const, int idx);
+int bm_get(uint8_t *bm_const, int idx);
+
+void *arena_alloc(int order);
+void arena_free(void *p, int order);
+void *arena_alloc_huge(void);
+int arena_contains(void *p);
+
+int offslab_init(objc_cache_t *cache);
+void offslab_destroy(objc_cache_t *cache);
+void offslab_insert(objc_cache_t *cache, objc_offslab_t *ctl);
+void offslab_remove(objc_cache_t *cache, objc_offslab_t *ctl);
+objc_slabctl_t *offslab_lookup(objc_cache_t *cache, void *slab);
+
+/*Returns the slabctl of the slab starting at `slab`.*/
+static inline objc_slabctl_t *slab_ctl(objc_cache_t *cache, void *slab) {
+  if (cache->flags & OBJC_CACHE_OFFSLAB)
+    return offslab_lookup(cache, slab);
+  return GET_SLABCTL(cache, slab);
+}
+
+/*Returns the base address of the slab controlled by `slabctl`.*/
+static inline char *slab_base(objc_cache_t *cache, objc_slabctl_t *slabctl) {
+  if (cache->flags & OBJC_CACHE_OFFSLAB)
+    return ((objc_offslab_t *)slabctl)->base;
+  return GET_SLABBASE(cache, slabctl);
+}
+
+/*Returns the address of the first buffer of the slab controlled by `slabctl`.*/
+static inline char *slab_bufs(objc_cache_t *cache, objc_slabctl_t *slabctl) {
+  return slab_base(cache, slabctl) + slabctl->color;
+}
+
+/*Index free lists store the index of the next free buffer in entries of `cache->idx_size` bytes. The largest
+ * value of an entry marks the end of the list.*/
+static inline uint32_t idx_get(objc_cache_t *cache, void *idx_list, uint32_t i) {
+  switch (cache->idx_size) {
+  case 1:
+    return ((uint8_t *)idx_list)[i] == UINT8_MAX ? OBJC_IDX_NONE : ((uint8_t *)idx_list)[i];
+  case 2:
+    return ((uint16_t *)idx_list)[i] == UINT16_MAX ? OBJC_IDX_NONE : ((uint16_t *)idx_list)[i];
+  default:
+    return ((uint32_t *)idx_list)[i];
+  }
+}
+
+static inline void idx_set(objc_cache_t *cache, void *idx_list, uint32_t i, uint32_t next) {
+  switch (cache->idx_size) {
+  case 1:
+    ((uint8_t *)idx_list)[i] = (uint8_t)next;
+    break;
+  case 2:
+    ((uint16_t *)idx_list)[i] = (uint16_t)next;
+    break;
+  default:
+    ((uint32_t *)idx_list)[i] = next;
+  }
+}
+
+void *slab_alloc(objc_cache_t *cache);
+void slab_free(objc_cache_t *cache, void *obj);
+size_t cache_trim(objc_cache_t *cache);
+void remote_drain(objc_cache_t *cache);
+void slab_free_map(objc_cache_t *cache, objc_slabctl_t *slabctl, uint8_t *free_map);
+
+void registry_add(objc_cache_t *cache);
+void registry_del(objc_cache_t *cache);
+void registry_foreach(void (*fn)(objc_cache_t *cache));
+void registry_foreach_unlocked(void (*fn)(objc_cache_t *cache, void *arg), void *arg);
+
+void trace_register(objc_cache_t *cache);
+void trace_record(objc_cache_t *cache, int op, void *obj);
+
+void profile_sample(objc_cache_t *cache, void *obj);
+void profile_free(objc_cache_t *cache, void *obj);
+void profile_move(objc_cache_t *cache, void *old_obj, void *new_obj);
+void profile_forget(objc_cache_t *cache);
+
+int mag_init(objc_cache_t *cache);
+void *mag_alloc(objc_cache_t *cache);
+int mag_free(objc_cache_t *cache, void *obj);
+void mag_purge(objc_cache_t *cache);
+void mag_destroy(objc_cache_t *cache);
+void mag_flush(objc_cache_t *cache);
+
+int pfile_open(objc_cache_t *cache, const char *path, size_t max_size);
+void pfile_close(objc_cache_t *cache);
+void *pfile_slab_alloc(objc_cache_t *cache);
+void pfile_slab_free(objc_cache_t *cache, void *slab);
+void pfile_foreach(objc_cache_t *cache, void (*fn)(objc_cache_t *cache, void *slab));
+
 #endif // !OBJC_INTERNAL_H
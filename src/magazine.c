@@ -0,0 +1,228 @@
+#include "objc_internal.h"
+#include "objcache.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+/*Magazine layer as described in Bonwick & Adams' follow-up paper "Magazines and Vmem". Every thread owns a
+ * `loaded` and a `previous` magazine per cache. Allocation and free are plain pops/pushes on these magazines
+ * and only the exchange of magazines with the per-cache depot takes a lock. The slab layer is only reached
+ * when both the thread's magazines and the depot miss.*/
+
+static objc_magazine_t *mag_create(objc_cache_t *cache) {
+  objc_magazine_t *mag = (objc_magazine_t *)malloc(sizeof(*mag) + cache->mag_size * sizeof(void *));
+  if (!mag)
+    return NULL;
+  mag->next = NULL;
+  mag->rounds = 0;
+  return mag;
+}
+
+/*Returns all the rounds of the magazine to the slab layer.*/
+static void mag_drain(objc_cache_t *cache, objc_magazine_t *mag) {
+  while (mag->rounds > 0)
+    slab_free(cache, mag->objs[--mag->rounds]);
+}
+
+/*Runs on thread exit. Whatever the thread still holds goes back to the slab layer and its magazines are
+ * returned to the depot as empty magazines.*/
+static void tcache_exit(void *arg) {
+  objc_tcache_t *tc = (objc_tcache_t *)arg;
+  objc_cache_t *cache = tc->cache;
+
+  mag_drain(cache, tc->loaded);
+  mag_drain(cache, tc->previous);
+
+  pthread_mutex_lock(&cache->depot_lock);
+#ifdef OBJC_STATS
+  cache->stats.mag_allocs += tc->allocs;
+  cache->stats.mag_frees += tc->frees;
+#endif
+  tc->loaded->next = tc->previous;
+  tc->previous->next = cache->depot_empty;
+  cache->depot_empty = tc->loaded;
+
+  if (tc->prev)
+    tc->prev->next = tc->next;
+  else
+    cache->tcaches = tc->next;
+  if (tc->next)
+    tc->next->prev = tc->prev;
+  pthread_mutex_unlock(&cache->depot_lock);
+
+  free(tc);
+}
+
+/*Get the calling thread's tcache, creating it on the first use of the cache by the thread.*/
+static objc_tcache_t *get_tcache(objc_cache_t *cache) {
+  objc_tcache_t *tc = (objc_tcache_t *)pthread_getspecific(cache->tkey);
+  if (tc)
+    return tc;
+
+  tc = (objc_tcache_t *)malloc(sizeof(*tc));
+  if (!tc)
+    return NULL;
+  tc->cache = cache;
+  atomic_init(&tc->allocs, 0);
+  atomic_init(&tc->frees, 0);
+  tc->loaded = mag_create(cache);
+  tc->previous = mag_create(cache);
+  if (!tc->loaded || !tc->previous || pthread_setspecific(cache->tkey, tc) != 0) {
+    free(tc->loaded);
+    free(tc->previous);
+    free(tc);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&cache->depot_lock);
+  tc->prev = NULL;
+  tc->next = cache->tcaches;
+  if (cache->tcaches)
+    cache->tcaches->prev = tc;
+  cache->tcaches = tc;
+  pthread_mutex_unlock(&cache->depot_lock);
+
+  return tc;
+}
+
+int mag_init(objc_cache_t *cache) { return pthread_key_create(&cache->tkey, tcache_exit) == 0 ? 0 : -1; }
+
+/*Returns a constructed object from the thread's magazines or NULL if both the magazines and the depot are
+ * out of rounds.*/
+void *mag_alloc(objc_cache_t *cache) {
+  objc_tcache_t *tc = get_tcache(cache);
+  if (!tc)
+    return NULL;
+
+  if (tc->loaded->rounds > 0) {
+    STAT_TINC(tc->allocs);
+    return tc->loaded->objs[--tc->loaded->rounds];
+  }
+
+  /*`loaded` is empty. If `previous` has rounds then swap them and allocate from the new `loaded`.*/
+  if (tc->previous->rounds > 0) {
+    objc_magazine_t *tmp = tc->loaded;
+    tc->loaded = tc->previous;
+    tc->previous = tmp;
+    STAT_TINC(tc->allocs);
+    return tc->loaded->objs[--tc->loaded->rounds];
+  }
+
+  /*Both magazines are empty. Exchange the `previous` empty magazine for a full one from the depot.*/
+  pthread_mutex_lock(&cache->depot_lock);
+  objc_magazine_t *full = cache->depot_full;
+  if (!full) {
+    pthread_mutex_unlock(&cache->depot_lock);
+    return NULL;
+  }
+  cache->depot_full = full->next;
+  tc->previous->next = cache->depot_empty;
+  cache->depot_empty = tc->previous;
+  pthread_mutex_unlock(&cache->depot_lock);
+
+  tc->previous = tc->loaded;
+  tc->loaded = full;
+  STAT_TINC(tc->allocs);
+  return tc->loaded->objs[--tc->loaded->rounds];
+}
+
+/*Puts the object in the thread's magazines. Returns -1 if the object couldn't be cached and has to be
+ * returned to the slab layer instead.*/
+int mag_free(objc_cache_t *cache, void *obj) {
+  objc_tcache_t *tc = get_tcache(cache);
+  if (!tc)
+    return -1;
+
+  if (tc->loaded->rounds < cache->mag_size) {
+    tc->loaded->objs[tc->loaded->rounds++] = obj;
+    STAT_TINC(tc->frees);
+    return 0;
+  }
+
+  /*`loaded` is full. If `previous` is empty then swap them and free into the new `loaded`.*/
+  if (tc->previous->rounds == 0) {
+    objc_magazine_t *tmp = tc->loaded;
+    tc->loaded = tc->previous;
+    tc->previous = tmp;
+    tc->loaded->objs[tc->loaded->rounds++] = obj;
+    STAT_TINC(tc->frees);
+    return 0;
+  }
+
+  /*Both magazines are full. Exchange the `previous` full magazine for an empty one from the depot. If the
+   * depot doesn't have any empty magazine then a new one is created.*/
+  pthread_mutex_lock(&cache->depot_lock);
+  objc_magazine_t *empty = cache->depot_empty;
+  if (empty) {
+    cache->depot_empty = empty->next;
+  } else {
+    empty = mag_create(cache);
+    if (!empty) {
+      pthread_mutex_unlock(&cache->depot_lock);
+      return -1;
+    }
+  }
+  tc->previous->next = cache->depot_full;
+  cache->depot_full = tc->previous;
+  pthread_mutex_unlock(&cache->depot_lock);
+
+  tc->previous = tc->loaded;
+  tc->loaded = empty;
+  tc->loaded->objs[tc->loaded->rounds++] = obj;
+  STAT_TINC(tc->frees);
+  return 0;
+}
+
+/*Empties the depot. The rounds of the full magazines are returned to the slab layer and all magazines of the
+ * depot are freed. Magazines loaded in the threads are left untouched.*/
+void mag_purge(objc_cache_t *cache) {
+  pthread_mutex_lock(&cache->depot_lock);
+  objc_magazine_t *full = cache->depot_full;
+  objc_magazine_t *empty = cache->depot_empty;
+  cache->depot_full = cache->depot_empty = NULL;
+  pthread_mutex_unlock(&cache->depot_lock);
+
+  while (full) {
+    objc_magazine_t *next = full->next;
+    mag_drain(cache, full);
+    free(full);
+    full = next;
+  }
+  while (empty) {
+    objc_magazine_t *next = empty->next;
+    free(empty);
+    empty = next;
+  }
+}
+
+/*Returns the rounds of the depot and of every thread to the slab layer. Only safe once no thread uses the cache.*/
+void mag_flush(objc_cache_t *cache) {
+  mag_purge(cache);
+  for (objc_tcache_t *tc = cache->tcaches; tc; tc = tc->next) {
+    mag_drain(cache, tc->loaded);
+    mag_drain(cache, tc->previous);
+  }
+}
+
+/*Frees every magazine and tcache of the cache. The rounds are not returned to the slab layer since all slabs
+ * are about to be released.*/
+void mag_destroy(objc_cache_t *cache) {
+  objc_magazine_t *lists[] = {cache->depot_full, cache->depot_empty};
+  for (int i = 0; i < 2; i++) {
+    objc_magazine_t *mag = lists[i];
+    while (mag) {
+      objc_magazine_t *next = mag->next;
+      free(mag);
+      mag = next;
+    }
+  }
+
+  objc_tcache_t *tc = cache->tcaches;
+  while (tc) {
+    objc_tcache_t *next = tc->next;
+    free(tc->loaded);
+    free(tc->previous);
+    free(tc);
+    tc = next;
+  }
+  pthread_key_delete(cache->tkey);
+}
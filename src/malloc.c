@@ -0,0 +1,123 @@
+#include "objc_internal.h"
+#include "objcache.h"
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/*kmalloc-style general purpose allocator over size class caches. Every size class cache uses slabs of the same
+ * order and keeps its slabctl in the slab, where it always ends the slab. The slabctl of any block, and through
+ * it the cache, is then found by masking the address of the block. Blocks larger than the largest class come
+ * from libc and are told apart by not being in the page arena.*/
+
+#define MALLOC_SLAB_SIZE ((size_t)PAGE_SIZE << OBJC_MALLOC_ORDER)
+#define MALLOC_SLABCTL(ptr)                                                                                      \
+  ((objc_slabctl_t *)(((uintptr_t)(ptr) & ~(MALLOC_SLAB_SIZE - 1)) + MALLOC_SLAB_SIZE - sizeof(objc_slabctl_t)))
+
+static const unsigned int class_sizes[OBJC_MALLOC_CLASSES] = {8,   16,  32,   48,   64,   96,   128,  192, 256,
+                                                             384, 512, 768, 1024, 1536, 2048, 3072, 4096};
+
+static objc_cache_t *_Atomic classes[OBJC_MALLOC_CLASSES];
+static char class_names[OBJC_MALLOC_CLASSES][24];
+static pthread_mutex_t classes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*Returns the index of the smallest class holding `size` bytes, `size` must be at most `OBJC_MALLOC_MAX`.*/
+static inline int size_class(size_t size) {
+  if (size <= 8)
+    return 0;
+  /*`size` is in (2^k, 2^(k+1)].*/
+  int k = 63 - __builtin_clzll(size - 1);
+  if (k < 5)
+    return k - 2;
+  return 2 * (k - 5) + 3 + (size > ((size_t)3 << (k - 1)));
+}
+
+/*Returns the cache of the class `i`, creating it on first use.*/
+static objc_cache_t *class_cache(int i) {
+  objc_cache_t *cache = atomic_load_explicit(&classes[i], memory_order_acquire);
+  if (cache)
+    return cache;
+  pthread_mutex_lock(&classes_lock);
+  cache = atomic_load_explicit(&classes[i], memory_order_relaxed);
+  if (!cache) {
+    unsigned int size = class_sizes[i];
+    snprintf(class_names[i], sizeof(class_names[i]), "objc_malloc_%u", size);
+    cache = objc_cache_create_ex(class_names[i], size, size < 16 ? size : 16, NULL, NULL,
+                                 OBJC_CACHE_ORDER(OBJC_MALLOC_ORDER) | OBJC_CACHE_ONSLAB);
+    if (cache) {
+      objc_cache_set_magsize(cache, OBJC_MALLOC_MAGSIZE);
+      atomic_store_explicit(&classes[i], cache, memory_order_release);
+    }
+  }
+  pthread_mutex_unlock(&classes_lock);
+  return cache;
+}
+
+void *objc_malloc(size_t size) {
+  if (size > OBJC_MALLOC_MAX)
+    return malloc(size);
+  objc_cache_t *cache = class_cache(size_class(size));
+  return cache ? objc_cache_alloc(cache) : NULL;
+}
+
+void *objc_calloc(size_t n, size_t size) {
+  if (size && n > SIZE_MAX / size)
+    return NULL;
+  if (n * size > OBJC_MALLOC_MAX)
+    return calloc(n, size);
+  /*Blocks of a class are recycled without being cleared.*/
+  void *ptr = objc_malloc(n * size);
+  if (ptr)
+    memset(ptr, 0, n * size);
+  return ptr;
+}
+
+void objc_free_ptr(void *ptr) {
+  if (!ptr)
+    return;
+  if (!arena_contains(ptr)) {
+    free(ptr);
+    return;
+  }
+  objc_free(MALLOC_SLABCTL(ptr)->cache, ptr);
+}
+
+void objc_free_sized(void *ptr, size_t size) {
+  if (!ptr)
+    return;
+  if (size > OBJC_MALLOC_MAX) {
+    free(ptr);
+    return;
+  }
+  objc_free(atomic_load_explicit(&classes[size_class(size)], memory_order_relaxed), ptr);
+}
+
+size_t objc_malloc_usable_size(void *ptr) {
+  if (!ptr)
+    return 0;
+  if (!arena_contains(ptr))
+    return malloc_usable_size(ptr);
+  return MALLOC_SLABCTL(ptr)->cache->size;
+}
+
+void *objc_realloc(void *ptr, size_t size) {
+  if (!ptr)
+    return objc_malloc(size);
+  if (!size) {
+    objc_free_ptr(ptr);
+    return NULL;
+  }
+  int owned = arena_contains(ptr);
+  if (!owned && size > OBJC_MALLOC_MAX)
+    return realloc(ptr, size);
+  size_t old_size = owned ? MALLOC_SLABCTL(ptr)->cache->size : malloc_usable_size(ptr);
+  /*The block stays where it is as long as it keeps its class.*/
+  if (owned && size <= OBJC_MALLOC_MAX && class_sizes[size_class(size)] == old_size)
+    return ptr;
+  void *new_ptr = objc_malloc(size);
+  if (!new_ptr)
+    return NULL;
+  memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+  objc_free_ptr(ptr);
+  return new_ptr;
+}
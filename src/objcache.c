@@ -1,21 +1,26 @@
 #include "objcache.h"
 #include "objc_internal.h"
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 
-int getobj_idx(objc_cache_t *cache, void *obj) {
-  void *slab_base = GET_SLABBASE(obj);
-  ptrdiff_t offset = obj - slab_base;
+int getobj_idx(objc_cache_t *cache, objc_slabctl_t *slabctl, void *obj) {
+  /*Buffers start after the color offset of the slab.*/
+  char *first_buf = slab_bufs(cache, slabctl);
+  ptrdiff_t offset = (char *)obj - first_buf;
   int index = offset / cache->buffer_size;
   return index;
 }
 
-uint8_t *bm_create(objc_cache_t *cache) {
-  int n = (cache->total_buf + 7) / 8;
-  uint8_t *bm_const = (uint8_t *)calloc(n, 1);
-  if (!bm_const)
-    return NULL;
+/*The bitmap lives in the slab itself, right before the slabctl (or its index free list), so no separate
+ * allocation is needed.*/
+uint8_t *bm_create(objc_cache_t *cache, void *slab) {
+  uint8_t *bm_const = (uint8_t *)slab + cache->bm_offset;
+  memset(bm_const, 0, BM_BYTES(cache->total_buf));
   return bm_const;
 }
 
@@ -37,143 +42,415 @@ int bm_get(uint8_t *bm_const, int idx) {
   return (bm_const[byte_index] >> bit_offset) & 1;
 }
 
-/*New slab has to be created in two cases:
- * i. When an object is being allocated for the first time. In this case, `cache->freeslab` is NULL since
- * slab doesn't exist yet.
- * ii. When the previous slab is empty i.e. all buffers are allocated of the slab. In this case, a new slab
- * is created and a circular doubly linked list of a previous slabs is maintained.
+/*Returns the list a slab with `ref_count` allocated buffers belongs to. Slabs with every buffer allocated are
+ * kept in `slabs_full`, slabs with every buffer free in `slabs_free` and the rest in one of the partial bins.
+ * With `OBJC_SLAB_DENSE` the partial bin is picked by the occupancy of the slab so that the most allocated
+ * slabs can be found in O(1). Otherwise all partial slabs share bin 0.*/
+static inline objc_slabctl_t **slab_list(objc_cache_t *cache, int ref_count) {
+  if (ref_count == 0)
+    return &cache->slabs_free;
+  if (ref_count == cache->total_buf)
+    return &cache->slabs_full;
+  if (cache->policy == OBJC_SLAB_DENSE)
+    return &cache->slabs_partial[ref_count * OBJC_PARTIAL_BINS / cache->total_buf];
+  return &cache->slabs_partial[0];
+}
+
+/*Updates the bit of a partial bin in `partial_mask` if `list` is one of the partial bins.*/
+static inline void partial_mask_update(objc_cache_t *cache, objc_slabctl_t **list) {
+  ptrdiff_t bin = list - cache->slabs_partial;
+  if (bin < 0 || bin >= OBJC_PARTIAL_BINS)
+    return;
+  if (*list)
+    cache->partial_mask |= 1u << bin;
+  else
+    cache->partial_mask &= ~(1u << bin);
+}
+
+/*Pushes the slab at the head of the list.*/
+static inline void slab_list_add(objc_cache_t *cache, objc_slabctl_t **list, objc_slabctl_t *slabctl) {
+  slabctl->prev = NULL;
+  slabctl->next = *list;
+  if (*list)
+    (*list)->prev = slabctl;
+  *list = slabctl;
+  if (list == &cache->slabs_free)
+    cache->free_slabs++;
+  partial_mask_update(cache, list);
+}
+
+static inline void slab_list_del(objc_cache_t *cache, objc_slabctl_t **list, objc_slabctl_t *slabctl) {
+  if (slabctl->prev)
+    slabctl->prev->next = slabctl->next;
+  else
+    *list = slabctl->next;
+  if (slabctl->next)
+    slabctl->next->prev = slabctl->prev;
+  if (list == &cache->slabs_free && --cache->free_slabs < cache->free_min)
+    cache->free_min = cache->free_slabs;
+  partial_mask_update(cache, list);
+}
+
+/*Moves the slab to the list matching its current `ref_count` if it differs from the list of `old_ref_count`.*/
+static inline void slab_relink(objc_cache_t *cache, objc_slabctl_t *slabctl, int old_ref_count) {
+  objc_slabctl_t **from = slab_list(cache, old_ref_count);
+  objc_slabctl_t **to = slab_list(cache, slabctl->ref_count);
+  if (from == to)
+    return;
+  slab_list_del(cache, from, slabctl);
+  slab_list_add(cache, to, slabctl);
+}
+
+/*Chains all buffers of a new slab through its index free list.*/
+static void idx_chain(objc_cache_t *cache, objc_slabctl_t *slabctl) {
+  void *idx_list = (char *)slabctl + cache->idx_offset;
+  for (uint32_t i = 0; i < cache->total_buf; i++)
+    idx_set(cache, idx_list, i, i + 1 < cache->total_buf ? i + 1 : OBJC_IDX_NONE);
+  slabctl->free_idx = 0;
+  slabctl->freebuf = NULL;
+}
+
+/*Stamps the prototype image into every buffer of a new slab starting at `start`. The image is copied into the first
+ * buffer, then the stamped part is copied onto the rest, doubling each time, so that the whole slab is covered by
+ * a handful of large memcpy calls running at full vector width. Padding and bufctls get copied too, the bufctls
+ * are chained afterwards.*/
+static void slab_stamp(objc_cache_t *cache, char *start) {
+  size_t total = (size_t)cache->total_buf * cache->buffer_size;
+  memcpy(start, cache->proto, cache->size);
+  for (size_t done = cache->buffer_size; done < total;) {
+    size_t n = done < total - done ? done : total - done;
+    memcpy(start + done, start, n);
+    done += n;
+  }
+}
+
+/*Gives the pages of a slab back to where they came from.*/
+static void slab_pages_free(objc_cache_t *cache, void *slab) {
+  if (cache->phdr)
+    pfile_slab_free(cache, slab);
+  else
+    arena_free(slab, cache->slab_order);
+}
+
+/*New slab has to be created when there is neither a partial nor a free slab left in the cache, which is
+ * also the case for the very first allocation.
  *
- * This function allocates `PAGE_SIZE` sized buffer and initializes all of the members of the struct type
- * `objc_slabctl_t`.*/
+ * This function takes a `slab_size` sized buffer from the page arena, initializes all of the members of the struct type
+ * `objc_slabctl_t` and puts the slab in the free list.*/
 static void *create_new_slab(objc_cache_t *cache) {
-  void *slab;
-  /*Using posix_memalign for now to always align the slab in page sized units. Alignment is needed
-   * to calculate the base of the slab. This will be updated to use the `mmap` after I visit this syscall
-   * real soon!*/
-  int ch = posix_memalign(&slab, PAGE_SIZE, PAGE_SIZE);
-  if (ch != 0 || slab == NULL)
-    return NULL;
-  objc_slabctl_t *slabctl = GET_SLABCTL(cache, slab);
+  /*Slabs are carved out of the page arena which always returns memory aligned to the slab size. Alignment
+   * is needed to calculate the base of the slab.*/
+  void *slab = NULL;
+  if (cache->phdr) {
+    /*Persistent caches take their slabs from their file instead.*/
+    slab = pfile_slab_alloc(cache);
+    if (!slab)
+      return NULL;
+  } else if (cache->flags & OBJC_CACHE_HUGETLB) {
+    slab = arena_alloc_huge();
+  }
+  if (!slab) {
+    slab = arena_alloc(cache->slab_order);
+    if (!slab)
+      return NULL;
+    /*Ask for a transparent huge page. This is only a hint and the slab works either way.*/
+    if (cache->flags & (OBJC_CACHE_HUGEPAGE | OBJC_CACHE_HUGETLB))
+      madvise(slab, cache->slab_size, MADV_HUGEPAGE);
+  }
+  objc_slabctl_t *slabctl;
+  /*Slab coloring: the first buffer of every new slab is shifted by the next color, in cache line (or alignment)
+   * steps through the unused bytes of the slab, so that the same buffer of different slabs doesn't map to the same
+   * CPU cache sets.*/
+  unsigned int color = cache->color_next;
+  cache->color_next = color + cache->color_step > cache->color_max ? 0 : color + cache->color_step;
+  char *start = (char *)slab + color;
+  if (cache->proto)
+    slab_stamp(cache, start);
+
+  if (cache->flags & OBJC_CACHE_OFFSLAB) {
+    /*Large objects: the slabctl comes from the cache's slabctl cache and the buffers are chained through the
+     * index free list that follows it.*/
+    objc_offslab_t *ctl = objc_cache_alloc(cache->slabctl_cache);
+    if (!ctl) {
+      slab_pages_free(cache, slab);
+      return NULL;
+    }
+    ctl->base = slab;
+    slabctl = &ctl->ctl;
+    slabctl->bm_const = (uint8_t *)(ctl + 1);
+    memset(slabctl->bm_const, 0, BM_BYTES(cache->total_buf));
 
-  char *start = (char *)slab;
-  char *end = start + cache->total_buf * cache->buffer_size;
+    idx_chain(cache, slabctl);
+    offslab_insert(cache, ctl);
+  } else if (cache->idx_size) {
+    /*Small objects packed without a bufctl: the index free list sits right before the slabctl.*/
+    slabctl = GET_SLABCTL(cache, slab);
+    slabctl->bm_const = bm_create(cache, slab);
+    idx_chain(cache, slabctl);
+  } else {
+    slabctl = GET_SLABCTL(cache, slab);
+    char *end = start + cache->total_buf * cache->buffer_size;
 
-  /*Create a linked list of bufctl*/
-  for (char *p = start; p < end; p += cache->buffer_size) {
-    objc_bufctl_t *bufctl = (objc_bufctl_t *)(p + cache->size);
+    /*Create a linked list of bufctl*/
+    for (char *p = start; p < end; p += cache->buffer_size) {
+      objc_bufctl_t *bufctl = (objc_bufctl_t *)(p + cache->bufctl_offset);
 
-    char *next_bufctl = p + cache->buffer_size + cache->size;
+      char *next_bufctl = p + cache->buffer_size + cache->bufctl_offset;
 
-    if (next_bufctl >= end) {
-      bufctl->next = NULL;
-    } else {
-      bufctl->next = (objc_bufctl_t *)next_bufctl;
+      if (next_bufctl >= end) {
+        bufctl->next = NULL;
+      } else {
+        bufctl->next = (objc_bufctl_t *)next_bufctl;
+      }
     }
+    slabctl->freebuf = ((objc_bufctl_t *)(start + cache->bufctl_offset));
+    slabctl->free_idx = OBJC_IDX_NONE;
+    slabctl->bm_const = bm_create(cache, slab);
   }
 
   /* Initialize slab metadata */
   slabctl->ref_count = 0;
-  slabctl->freebuf = ((objc_bufctl_t *)(start + cache->size));
-  slabctl->bm_const = bm_create(cache);
-  if (!slabctl->bm_const)
-    return NULL;
+  slabctl->color = color;
+  slabctl->cache = cache;
+  /*Every buffer of a prototype cache holds a constructed object from the start.*/
+  if (cache->proto)
+    memset(slabctl->bm_const, 0xff, BM_BYTES(cache->total_buf));
+  atomic_init(&slabctl->remote, 0);
 
-  if (!cache->free_slab) {
-    /*Slab is being created first time. Both next and prev points to slabctl
-     * because only there is only one slab at this point.*/
-    slabctl->next = slabctl->prev = slabctl;
-  } else {
-    /* A new complete slab is being created when previous slab becomes empty
-    i.e. all buffers allocated (slabctl->freebuf is NULL)*/
-
-    /*Create a doubly linked list of the slabs.*/
-    objc_slabctl_t *prev_slabctl = GET_SLABCTL(cache, cache->free_slab);
-    slabctl->next = prev_slabctl->next;
-    slabctl->prev = prev_slabctl;
-    prev_slabctl->next = slabctl;
-    if (prev_slabctl->prev == prev_slabctl) {
-      /*For second slab*/
-      prev_slabctl->prev = slabctl;
-    } else {
-      /*From third slab and onwards*/
-      slabctl->next->prev = slabctl;
-    }
-  }
-  /*new slab becomes the current partial one*/
-  cache->free_slab = slab;
+  slab_list_add(cache, &cache->slabs_free, slabctl);
   cache->slab_count++;
+  STAT_INC(cache, slabs_created);
   return slab;
 }
 
-/*Go thorugh the slab doubly linked list and return slab base address if a partial slab is found.*/
-static inline void *find_partial_slab(objc_cache_t *cache, void *slab) {
-  objc_slabctl_t *start = GET_SLABCTL(cache, slab);
-  objc_slabctl_t *cur = start->next;
-  while (cur != start) {
-    if (cur->freebuf != NULL) {
-      /*If next slab in the list have free buffer then we return this slab base.*/
-      return GET_SLABBASE(cur);
+/*Splices the remote free lists of all slabs in `remote_pending` into their local free lists and fixes up
+ * `ref_count` and the slab list once per slab. Caller must hold the cache lock.*/
+void remote_drain(objc_cache_t *cache) {
+  objc_slabctl_t *slabctl = atomic_exchange_explicit(&cache->remote_pending, NULL, memory_order_acquire);
+  while (slabctl) {
+    /*Once its remote list is emptied the slab can be pushed again by another thread, which overwrites
+     * `remote_next`.*/
+    objc_slabctl_t *next = slabctl->remote_next;
+    uintptr_t head = atomic_exchange_explicit(&slabctl->remote, 0, memory_order_acq_rel);
+    int n = 1;
+    if (cache->idx_size) {
+      void *idx_list = (char *)slabctl + cache->idx_offset;
+      uint32_t last = head - 1;
+      for (uint32_t idx; (idx = idx_get(cache, idx_list, last)) != OBJC_IDX_NONE; n++)
+        last = idx;
+      idx_set(cache, idx_list, last, slabctl->free_idx);
+      slabctl->free_idx = head - 1;
+    } else {
+      objc_bufctl_t *last = (objc_bufctl_t *)head;
+      for (; last->next; n++)
+        last = last->next;
+      last->next = slabctl->freebuf;
+      slabctl->freebuf = (objc_bufctl_t *)head;
     }
-    cur = cur->next;
+    slabctl->ref_count -= n;
+    slab_relink(cache, slabctl, slabctl->ref_count + n);
+    STAT_ADD(cache, remote_frees, n);
+    STAT_ADD(cache, frees, n);
+    slabctl = next;
   }
-  return NULL;
 }
 
-/*Inserts the `v` slab after `u`.*/
-static inline void insert_slab_after(objc_slabctl_t *u, objc_slabctl_t *v) {
-  // unlink the slab
-  v->prev->next = v->next;
-  v->next->prev = v->prev;
-
-  // place the `v` slab after the `u` slab
-  v->next = u->next;
-  v->prev = u;
-  u->next->prev = v;
-  u->next = v;
+/*Counts `n` objects allocated from the slabs and keeps track of the peak. Caller must hold the cache lock.*/
+static inline void stat_alloc(objc_cache_t *cache, int n) {
+#ifdef OBJC_STATS
+  cache->stats.allocs += n;
+  if (cache->stats.allocs - cache->stats.frees > cache->stats.peak_inuse)
+    cache->stats.peak_inuse = cache->stats.allocs - cache->stats.frees;
+#endif
 }
 
-/*Checks if a new slab has to be created or not and updates the `freebuf` and `ref_count` members
- * of the struct `objc_slabctl_t` and returns the free object (buffer) `obj` where object can be allocated
- * by running the constructor function.*/
-static void *get_obj(objc_cache_t *cache) {
-
-  void *slab = cache->free_slab;
-
-  /*If `slab` is NULL then that means slab is not yet created for the cache. In this case, we directly
-   * create a new slab.*/
-  if (!slab) {
-    slab = create_new_slab(cache);
-    if (!slab)
-      return NULL;
+/*Returns the slab new objects are allocated from. A partial slab is preferred over a free slab so that the
+ * free slabs can be reclaimed. With `OBJC_SLAB_DENSE`, the partial slab from the most allocated bin is picked.
+ * A new slab is created only if there are no partial and free slabs.*/
+static inline objc_slabctl_t *find_alloc_slab(objc_cache_t *cache) {
+  /*Objects freed by other threads are taken back once the partial slabs run out, before touching a free slab.*/
+  if (!cache->partial_mask && atomic_load_explicit(&cache->remote_pending, memory_order_relaxed))
+    remote_drain(cache);
+  if (cache->partial_mask) {
+    int bin = 31 - __builtin_clz(cache->partial_mask);
+    STAT_INC(cache, partial_hits);
+    return cache->slabs_partial[bin];
   }
+  if (!cache->slabs_free && !create_new_slab(cache))
+    return NULL;
+  STAT_INC(cache, free_hits);
+  return cache->slabs_free;
+}
 
-  /* If `GET_SLABCTL(cache, slab)->freebuf` is null that means the current slab is empty (all buffers allocated). In
-   * this case, we first go through the slab list to check for a partially free slab i.e. `slabctl->freebuf != NULL`.
-   * If no partially free slab is found after one complete round through the circular linked list then we create a new
-   * slab. If partially free slab is found, then we update the slab pointer to this partially free slab.*/
-  if (!GET_SLABCTL(cache, slab)->freebuf) {
-    void *partial_slab = find_partial_slab(cache, slab);
-    slab = partial_slab ? partial_slab : create_new_slab(cache);
-    if (!slab)
-      return NULL;
+/*Pops the first free buffer of the slab and stores its index in `idxp`. `ref_count` and the slab list are left to
+ * the caller.*/
+static inline void *pop_buf(objc_cache_t *cache, objc_slabctl_t *slabctl, uint32_t *idxp) {
+  if (cache->idx_size) {
+    uint32_t idx = slabctl->free_idx;
+    slabctl->free_idx = idx_get(cache, (char *)slabctl + cache->idx_offset, idx);
+    *idxp = idx;
+    return slab_bufs(cache, slabctl) + idx * cache->buffer_size;
   }
-
-  objc_slabctl_t *slabctl = GET_SLABCTL(cache, slab);
-
   /*Get the current free bufctl*/
   objc_bufctl_t *cur_freebuf = slabctl->freebuf;
   /*Update freebuf to point to the next bufctl*/
   slabctl->freebuf = cur_freebuf->next;
 
-  void *obj = (void *)((char *)cur_freebuf - cache->size);
+  void *obj = (void *)((char *)cur_freebuf - cache->bufctl_offset);
+  *idxp = getobj_idx(cache, slabctl, obj);
+  return obj;
+}
 
+/*Pushes `obj` back on the free list of its slab. `ref_count` and the slab list are left to the caller.*/
+static inline void push_buf(objc_cache_t *cache, objc_slabctl_t *slabctl, void *obj) {
+  if (cache->idx_size) {
+    /*Push the index of the freed `obj` on the index free list*/
+    uint32_t idx = getobj_idx(cache, slabctl, obj);
+    idx_set(cache, (char *)slabctl + cache->idx_offset, idx, slabctl->free_idx);
+    slabctl->free_idx = idx;
+  } else {
+    /*Put the `bufctl` of the freed `obj` back in the free linked list*/
+    objc_bufctl_t *bufctl = (objc_bufctl_t *)((char *)obj + cache->bufctl_offset);
+    bufctl->next = slabctl->freebuf;
+    slabctl->freebuf = bufctl;
+  }
+}
+
+/*Takes the first free buffer of the allocation slab, updates the `ref_count` member of the struct
+ * `objc_slabctl_t` and moves the slab to its new list. Returns the free object (buffer) `obj` where object can
+ * be allocated by running the constructor function, its slab in `slabctlp` and its index in `idxp`.*/
+static void *get_obj(objc_cache_t *cache, objc_slabctl_t **slabctlp, uint32_t *idxp) {
+  objc_slabctl_t *slabctl = find_alloc_slab(cache);
+  if (!slabctl)
+    return NULL;
+
+  void *obj = pop_buf(cache, slabctl, idxp);
   slabctl->ref_count++;
-  cache->free_slab = slab;
+  slab_relink(cache, slabctl, slabctl->ref_count - 1);
 
+  *slabctlp = slabctl;
   return obj;
 }
 
-objc_cache_t *objc_cache_create(char *name, size_t size, int align, constructor c, destructor d) {
+/*Returns the number of buffers of `buffer_size` bytes that fit in `avail` bytes next to their constructed state
+ * bitmap and an index free list of `idx_size` bytes per buffer, rounded up to keep the slabctl aligned.*/
+static size_t slab_fit(size_t avail, size_t buffer_size, int idx_size) {
+  size_t total_buf = avail / (buffer_size + idx_size);
+  while (total_buf && total_buf * buffer_size + BM_BYTES(total_buf) +
+                              ((total_buf * idx_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1)) >
+                          avail)
+    total_buf--;
+  return total_buf;
+}
+
+/*Computes the layout of a slab of `PAGE_SIZE << order` bytes:
+ * | buffers | unused | bm_const | slabctl |
+ * or, for small objects packed without a bufctl:
+ * | buffers | unused | bm_const | idx_list | slabctl |
+ * or, for off-slab caches, only the buffers. Returns the number of unused bytes. The slabctl of an on-slab
+ * layout always ends the slab so that it can be found from any object given only the slab size.
+ *
+ * The compact layout keeps an index free list of 1 or 2 bytes per buffer right before the slabctl instead of the
+ * bufctl appended to every buffer. It is picked whenever it fits more buffers in the slab.*/
+static size_t slab_layout(objc_cache_t *cache, int order) {
+  size_t slab_size = (size_t)PAGE_SIZE << order;
+  cache->slab_order = order;
+  cache->slab_size = slab_size;
+
+  if (cache->flags & OBJC_CACHE_OFFSLAB) {
+    /*Off-slab: | buffers | unused |*/
+    cache->total_buf = slab_size / cache->buffer_size;
+    cache->slabctl_offset = cache->bm_offset = slab_size;
+    cache->unused = slab_size - cache->total_buf * cache->buffer_size;
+    return cache->unused;
+  }
+
+  size_t avail = slab_size - sizeof(objc_slabctl_t);
+  /*The bufctl is kept pointer aligned after the object and the buffer is rounded up so that the next object is
+   * aligned too.*/
+  cache->buffer_size = ALIGN_UP(cache->bufctl_offset + sizeof(objc_bufctl_t), cache->align);
+  cache->idx_size = 0;
+  /*Cache line isolated buffers can't hold any metadata and the slabs of persistent caches can't hold pointers, so
+   * only the compact layout is possible.*/
+  int compact = cache->flags & (OBJC_CACHE_ISOLATE | OBJC_CACHE_COMPACT);
+  size_t total_buf = compact ? 0 : slab_fit(avail, cache->buffer_size, 0);
+
+  if (!(cache->flags & OBJC_CACHE_BUFCTL) || compact) {
+    size_t compact_size = ALIGN_UP(cache->size, cache->align);
+    for (int idx_size = 1; idx_size <= 2; idx_size++) {
+      size_t compact_buf = slab_fit(avail, compact_size, idx_size);
+      /*The largest value of an index marks the end of the list. A forced compact layout leaves the rest of the
+       * slab unused rather than failing.*/
+      if (compact_buf >= UINT16_MAX && (cache->flags & OBJC_CACHE_COMPACT))
+        compact_buf = UINT16_MAX - 1;
+      if (compact_buf >= (idx_size == 1 ? UINT8_MAX : UINT16_MAX))
+        continue;
+      if (compact_buf > total_buf) {
+        total_buf = compact_buf;
+        cache->buffer_size = compact_size;
+        cache->idx_size = idx_size;
+      }
+      break;
+    }
+  }
+
+  size_t idx_bytes = (total_buf * cache->idx_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  cache->total_buf = total_buf;
+  cache->slabctl_offset = avail;
+  cache->idx_offset = -(ptrdiff_t)idx_bytes;
+  cache->bm_offset = avail - idx_bytes - BM_BYTES(total_buf);
+  cache->unused = cache->bm_offset - total_buf * cache->buffer_size;
+  return cache->unused;
+}
+
+static int offslab_create(objc_cache_t *cache) {
+  cache->idx_size = cache->total_buf < UINT8_MAX ? 1 : cache->total_buf < UINT16_MAX ? 2 : 4;
+  cache->idx_offset = sizeof(objc_offslab_t) + ((BM_BYTES(cache->total_buf) + 3) & ~3);
+  size_t ctl_size = cache->idx_offset + cache->total_buf * cache->idx_size;
+
+  cache->slabctl_cache = objc_cache_create_ex("objc_slabctl", ctl_size, 0, NULL, NULL, OBJC_CACHE_NOTRACE);
+  if (!cache->slabctl_cache)
+    return -1;
+  if (offslab_init(cache) != 0) {
+    objc_cache_destroy(cache->slabctl_cache);
+    return -1;
+  }
+  return 0;
+}
+
+/*Picks the smallest slab order that holds at least `OBJC_SLAB_MIN_OBJS` objects and wastes no more than
+ * `1 / OBJC_SLAB_WASTE` of the slab. If no order meets both, the order with the smallest fraction of unused
+ * bytes is used.*/
+static int slab_order(objc_cache_t *cache) {
+  int best = -1;
+  double best_waste = 1.0;
+  for (int order = 0; order <= OBJC_ARENA_MAX_ORDER; order++) {
+    size_t unused = slab_layout(cache, order);
+    if (!cache->total_buf)
+      continue;
+    if (cache->total_buf >= OBJC_SLAB_MIN_OBJS && unused * OBJC_SLAB_WASTE <= cache->slab_size)
+      return order;
+    double waste = (double)unused / cache->slab_size;
+    if (best < 0 || waste < best_waste) {
+      best = order;
+      best_waste = waste;
+    }
+  }
+  return best;
+}
+
+objc_cache_t *objc_cache_create_ex(char *name, size_t size, int align, constructor c, destructor d,
+                                   unsigned int flags) {
+  /*`align` must be 0 or a power of two no larger than a page. 0 aligns objects to a pointer, or to the next
+   * power of two of their size for smaller objects.*/
+  if (align < 0 || align > PAGE_SIZE || (align & (align - 1)) || !size)
+    return NULL;
+  if (!align) {
+    align = sizeof(void *);
+    while (align / 2 >= size)
+      align /= 2;
+  }
+
   objc_cache_t *cache = (objc_cache_t *)malloc(sizeof(*cache));
 
   if (!cache)
@@ -181,122 +458,738 @@ objc_cache_t *objc_cache_create(char *name, size_t size, int align, constructor
 
   cache->name = name;
   cache->size = size;
-  cache->align = align;
   cache->c = c;
   cache->d = d;
-  cache->free_slab = NULL; // NULL because slab is not created yet
-  cache->buffer_size = align > (size + sizeof(objc_bufctl_t)) ? align : (size + sizeof(objc_bufctl_t));
-  cache->total_buf = (PAGE_SIZE - sizeof(objc_slabctl_t)) / (cache->buffer_size);
-
-  cache->unused = (PAGE_SIZE - sizeof(objc_slabctl_t)) % (cache->buffer_size);
+  cache->proto = NULL;
+  cache->move = NULL;
+  cache->move_arg = NULL;
+  cache->phdr = NULL;
+  cache->slabs_full = cache->slabs_free = NULL; // NULL because slab is not created yet
+  for (int i = 0; i < OBJC_PARTIAL_BINS; i++)
+    cache->slabs_partial[i] = NULL;
+  cache->partial_mask = 0;
+  cache->policy = OBJC_SLAB_LIFO;
+  /*Large objects don't carry a bufctl. Their free list is kept off-slab.*/
+  if (size >= OBJC_LARGE_OBJECT && !(flags & OBJC_CACHE_ONSLAB))
+    flags |= OBJC_CACHE_OFFSLAB;
+  /*Cache line isolated objects get whole lines of at least `OBJC_CACHELINE` bytes.*/
+  if ((flags & OBJC_CACHE_ISOLATE) && align < OBJC_CACHELINE)
+    align = OBJC_CACHELINE;
+  cache->align = align;
+  cache->bufctl_offset = ALIGN_UP(size, sizeof(void *));
+  /*The buffer size of small objects depends on the layout picked by `slab_layout`.*/
+  cache->buffer_size = ALIGN_UP(size, align);
+  cache->flags = flags;
+  cache->slabctl_cache = NULL;
+  cache->idx_size = 0;
 
-  cache->slabctl_offset = cache->total_buf * cache->buffer_size + cache->unused;
+  /*Huge page slabs are always 2M. Otherwise the order is either given with `OBJC_CACHE_ORDER` or picked to
+   * minimise the unused bytes.*/
+  int order;
+  if (flags & (OBJC_CACHE_HUGEPAGE | OBJC_CACHE_HUGETLB))
+    order = OBJC_ARENA_MAX_ORDER;
+  else if (flags & OBJC_CACHE_ORDER_MASK)
+    order = (flags & OBJC_CACHE_ORDER_MASK) - 1;
+  else
+    order = slab_order(cache);
+  if (order < 0 || order > OBJC_ARENA_MAX_ORDER) {
+    free(cache);
+    return NULL;
+  }
+  slab_layout(cache, order);
+  if (!cache->total_buf || ((flags & OBJC_CACHE_OFFSLAB) && offslab_create(cache) != 0)) {
+    free(cache);
+    return NULL;
+  }
+  cache->color_next = 0;
+  /*Colors are multiples of the alignment so that they don't break it.*/
+  cache->color_step = align > OBJC_CACHELINE ? align : OBJC_CACHELINE;
+  cache->color_max = (flags & OBJC_CACHE_NOCOLOR) ? 0 : cache->unused & ~(cache->color_step - 1);
   cache->slab_count = 0;
+  cache->free_slabs = cache->free_min = 0;
+  cache->reserve_slabs = 0;
+  pthread_mutex_init(&cache->lock, NULL);
+  atomic_init(&cache->remote_pending, NULL);
 
+  cache->mag_size = 0;
+  pthread_mutex_init(&cache->depot_lock, NULL);
+  cache->depot_full = cache->depot_empty = NULL;
+  cache->tcaches = NULL;
+
+  memset(&cache->stats, 0, sizeof(cache->stats));
+  atomic_init(&cache->trace_id, 0);
+  atomic_init(&cache->prof_live, 0);
+  registry_add(cache);
   return cache;
 }
 
-/*This function runs the constructor to allocate the object into the slab buffer.*/
-void *objc_cache_alloc(objc_cache_t *cache) {
-  void *obj = get_obj(cache);
+objc_cache_t *objc_cache_create(char *name, size_t size, int align, constructor c, destructor d) {
+  return objc_cache_create_ex(name, size, align, c, d, 0);
+}
 
-  if (!obj || !cache)
+objc_cache_t *objc_cache_create_proto(char *name, size_t size, int align, const void *proto, destructor d,
+                                      unsigned int flags) {
+  if (!proto)
     return NULL;
+  void *image = malloc(size);
+  if (!image)
+    return NULL;
+  memcpy(image, proto, size);
+  objc_cache_t *cache = objc_cache_create_ex(name, size, align, NULL, d, flags);
+  if (!cache) {
+    free(image);
+    return NULL;
+  }
+  /*No slab exists yet so every slab gets stamped.*/
+  cache->proto = image;
+  return cache;
+}
 
-  int obj_index = getobj_idx(cache, obj);
-  if (bm_get(GET_SLABCTL(cache, cache->free_slab)->bm_const, obj_index) == 0) {
-    // run the constructor if it was not ran before
-    cache->c(obj, cache->size);
-    bm_set(GET_SLABCTL(cache, cache->free_slab)->bm_const, obj_index);
+/*Puts a slab found in the file of a persistent cache back in its list, rebuilding the pointers of its slabctl.*/
+static void slab_adopt(objc_cache_t *cache, void *slab) {
+  objc_slabctl_t *slabctl = GET_SLABCTL(cache, slab);
+  slabctl->bm_const = (uint8_t *)slab + cache->bm_offset;
+  slabctl->freebuf = NULL;
+  slabctl->cache = cache;
+  atomic_init(&slabctl->remote, 0);
+  slabctl->remote_next = NULL;
+  slab_list_add(cache, slab_list(cache, slabctl->ref_count), slabctl);
+  cache->slab_count++;
+}
+
+/*Clears the pointers of a slabctl before the file is closed so that the metadata doesn't depend on the address
+ * of the mapping.*/
+static void slab_detach(objc_cache_t *cache, void *slab) {
+  objc_slabctl_t *slabctl = GET_SLABCTL(cache, slab);
+  slabctl->bm_const = NULL;
+  slabctl->cache = NULL;
+  slabctl->next = slabctl->prev = slabctl->remote_next = NULL;
+}
+
+objc_cache_t *objc_cache_open(char *name, const char *path, size_t size, int align, constructor c, destructor d,
+                              size_t max_size) {
+  /*Only the compact layout keeps its free lists relative to the slab, it is used whatever the object size.*/
+  objc_cache_t *cache = objc_cache_create_ex(name, size, align, c, d, OBJC_CACHE_ONSLAB | OBJC_CACHE_COMPACT);
+  if (!cache)
+    return NULL;
+  if (pfile_open(cache, path, max_size) != 0) {
+    objc_cache_destroy(cache);
+    return NULL;
+  }
+  pthread_mutex_lock(&cache->lock);
+  pfile_foreach(cache, slab_adopt);
+  pthread_mutex_unlock(&cache->lock);
+  return cache;
+}
+
+void objc_cache_close(objc_cache_t *cache) {
+  if (!cache->phdr) {
+    objc_cache_destroy(cache);
+    return;
+  }
+  registry_del(cache);
+  /*Objects cached in magazines go back to their slabs, they are free in the next run.*/
+  if (cache->mag_size) {
+    mag_flush(cache);
+    mag_destroy(cache);
+  }
+  pthread_mutex_lock(&cache->lock);
+  remote_drain(cache);
+  pfile_foreach(cache, slab_detach);
+  pthread_mutex_unlock(&cache->lock);
+  pfile_close(cache);
+  pthread_mutex_destroy(&cache->depot_lock);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+/*Prefaults the pages of a slab for writing, with a single call if the kernel supports it.*/
+static void slab_prefault(objc_cache_t *cache, char *slab) {
+#ifdef MADV_POPULATE_WRITE
+  if (madvise(slab, cache->slab_size, MADV_POPULATE_WRITE) == 0)
+    return;
+#endif
+  for (size_t off = 0; off < cache->slab_size; off += PAGE_SIZE)
+    ((volatile char *)slab)[off] = ((volatile char *)slab)[off];
+}
+
+/*Share of the slabs of `objc_cache_reserve` prefaulted and constructed by one thread.*/
+typedef struct reserve_work {
+  pthread_t tid;
+  int started;
+  objc_cache_t *cache;
+  objc_slabctl_t **slabs;
+  size_t first, last;
+  uint64_t ctor_calls;
+} reserve_work_t;
+
+static void *reserve_worker(void *arg) {
+  reserve_work_t *w = arg;
+  objc_cache_t *cache = w->cache;
+  for (size_t s = w->first; s < w->last; s++) {
+    objc_slabctl_t *slabctl = w->slabs[s];
+    slab_prefault(cache, slab_base(cache, slabctl));
+    /*Without a constructor there is nothing to mark: the destructor only runs on buffers that were handed out.*/
+    if (!cache->c || cache->proto)
+      continue;
+    char *bufs = slab_bufs(cache, slabctl);
+    for (uint32_t i = 0; i < cache->total_buf; i++) {
+      if (!bm_get(slabctl->bm_const, i)) {
+        cache->c(bufs + (size_t)i * cache->buffer_size, cache->size);
+        bm_set(slabctl->bm_const, i);
+        w->ctor_calls++;
+      }
+    }
+  }
+  return NULL;
+}
+
+/*Sets the free slabs the reaper keeps to `want`, or to the slabs that exist if fewer could be created. Called with
+ * the cache locked once the new slabs are in their list.*/
+static void reserve_set(objc_cache_t *cache, size_t want) {
+  cache->reserve_slabs = want < cache->slab_count ? want : cache->slab_count;
+}
+
+int objc_cache_reserve(objc_cache_t *cache, size_t n_objects, int n_threads) {
+  size_t want = (n_objects + cache->total_buf - 1) / cache->total_buf;
+  pthread_mutex_lock(&cache->lock);
+  remote_drain(cache);
+  size_t avail = (size_t)cache->free_slabs * cache->total_buf;
+  for (int i = 0; i < OBJC_PARTIAL_BINS; i++) {
+    for (objc_slabctl_t *cur = cache->slabs_partial[i]; cur; cur = cur->next)
+      avail += cache->total_buf - cur->ref_count;
+  }
+  if (avail >= n_objects) {
+    reserve_set(cache, want);
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+  }
+  size_t nslabs = (n_objects - avail + cache->total_buf - 1) / cache->total_buf;
+  objc_slabctl_t **slabs = malloc(nslabs * sizeof(objc_slabctl_t *));
+  if (!slabs) {
+    pthread_mutex_unlock(&cache->lock);
+    return -1;
+  }
+  /*The new slabs are kept out of the lists while they are built so that the cache stays usable meanwhile.*/
+  size_t created = 0;
+  for (; created < nslabs && create_new_slab(cache); created++) {
+    slabs[created] = cache->slabs_free;
+    slab_list_del(cache, &cache->slabs_free, slabs[created]);
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  if (n_threads < 1)
+    n_threads = 1;
+  if ((size_t)n_threads > created)
+    n_threads = created ? created : 1;
+  reserve_work_t *workers = calloc(n_threads, sizeof(reserve_work_t));
+  reserve_work_t single;
+  if (!workers) {
+    workers = &single;
+    n_threads = 1;
+  }
+  for (int i = 0; i < n_threads; i++) {
+    reserve_work_t *w = &workers[i];
+    *w = (reserve_work_t){.cache = cache, .slabs = slabs};
+    w->first = created * i / n_threads;
+    w->last = created * (i + 1) / n_threads;
+    w->started = i > 0 && pthread_create(&w->tid, NULL, reserve_worker, w) == 0;
+  }
+  reserve_worker(&workers[0]);
+  uint64_t ctor_calls = workers[0].ctor_calls;
+  for (int i = 1; i < n_threads; i++) {
+    if (workers[i].started)
+      pthread_join(workers[i].tid, NULL);
+    else
+      reserve_worker(&workers[i]);
+    ctor_calls += workers[i].ctor_calls;
+  }
+  (void)ctor_calls;
+
+  pthread_mutex_lock(&cache->lock);
+  for (size_t i = 0; i < created; i++)
+    slab_list_add(cache, &cache->slabs_free, slabs[i]);
+  reserve_set(cache, want);
+  STAT_ADD(cache, ctor_calls, ctor_calls);
+  pthread_mutex_unlock(&cache->lock);
+  if (workers != &single)
+    free(workers);
+  free(slabs);
+  return created == nslabs ? 0 : -1;
+}
+
+int objc_cache_set_magsize(objc_cache_t *cache, int mag_size) {
+  /*Magazine size can only be set once and before the cache is used since magazines are not resized.*/
+  if (mag_size < 0 || cache->mag_size || cache->slab_count)
+    return -1;
+  if (mag_size == 0)
+    return 0;
+  if (mag_init(cache) != 0)
+    return -1;
+  cache->mag_size = mag_size;
+  return 0;
+}
+
+int objc_cache_set_policy(objc_cache_t *cache, objc_slab_policy_t policy) {
+  /*Partial slabs are binned by the policy so it can't change once slabs exist.*/
+  if (cache->slab_count)
+    return -1;
+  if (policy != OBJC_SLAB_LIFO && policy != OBJC_SLAB_DENSE)
+    return -1;
+  cache->policy = policy;
+  return 0;
+}
+
+int objc_cache_set_move(objc_cache_t *cache, objc_move_fn fn, void *arg) {
+  if (cache->slab_count || !fn)
+    return -1;
+  cache->move = fn;
+  cache->move_arg = arg;
+  return 0;
+}
+
+/*Allocates an object from the slab layer under the cache lock and runs the constructor if the buffer was
+ * never constructed before.*/
+void *slab_alloc(objc_cache_t *cache) {
+  pthread_mutex_lock(&cache->lock);
+  objc_slabctl_t *slabctl;
+  uint32_t obj_index;
+  void *obj = get_obj(cache, &slabctl, &obj_index);
+  if (!obj) {
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
   }
+
+  uint8_t *bm_const = slabctl->bm_const;
+  /*Buffers of prototype caches are always constructed, their bitmap isn't even looked at.*/
+  int constructed = cache->proto || bm_get(bm_const, obj_index);
+  if (!constructed)
+    bm_set(bm_const, obj_index);
+  stat_alloc(cache, 1);
+  if (constructed)
+    STAT_INC(cache, bitmap_hits);
+  else if (cache->c)
+    STAT_INC(cache, ctor_calls);
+  pthread_mutex_unlock(&cache->lock);
+
+  /*The buffer belongs to the caller now so the constructor can run outside of the lock.*/
+  if (!constructed && cache->c)
+    cache->c(obj, cache->size);
   return obj;
 }
 
-void objc_free(objc_cache_t *cache, void *obj) {
-  objc_bufctl_t *bufctl = (objc_bufctl_t *)((char *)obj + cache->size);
-  /*Get slab base address using bit mask*/
-  void *slab = GET_SLABBASE(obj);
-  objc_slabctl_t *slabctl = GET_SLABCTL(cache, slab);
+/*Objects are served from the thread's magazines first and from the slab layer on a magazine miss.*/
+void *objc_cache_alloc(objc_cache_t *cache) {
+  if (!cache)
+    return NULL;
 
-  /*Put the `bufctl` of the freed `obj` back in the free linked list*/
-  objc_bufctl_t *temp_bufctl = slabctl->freebuf;
-  slabctl->freebuf = bufctl;
-  bufctl->next = temp_bufctl;
+  void *obj = cache->mag_size ? mag_alloc(cache) : NULL;
+  if (!obj)
+    obj = slab_alloc(cache);
+  TRACE(cache, OBJC_TRACE_ALLOC, obj);
+  PROFILE_ALLOC(cache, obj);
+  return obj;
+}
 
-  slabctl->ref_count--;
+/*Fills `out` with `n` objects taken from the slab layer under a single lock. Whole runs of the free list of a
+ * slab are taken at once and the slab is moved to its new list only once per run. Constructed buffers are stored
+ * from the front of `out` and the buffers that still need their constructor from the back so that the
+ * constructors can run after the lock is dropped. Returns the number of objects allocated.*/
+static int slab_alloc_bulk(objc_cache_t *cache, int n, void **out) {
+  int front = 0, back = n;
 
-  /*If all buffers from the slab gets freed.*/
-  if (slabctl->ref_count == 0) {
-    objc_slabctl_t *cur = slabctl->next;
-    while (cur != slabctl) {
-      /*If there is partial slab present in the cache then put this complete slab
-       * after partial slab. Otherwise continue.*/
-      if (cur->ref_count > 0 && cur->ref_count < cache->total_buf) {
-        insert_slab_after(cur, slabctl);
-        cache->free_slab = GET_SLABBASE(cur);
-        return;
+  pthread_mutex_lock(&cache->lock);
+  while (front < back) {
+    objc_slabctl_t *slabctl = find_alloc_slab(cache);
+    if (!slabctl)
+      break;
+    int run = cache->total_buf - slabctl->ref_count;
+    if (run > back - front)
+      run = back - front;
+    for (int i = 0; i < run; i++) {
+      uint32_t idx;
+      void *obj = pop_buf(cache, slabctl, &idx);
+      if (cache->proto || bm_get(slabctl->bm_const, idx)) {
+        out[front++] = obj;
+      } else {
+        bm_set(slabctl->bm_const, idx);
+        out[--back] = obj;
       }
-      cur = cur->prev;
     }
+    slabctl->ref_count += run;
+    slab_relink(cache, slabctl, slabctl->ref_count - run);
   }
+  stat_alloc(cache, front + n - back);
+  STAT_ADD(cache, bitmap_hits, front);
+  if (cache->c)
+    STAT_ADD(cache, ctor_calls, n - back);
+  pthread_mutex_unlock(&cache->lock);
 
-  if (slabctl->next == slabctl)
-    // do nothing if only one slab exists
+  /*Close the gap left in the middle of `out` if the cache ran out of memory.*/
+  int unconstructed = n - back;
+  if (front < back)
+    memmove(out + front, out + back, unconstructed * sizeof(void *));
+  if (cache->c) {
+    for (int i = front; i < front + unconstructed; i++)
+      cache->c(out[i], cache->size);
+  }
+  return front + unconstructed;
+}
+
+int objc_cache_alloc_bulk(objc_cache_t *cache, int n, void **out) {
+  if (!cache || n <= 0)
+    return 0;
+
+  int got = 0;
+  if (cache->mag_size) {
+    while (got < n && (out[got] = mag_alloc(cache)))
+      got++;
+  }
+  got += slab_alloc_bulk(cache, n - got, out + got);
+  for (int i = 0; i < got; i++) {
+    TRACE(cache, OBJC_TRACE_ALLOC, out[i]);
+    PROFILE_ALLOC(cache, out[i]);
+  }
+  return got;
+}
+
+/*Returns the object to its slab and moves the slab to the free list if this was its last allocated buffer
+ * or to a partial list if the slab was full. Caller must hold the cache lock.*/
+static void put_obj(objc_cache_t *cache, void *obj) {
+  /*Get slab base address using bit mask*/
+  void *slab = GET_SLABBASE(cache, obj);
+  objc_slabctl_t *slabctl = slab_ctl(cache, slab);
+
+  push_buf(cache, slabctl, obj);
+  slabctl->ref_count--;
+  slab_relink(cache, slabctl, slabctl->ref_count + 1);
+  STAT_INC(cache, frees);
+}
+
+/*Pushes `obj` on the remote free list of its slab with a single CAS. The first object pushed on an empty list
+ * also publishes the slab in `remote_pending` so that the next `remote_drain` finds it.*/
+static void remote_free(objc_cache_t *cache, void *obj) {
+  objc_slabctl_t *slabctl = GET_SLABCTL(cache, GET_SLABBASE(cache, obj));
+  uintptr_t old = atomic_load_explicit(&slabctl->remote, memory_order_relaxed);
+  uintptr_t new;
+  do {
+    /*The link of an allocated buffer is not used by anyone else so it can be written before the CAS.*/
+    if (cache->idx_size) {
+      uint32_t idx = getobj_idx(cache, slabctl, obj);
+      idx_set(cache, (char *)slabctl + cache->idx_offset, idx, old ? old - 1 : OBJC_IDX_NONE);
+      new = idx + 1;
+    } else {
+      objc_bufctl_t *bufctl = (objc_bufctl_t *)((char *)obj + cache->bufctl_offset);
+      bufctl->next = (objc_bufctl_t *)old;
+      new = (uintptr_t)bufctl;
+    }
+  } while (!atomic_compare_exchange_weak_explicit(&slabctl->remote, &old, new, memory_order_acq_rel,
+                                                  memory_order_relaxed));
+  if (old)
     return;
 
-  /*If more then one slab exists.*/
-  if (slabctl->next->freebuf != NULL) {
-    /*If the next slab is not empty slab (all buffer allocated), it
-     * means the next slab is a partial/complete slab. So if the next slab is the partial slab
-     * then we can point the current `cache->free_slab` to this slab from where obj is just
-     * freed and rearranging the slab list is not necessary because partial slabs are together.*/
+  objc_slabctl_t *head = atomic_load_explicit(&cache->remote_pending, memory_order_relaxed);
+  do {
+    slabctl->remote_next = head;
+  } while (!atomic_compare_exchange_weak_explicit(&cache->remote_pending, &head, slabctl, memory_order_release,
+                                                  memory_order_relaxed));
+}
 
-    cache->free_slab = slab;
+/*Returns the object to its slab. If another thread holds the cache lock the object is pushed on the remote free
+ * list of its slab instead of waiting. Off-slab caches always take the lock since their slabctl is found
+ * through the hash table which is only safe to read under the lock.*/
+void slab_free(objc_cache_t *cache, void *obj) {
+  if (cache->flags & OBJC_CACHE_OFFSLAB) {
+    pthread_mutex_lock(&cache->lock);
+  } else if (pthread_mutex_trylock(&cache->lock) != 0) {
+    remote_free(cache, obj);
     return;
   }
+  put_obj(cache, obj);
+  pthread_mutex_unlock(&cache->lock);
+}
 
-  /*If the next slab is the empty slab then we will iterate through the list until a partial/complete
-   * slab is found then get the last empty slab to arrange all partial slabs after it.*/
-  objc_slabctl_t *cur = slabctl->next;
-  /*Iterate until a partial or complete slab is found.*/
-  while (cur->freebuf == NULL) {
-    cur = cur->next;
+void objc_free_remote(objc_cache_t *cache, void *obj) {
+  TRACE(cache, OBJC_TRACE_FREE, obj);
+  PROFILE_FREE(cache, obj);
+  if (cache->flags & OBJC_CACHE_OFFSLAB) {
+    slab_free(cache, obj);
+    return;
   }
-  /*If cur is the partial/complete slab then `cur->prev` is the last empty slab. We need to
-   * rearrange the next and prev pointers of the `slabctl` (from which obj is being freed) with
-   * this last empty slab so that empty slab moves toward the head and partial/complete slabs
-   * follow.*/
-  objc_slabctl_t *empty_slab = cur->prev;
-  insert_slab_after(empty_slab, slabctl);
+  remote_free(cache, obj);
+}
 
-  cache->free_slab = slab;
+void objc_free(objc_cache_t *cache, void *obj) {
+  TRACE(cache, OBJC_TRACE_FREE, obj);
+  PROFILE_FREE(cache, obj);
+  if (cache->mag_size && mag_free(cache, obj) == 0)
+    return;
+  slab_free(cache, obj);
 }
 
-void objc_cache_destroy(objc_cache_t *cache) {
-  if (!cache->free_slab) {
-    free(cache);
+/*Returns `n` objects to the slab layer under a single lock. Consecutive objects of the same slab are grouped so
+ * that the slabctl is looked up and the slab is moved to its new list only once per group.*/
+static void slab_free_bulk(objc_cache_t *cache, int n, void **objs) {
+  pthread_mutex_lock(&cache->lock);
+  int i = 0;
+  while (i < n) {
+    void *slab = GET_SLABBASE(cache, objs[i]);
+    objc_slabctl_t *slabctl = slab_ctl(cache, slab);
+    int run = 0;
+    for (; i < n && GET_SLABBASE(cache, objs[i]) == slab; i++, run++)
+      push_buf(cache, slabctl, objs[i]);
+    slabctl->ref_count -= run;
+    slab_relink(cache, slabctl, slabctl->ref_count + run);
+    STAT_ADD(cache, frees, run);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void objc_free_bulk(objc_cache_t *cache, int n, void **objs) {
+  if (!cache || n <= 0)
     return;
+
+  for (int i = 0; i < n; i++) {
+    TRACE(cache, OBJC_TRACE_FREE, objs[i]);
+    PROFILE_FREE(cache, objs[i]);
   }
+  int done = 0;
+  if (cache->mag_size) {
+    while (done < n && mag_free(cache, objs[done]) == 0)
+      done++;
+  }
+  slab_free_bulk(cache, n - done, objs + done);
+}
 
-  objc_slabctl_t *start = GET_SLABCTL(cache, cache->free_slab);
-  if (cache->slab_count > 1) {
-    objc_slabctl_t *cur = start->next;
+/*Runs the destructor on every constructed buffer of a free slab and returns the slab to the page arena.
+ * Returns the number of bytes given back to the OS.*/
+static size_t slab_release(objc_cache_t *cache, objc_slabctl_t *slabctl) {
+  char *slab = slab_base(cache, slabctl);
+  if (cache->d) {
+    char *bufs = slab_bufs(cache, slabctl);
+    for (int i = 0; i < cache->total_buf; i++) {
+      /*Only buffers that were constructed once hold an object the destructor can tear down.*/
+      if (bm_get(slabctl->bm_const, i))
+        cache->d(bufs + i * cache->buffer_size, cache->size);
+    }
+  }
+  slab_pages_free(cache, slab);
+  if (cache->flags & OBJC_CACHE_OFFSLAB) {
+    offslab_remove(cache, (objc_offslab_t *)slabctl);
+    objc_free(cache->slabctl_cache, slabctl);
+  }
+  cache->slab_count--;
+  STAT_INC(cache, slabs_released);
+  return cache->slab_size;
+}
 
-    // Break circularity
-    start->prev->next = NULL;
-    start->prev = NULL;
+size_t objc_cache_reap(objc_cache_t *cache, int keep) {
+  /*Objects cached in the depot's full magazines are returned to their slabs first so that slabs that are
+   * only held by the depot become free.*/
+  if (cache->mag_size)
+    mag_purge(cache);
+
+  pthread_mutex_lock(&cache->lock);
+  remote_drain(cache);
+  /*Keep the first `keep` free slabs warm and release the rest.*/
+  objc_slabctl_t *cur = cache->slabs_free;
+  for (int i = 0; cur && i < keep; i++)
+    cur = cur->next;
 
-    // Free all slabs and bitmaps for constructed state
+  size_t reaped = 0;
+  while (cur) {
+    objc_slabctl_t *next = cur->next;
+    slab_list_del(cache, &cache->slabs_free, cur);
+    reaped += slab_release(cache, cur);
+    cur = next;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  /*Off-slab slabctls of the released slabs are in the slabctl cache now.*/
+  if (cache->slabctl_cache)
+    reaped += objc_cache_reap(cache->slabctl_cache, 0);
+  return reaped;
+}
+
+/*Working set trimming for the reaper: slabs that stayed free since the previous call weren't needed by the cache
+ * during that time and are released, coldest first. The others are kept for the next burst. The magazines are left
+ * alone. Returns the number of bytes released.*/
+size_t cache_trim(objc_cache_t *cache) {
+  pthread_mutex_lock(&cache->lock);
+  remote_drain(cache);
+  unsigned int excess = cache->free_min;
+  /*Slabs reserved with `objc_cache_reserve` stay until they are used.*/
+  unsigned int keep = cache->reserve_slabs < cache->free_slabs ? cache->reserve_slabs : cache->free_slabs;
+  if (excess > cache->free_slabs - keep)
+    excess = cache->free_slabs - keep;
+  size_t reaped = 0;
+  if (excess) {
+    objc_slabctl_t *cur = cache->slabs_free;
+    while (cur->next)
+      cur = cur->next;
+    for (; excess; excess--) {
+      objc_slabctl_t *prev = cur->prev;
+      slab_list_del(cache, &cache->slabs_free, cur);
+      reaped += slab_release(cache, cur);
+      cur = prev;
+    }
+  }
+  cache->free_min = cache->free_slabs;
+  pthread_mutex_unlock(&cache->lock);
+  return reaped;
+}
+
+static int ref_count_cmp(const void *a, const void *b) {
+  return (*(objc_slabctl_t *const *)a)->ref_count - (*(objc_slabctl_t *const *)b)->ref_count;
+}
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+size_t objc_cache_defrag(objc_cache_t *cache, unsigned int max_moves, unsigned int max_us) {
+  if (!cache->move)
+    return 0;
+  uint64_t deadline = max_us ? now_us() + max_us : 0;
+  /*Objects held by the depot pin their slabs like live ones.*/
+  if (cache->mag_size)
+    mag_purge(cache);
+  uint8_t *free_map = malloc(BM_BYTES(cache->total_buf));
+  if (!free_map)
+    return 0;
+
+  pthread_mutex_lock(&cache->lock);
+  remote_drain(cache);
+  int n = 0;
+  for (int i = 0; i < OBJC_PARTIAL_BINS; i++) {
+    for (objc_slabctl_t *cur = cache->slabs_partial[i]; cur; cur = cur->next)
+      n++;
+  }
+  objc_slabctl_t **slabs = malloc((n ? n : 1) * sizeof(objc_slabctl_t *));
+  if (!slabs) {
+    pthread_mutex_unlock(&cache->lock);
+    free(free_map);
+    return 0;
+  }
+  n = 0;
+  for (int i = 0; i < OBJC_PARTIAL_BINS; i++) {
+    for (objc_slabctl_t *cur = cache->slabs_partial[i]; cur; cur = cur->next)
+      slabs[n++] = cur;
+  }
+  /*Sources are taken from the sparse end, destinations from the dense end.*/
+  qsort(slabs, n, sizeof(objc_slabctl_t *), ref_count_cmp);
+  size_t room = 0; // free buffers of the destinations `slabs[src + 1..dst]`
+  for (int i = 1; i < n; i++)
+    room += cache->total_buf - slabs[i]->ref_count;
+
+  unsigned int moves = 0;
+  int src = 0, dst = n - 1, stop = 0;
+  for (; src < dst && !stop; src++) {
+    objc_slabctl_t *from = slabs[src];
+    if (src > 0)
+      room -= cache->total_buf - from->ref_count;
+    if ((size_t)from->ref_count > room)
+      break;
+    slab_free_map(cache, from, free_map);
+    char *bufs = slab_bufs(cache, from);
+    for (uint32_t i = 0; i < cache->total_buf && src < dst; i++) {
+      if (bm_get(free_map, i))
+        continue;
+      if ((max_moves && moves == max_moves) || (deadline && now_us() >= deadline)) {
+        stop = 1;
+        break;
+      }
+      objc_slabctl_t *to = slabs[dst];
+      uint32_t idx;
+      void *new_obj = pop_buf(cache, to, &idx);
+      to->ref_count++;
+      slab_relink(cache, to, to->ref_count - 1);
+      room--;
+      if (!cache->proto && !bm_get(to->bm_const, idx)) {
+        bm_set(to->bm_const, idx);
+        if (cache->c)
+          cache->c(new_obj, cache->size);
+      }
+      void *old_obj = bufs + (size_t)i * cache->buffer_size;
+      objc_move_t ret = cache->move(old_obj, new_obj, cache->size, cache->move_arg);
+      /*A refused or freed object gives its new buffer back. The old buffer of a freed object is on its way to the
+       * remote free list of its slab, it is taken back below.*/
+      void *back = ret == OBJC_MOVE_YES ? old_obj : new_obj;
+      objc_slabctl_t *back_slab = ret == OBJC_MOVE_YES ? from : to;
+      push_buf(cache, back_slab, back);
+      back_slab->ref_count--;
+      slab_relink(cache, back_slab, back_slab->ref_count + 1);
+      if (ret == OBJC_MOVE_YES) {
+        moves++;
+        /*A trace sees the object allocated at its new address and freed at the old one, so a replay ends with
+         * the same live objects.*/
+        TRACE(cache, OBJC_TRACE_ALLOC, new_obj);
+        TRACE(cache, OBJC_TRACE_FREE, old_obj);
+        /*A sampled object keeps its call stack at its new address.*/
+        if (atomic_load_explicit(&cache->prof_live, memory_order_relaxed))
+          profile_move(cache, old_obj, new_obj);
+      } else {
+        room++;
+      }
+      if (ret == OBJC_MOVE_NO)
+        break;
+      if (to->ref_count == (int)cache->total_buf)
+        dst--;
+    }
+  }
+
+  /*Release the sources that are free now.*/
+  remote_drain(cache);
+  size_t released = 0;
+  for (int i = 0; i < src && i < n; i++) {
+    if (slabs[i]->ref_count == 0) {
+      slab_list_del(cache, &cache->slabs_free, slabs[i]);
+      released += slab_release(cache, slabs[i]);
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+  free(slabs);
+  free(free_map);
+  return released;
+}
+
+void objc_cache_destroy(objc_cache_t *cache) {
+  registry_del(cache);
+  if (atomic_load(&cache->prof_live))
+    profile_forget(cache);
+  /*Destructors run for the constructed buffers of the free slabs. Slabs that still have allocated objects
+   * are released without running any destructor.*/
+  objc_cache_reap(cache, 0);
+
+  if (cache->mag_size)
+    mag_destroy(cache);
+  pthread_mutex_destroy(&cache->depot_lock);
+  pthread_mutex_destroy(&cache->lock);
+
+  // Free all slabs and bitmaps for constructed state
+  objc_slabctl_t *lists[OBJC_PARTIAL_BINS + 2] = {cache->slabs_full, cache->slabs_free};
+  for (int i = 0; i < OBJC_PARTIAL_BINS; i++)
+    lists[i + 2] = cache->slabs_partial[i];
+  for (int i = 0; i < OBJC_PARTIAL_BINS + 2; i++) {
+    objc_slabctl_t *cur = lists[i];
     while (cur) {
       objc_slabctl_t *next = cur->next;
-      free(cur->bm_const);
-      free(GET_SLABBASE(cur));
+      slab_pages_free(cache, slab_base(cache, cur));
       cur = next;
     }
   }
-  // Free starting slab
-  free(start->bm_const);
-  free(GET_SLABBASE(start));
+  if (cache->flags & OBJC_CACHE_OFFSLAB) {
+    offslab_destroy(cache);
+    objc_cache_destroy(cache->slabctl_cache);
+  }
+  /*The file of a persistent cache is left empty.*/
+  if (cache->phdr) {
+    objc_cache_set_root(cache, NULL);
+    pfile_close(cache);
+  }
+  free(cache->proto);
   free(cache);
 }
 
@@ -306,6 +1199,10 @@ objc_cache_info_t objc_cache_info(objc_cache_t *cache) {
                                   .slabctl = sizeof(objc_slabctl_t),
                                   .buffer_size = cache->buffer_size,
                                   .total_buf = cache->total_buf,
+                                  .slab_size = cache->slab_size,
+                                  .align = cache->align,
+                                  .padding = cache->buffer_size - cache->size -
+                                             (cache->idx_size ? 0 : sizeof(objc_bufctl_t)),
                                   .slab_count = cache->slab_count};
 
   return cache_info;
@@ -0,0 +1,80 @@
+#include "objc_internal.h"
+#include "objcache.h"
+#include <stdint.h>
+
+/*Large object caches keep their slab control outside of the slab, so the slabctl of an object can't be found
+ * by masking the object address. Instead every slabctl is put in a per-cache hash table keyed by the base of
+ * its slab, which is itself found by masking the object address. Chains are linked through
+ * `objc_offslab_t.hnext` and the bucket array is taken from the page arena.*/
+
+static inline size_t hash(objc_cache_t *cache, void *slab) {
+  uint64_t key = (uintptr_t)slab >> (12 + cache->slab_order);
+  return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (cache->hbuckets - 1);
+}
+
+/*Returns the smallest arena order holding `n` buckets.*/
+static int buckets_order(size_t n) {
+  int order = 0;
+  while (((size_t)PAGE_SIZE << order) < n * sizeof(objc_offslab_t *))
+    order++;
+  return order;
+}
+
+int offslab_init(objc_cache_t *cache) {
+  cache->hbuckets = OBJC_HASH_MIN_BUCKETS;
+  cache->hcount = 0;
+  /*Arena memory is zeroed so all buckets start empty.*/
+  cache->htab = arena_alloc(buckets_order(cache->hbuckets));
+  return cache->htab ? 0 : -1;
+}
+
+void offslab_destroy(objc_cache_t *cache) { arena_free(cache->htab, buckets_order(cache->hbuckets)); }
+
+/*Doubles the number of buckets. The table keeps working with longer chains if it can't grow.*/
+static void rehash(objc_cache_t *cache) {
+  size_t old_buckets = cache->hbuckets;
+  if (buckets_order(old_buckets * 2) > OBJC_ARENA_MAX_ORDER)
+    return;
+  objc_offslab_t **htab = arena_alloc(buckets_order(old_buckets * 2));
+  if (!htab)
+    return;
+
+  objc_offslab_t **old = cache->htab;
+  cache->htab = htab;
+  cache->hbuckets = old_buckets * 2;
+  for (size_t i = 0; i < old_buckets; i++) {
+    objc_offslab_t *cur = old[i];
+    while (cur) {
+      objc_offslab_t *next = cur->hnext;
+      size_t h = hash(cache, cur->base);
+      cur->hnext = htab[h];
+      htab[h] = cur;
+      cur = next;
+    }
+  }
+  arena_free(old, buckets_order(old_buckets));
+}
+
+void offslab_insert(objc_cache_t *cache, objc_offslab_t *ctl) {
+  if (cache->hcount >= cache->hbuckets)
+    rehash(cache);
+  size_t h = hash(cache, ctl->base);
+  ctl->hnext = cache->htab[h];
+  cache->htab[h] = ctl;
+  cache->hcount++;
+}
+
+void offslab_remove(objc_cache_t *cache, objc_offslab_t *ctl) {
+  objc_offslab_t **cur = &cache->htab[hash(cache, ctl->base)];
+  while (*cur != ctl)
+    cur = &(*cur)->hnext;
+  *cur = ctl->hnext;
+  cache->hcount--;
+}
+
+objc_slabctl_t *offslab_lookup(objc_cache_t *cache, void *slab) {
+  objc_offslab_t *cur = cache->htab[hash(cache, slab)];
+  while (cur && cur->base != slab)
+    cur = cur->hnext;
+  return (objc_slabctl_t *)cur;
+}
@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+#include "objc_internal.h"
+#include "objcache.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*File backed slabs of persistent caches. The file starts with a header holding the layout of the cache and a bitmap
+ * of the slab slots in use, followed by the slots. Slots are aligned to the slab size in memory, the mapping is
+ * placed at such an address, the one of the previous run if it is still available.
+ *
+ * Only the compact layout is used, for objects of any size: free lists are indexes relative to their slab and the
+ * constructed bitmap sits at a fixed offset of the slab. The pointer fields of the slabctls (list links, bitmap,
+ * cache) are cleared when the cache is closed and rebuilt when it is opened, so the file can be mapped anywhere. A
+ * checksum over the header and the metadata of every slab is written together with the clean flag on close. A file
+ * that wasn't closed, or whose checksum doesn't match, is refused.*/
+
+struct objc_phdr {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t clean;     // 1 once closed, 0 while a process has it open
+  uint64_t checksum;  // FNV-1a of the header (with `checksum` 0) and the metadata of every slab
+  uint64_t base;      // address of the first slot in the previous run
+  uint64_t root;      // offset of the root object from the first slot + 1, 0 if none
+  uint64_t nslots;    // number of slab slots of the file
+  uint64_t hdr_size;  // bytes before the first slot, a multiple of the slab size
+  uint64_t size;      // layout of the cache, must match when the file is opened again
+  uint64_t align;
+  uint64_t buffer_size;
+  uint64_t slab_size;
+  uint64_t total_buf;
+  uint64_t idx_size;
+  uint8_t used[];     // bit `i` is set if slot `i` holds a slab
+};
+
+static uint64_t fnv1a(uint64_t h, const void *p, size_t n) {
+  const uint8_t *b = p;
+  for (size_t i = 0; i < n; i++)
+    h = (h ^ b[i]) * 0x100000001b3ULL;
+  return h;
+}
+
+static inline char *slot_addr(objc_cache_t *cache, size_t slot) {
+  return (char *)cache->phdr + cache->phdr->hdr_size + slot * cache->slab_size;
+}
+
+/*Checksum of the header and of the metadata at the end of every slab: constructed bitmap, index free list and
+ * slabctl.*/
+static uint64_t pfile_checksum(objc_cache_t *cache) {
+  objc_phdr_t *hdr = cache->phdr;
+  uint64_t saved = hdr->checksum;
+  hdr->checksum = 0;
+  uint64_t h = fnv1a(0xcbf29ce484222325ULL, hdr, sizeof(*hdr) + BM_BYTES(hdr->nslots));
+  hdr->checksum = saved;
+  for (size_t i = 0; i < hdr->nslots; i++) {
+    if (bm_get(hdr->used, i))
+      h = fnv1a(h, slot_addr(cache, i) + cache->bm_offset, cache->slab_size - cache->bm_offset);
+  }
+  return h;
+}
+
+static int layout_matches(objc_cache_t *cache, objc_phdr_t *hdr) {
+  return hdr->size == cache->size && hdr->align == (uint64_t)cache->align &&
+         hdr->buffer_size == cache->buffer_size && hdr->slab_size == cache->slab_size &&
+         hdr->total_buf == cache->total_buf && hdr->idx_size == (uint64_t)cache->idx_size;
+}
+
+/*Maps `size` bytes of `fd` at an address aligned to `align`, at `hint` if possible.*/
+static void *map_aligned(int fd, size_t size, size_t align, void *hint) {
+  void *p;
+  if (hint) {
+    p = mmap(hint, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    if (p == hint)
+      return p;
+    if (p != MAP_FAILED)
+      munmap(p, size);
+  }
+  /*Reserve enough to find an aligned address and map the file over it.*/
+  char *r = mmap(NULL, size + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (r == MAP_FAILED)
+    return NULL;
+  char *start = (char *)ALIGN_UP((uintptr_t)r, align);
+  p = mmap(start, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+  if (p == MAP_FAILED) {
+    munmap(r, size + align);
+    return NULL;
+  }
+  if (start > r)
+    munmap(r, start - r);
+  munmap(start + size, r + align - start);
+  return p;
+}
+
+int pfile_open(objc_cache_t *cache, const char *path, size_t max_size) {
+  int fd = open(path, O_RDWR | O_CREAT, 0600);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  objc_phdr_t *hdr = NULL;
+  size_t map_size;
+  if (st.st_size == 0) {
+    size_t nslots = max_size / cache->slab_size;
+    size_t hdr_size = ALIGN_UP(sizeof(objc_phdr_t) + BM_BYTES(nslots), cache->slab_size);
+    if (nslots * cache->slab_size <= hdr_size)
+      goto fail;
+    nslots -= hdr_size / cache->slab_size;
+    map_size = hdr_size + nslots * cache->slab_size;
+    if (ftruncate(fd, map_size) < 0 || !(hdr = map_aligned(fd, map_size, cache->slab_size, NULL)))
+      goto fail;
+    hdr->magic = OBJC_PCACHE_MAGIC;
+    hdr->version = OBJC_PCACHE_VERSION;
+    hdr->nslots = nslots;
+    hdr->hdr_size = hdr_size;
+    hdr->size = cache->size;
+    hdr->align = cache->align;
+    hdr->buffer_size = cache->buffer_size;
+    hdr->slab_size = cache->slab_size;
+    hdr->total_buf = cache->total_buf;
+    hdr->idx_size = cache->idx_size;
+  } else {
+    /*Read the header alone first to know where the previous run had it.*/
+    objc_phdr_t probe;
+    if ((size_t)st.st_size < sizeof(probe) || pread(fd, &probe, sizeof(probe), 0) != sizeof(probe) ||
+        probe.magic != OBJC_PCACHE_MAGIC || probe.version != OBJC_PCACHE_VERSION || !probe.clean ||
+        !layout_matches(cache, &probe) || probe.hdr_size + probe.nslots * probe.slab_size != (uint64_t)st.st_size)
+      goto fail;
+    map_size = st.st_size;
+    if (!(hdr = map_aligned(fd, map_size, cache->slab_size, (char *)probe.base - probe.hdr_size)))
+      goto fail;
+    cache->phdr = hdr;
+    if (pfile_checksum(cache) != hdr->checksum) {
+      munmap(hdr, map_size);
+      goto fail;
+    }
+  }
+  close(fd);
+  cache->phdr = hdr;
+  cache->pmap_size = map_size;
+  cache->pslot_hint = 0;
+  hdr->base = (uint64_t)(uintptr_t)slot_addr(cache, 0);
+  /*Until the cache is closed the file is in an unknown state.*/
+  hdr->clean = 0;
+  msync(hdr, PAGE_SIZE, MS_SYNC);
+  return 0;
+
+fail:
+  cache->phdr = NULL;
+  close(fd);
+  return -1;
+}
+
+/*Returns a slot of the file for a new slab, NULL if the file is full.*/
+void *pfile_slab_alloc(objc_cache_t *cache) {
+  objc_phdr_t *hdr = cache->phdr;
+  /*Slots below `pslot_hint` are all in use.*/
+  for (size_t i = cache->pslot_hint; i < hdr->nslots; i++) {
+    if (!bm_get(hdr->used, i)) {
+      bm_set(hdr->used, i);
+      cache->pslot_hint = i + 1;
+      return slot_addr(cache, i);
+    }
+  }
+  return NULL;
+}
+
+/*Gives a slot back, punching a hole in the file so that it doesn't keep the slab's blocks.*/
+void pfile_slab_free(objc_cache_t *cache, void *slab) {
+  objc_phdr_t *hdr = cache->phdr;
+  size_t slot = ((char *)slab - slot_addr(cache, 0)) / cache->slab_size;
+  bm_clear(hdr->used, slot);
+  if (slot < cache->pslot_hint)
+    cache->pslot_hint = slot;
+  madvise(slab, cache->slab_size, MADV_REMOVE);
+}
+
+/*Calls `fn` on every slab of the file.*/
+void pfile_foreach(objc_cache_t *cache, void (*fn)(objc_cache_t *cache, void *slab)) {
+  for (size_t i = 0; i < cache->phdr->nslots; i++) {
+    if (bm_get(cache->phdr->used, i))
+      fn(cache, slot_addr(cache, i));
+  }
+}
+
+/*Writes the checksum and the clean flag and unmaps the file. The slabctls have their pointers cleared already.*/
+void pfile_close(objc_cache_t *cache) {
+  objc_phdr_t *hdr = cache->phdr;
+  msync(hdr, cache->pmap_size, MS_SYNC);
+  hdr->clean = 1;
+  hdr->checksum = pfile_checksum(cache);
+  msync(hdr, PAGE_SIZE, MS_SYNC);
+  munmap(hdr, cache->pmap_size);
+  cache->phdr = NULL;
+}
+
+void objc_cache_set_root(objc_cache_t *cache, void *obj) {
+  if (cache->phdr)
+    cache->phdr->root = obj ? (uint64_t)((char *)obj - slot_addr(cache, 0)) + 1 : 0;
+}
+
+void *objc_cache_root(objc_cache_t *cache) {
+  if (!cache->phdr || !cache->phdr->root)
+    return NULL;
+  return slot_addr(cache, 0) + cache->phdr->root - 1;
+}
@@ -0,0 +1,497 @@
+#define _GNU_SOURCE
+#include "objc_internal.h"
+#include "objcache.h"
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*Sampling heap profiler. Every thread counts down the bytes it allocates and samples the object that takes the
+ * count below zero, then draws the next countdown from an exponential distribution of mean `rate`, so that the
+ * samples form a Poisson process over the allocated bytes. A sampled object of size `s` stands for
+ * `1 / (1 - exp(-s / rate))` objects.
+ *
+ * The call stack of a sample is recorded in a table of sites, one per call stack and cache, holding the sampled
+ * objects in use and all those sampled so far. Sampled objects in use are kept in a linear probing table mapping
+ * their address to their site. A free looks its object up without the lock, in caches that have sampled objects in
+ * use only. Removals shift the following keys back instead of leaving tombstones, so they bump a sequence counter
+ * and a lookup that finds nothing while it changed looks again.
+ *
+ * While the profiler is stopped a thread only checks it every `OBJC_PROFILE_IDLE` bytes, which is also how long a
+ * thread may take to notice that it started.*/
+
+#define OBJC_PROFILE_DEPTH 32       // frames kept per call stack
+#define OBJC_PROFILE_SKIP 1         // frames of the profiler itself
+#define OBJC_PROFILE_SITES 4096     // slots of the site table, a power of 2
+#define OBJC_PROFILE_LIVE 65536     // slots of the table of sampled objects in use, a power of 2
+#define OBJC_PROFILE_IDLE (1 << 20) // bytes between two checks of a thread while the profiler is stopped
+
+#define LN2 0.6931471805599453
+
+typedef struct prof_site {
+  uint64_t hash;       // 0 for an unused slot
+  objc_cache_t *cache; // NULL once the cache is destroyed
+  size_t size;
+  char name[32];
+  int depth;
+  void *pcs[OBJC_PROFILE_DEPTH]; // innermost frame first
+  uint64_t live_objs;            // sampled objects in use
+  uint64_t alloc_objs;           // sampled objects since the start
+} prof_site_t;
+
+__thread int64_t profile_countdown;
+static __thread uint64_t prof_rng;
+static __thread int in_profile; // the thread is sampling or dumping, its own allocations are left out
+
+static struct {
+  pthread_mutex_t lock; // protects the tables and the counters
+  atomic_int active;
+  _Atomic size_t rate;
+  _Atomic unsigned int seq; // odd while keys are moved in `live`
+  uint64_t samples;
+  uint64_t live;
+  uint64_t nsites;
+  uint64_t dropped;
+  prof_site_t sites[OBJC_PROFILE_SITES];
+  _Atomic uintptr_t keys[OBJC_PROFILE_LIVE]; // addresses of the sampled objects in use, 0 for an empty slot
+  uint32_t key_site[OBJC_PROFILE_LIVE];      // site of each key
+} prof = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static struct {
+  pthread_mutex_t lock; // protects the fields below
+  int pipe[2];          // written by the handler, read by the dump thread
+  int started;
+  char path[PATH_MAX];
+  objc_profile_format_t format;
+} sig = {.lock = PTHREAD_MUTEX_INITIALIZER, .pipe = {-1, -1}};
+
+static uint64_t prof_random(void) {
+  if (!prof_rng)
+    prof_rng = ((uintptr_t)&prof_rng ^ (uint64_t)time(NULL) * 0x9e3779b97f4a7c15ULL) | 1;
+  prof_rng ^= prof_rng >> 12;
+  prof_rng ^= prof_rng << 25;
+  prof_rng ^= prof_rng >> 27;
+  return prof_rng * 0x2545f4914f6cdd1dULL;
+}
+
+/*-ln(u) for a uniform u in (0, 1], without libm: u = m * 2^(e - 53) with m in [1, 2) and
+ * ln(m) = 2 atanh((m - 1) / (m + 1)), whose series converges fast as (m - 1) / (m + 1) < 1/3.*/
+static double neg_log_uniform(void) {
+  uint64_t r = (prof_random() >> 11) + 1;
+  int e = 63 - __builtin_clzll(r);
+  double m = (double)r / (double)(1ULL << e);
+  double s = (m - 1) / (m + 1), s2 = s * s;
+  double ln_m = 2 * s * (1 + s2 * (1.0 / 3 + s2 * (1.0 / 5 + s2 * (1.0 / 7 + s2 / 9))));
+  return (53 - e) * LN2 - ln_m;
+}
+
+/*exp(-x) for x >= 0: x = k ln2 + r with r in [0, ln2) and the series of exp(-r).*/
+static double neg_exp(double x) {
+  if (x > 40)
+    return 0;
+  int k = (int)(x / LN2);
+  double r = x - k * LN2, term = 1, sum = 1;
+  for (int i = 1; i < 12; i++) {
+    term *= -r / i;
+    sum += term;
+  }
+  return sum / (double)(1ULL << k);
+}
+
+/*Estimated bytes allocated for `objs` sampled objects of `size` bytes.*/
+static uint64_t prof_unsample(uint64_t objs, size_t size, size_t rate) {
+  return (uint64_t)(objs * size / (1 - neg_exp((double)size / rate)) + 0.5);
+}
+
+static inline size_t ptr_slot(uintptr_t key) {
+  return (size_t)((key >> 4) * 0x9e3779b97f4a7c15ULL >> 32) & (OBJC_PROFILE_LIVE - 1);
+}
+
+/*Returns the slot of `obj`, or -1. Without the lock a miss is only certain if no key moved meanwhile.*/
+static ssize_t live_slot(void *obj) {
+  size_t i = ptr_slot((uintptr_t)obj);
+  for (size_t n = 0; n < OBJC_PROFILE_LIVE; n++, i = (i + 1) & (OBJC_PROFILE_LIVE - 1)) {
+    /*Acquire so that the check of the sequence counter that follows comes after the keys are read.*/
+    uintptr_t key = atomic_load_explicit(&prof.keys[i], memory_order_acquire);
+    if (!key)
+      return -1;
+    if (key == (uintptr_t)obj)
+      return i;
+  }
+  return -1;
+}
+
+/*Lock-free check of whether `obj` is sampled. A miss while keys were moved is retried.*/
+static int live_find(void *obj) {
+  for (;;) {
+    unsigned int seq = atomic_load_explicit(&prof.seq, memory_order_acquire);
+    if (seq & 1)
+      continue;
+    ssize_t i = live_slot(obj);
+    if (i >= 0 || atomic_load_explicit(&prof.seq, memory_order_relaxed) == seq)
+      return i >= 0;
+  }
+}
+
+/*Caller must hold the lock.*/
+static int live_insert(void *obj, uint32_t site) {
+  /*At most half full so that probes stay short.*/
+  if (prof.live >= OBJC_PROFILE_LIVE / 2)
+    return -1;
+  size_t i = ptr_slot((uintptr_t)obj);
+  while (atomic_load_explicit(&prof.keys[i], memory_order_relaxed))
+    i = (i + 1) & (OBJC_PROFILE_LIVE - 1);
+  prof.key_site[i] = site;
+  atomic_store_explicit(&prof.keys[i], (uintptr_t)obj, memory_order_release);
+  return 0;
+}
+
+/*Empties slot `i` and moves back the keys that follow it and probed past it. Caller must hold the lock.*/
+static void live_remove(size_t i) {
+  atomic_fetch_add(&prof.seq, 1);
+  for (size_t j = i;;) {
+    j = (j + 1) & (OBJC_PROFILE_LIVE - 1);
+    uintptr_t key = atomic_load_explicit(&prof.keys[j], memory_order_relaxed);
+    if (!key)
+      break;
+    /*The key stays if its home slot is cyclically in (i, j].*/
+    size_t home = ptr_slot(key);
+    if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+      continue;
+    prof.key_site[i] = prof.key_site[j];
+    atomic_store_explicit(&prof.keys[i], key, memory_order_relaxed);
+    i = j;
+  }
+  atomic_store_explicit(&prof.keys[i], 0, memory_order_relaxed);
+  atomic_fetch_add(&prof.seq, 1);
+}
+
+/*Drops the sampled object in slot `i` from the objects in use. Caller must hold the lock.*/
+static void live_release(objc_cache_t *cache, size_t i) {
+  prof.sites[prof.key_site[i]].live_objs--;
+  prof.live--;
+  atomic_fetch_sub(&cache->prof_live, 1);
+  live_remove(i);
+}
+
+static uint64_t stack_hash(objc_cache_t *cache, void **pcs, int depth) {
+  uint64_t h = (uintptr_t)cache * 0x9e3779b97f4a7c15ULL;
+  for (int i = 0; i < depth; i++)
+    h = (h ^ (uintptr_t)pcs[i]) * 0x100000001b3ULL;
+  return h | 1;
+}
+
+/*Returns the site of the call stack in `cache`, a new one if it wasn't seen yet, or NULL if the table is full.
+ * Caller must hold the lock.*/
+static prof_site_t *site_get(objc_cache_t *cache, uint64_t hash, void **pcs, int depth) {
+  size_t i = hash & (OBJC_PROFILE_SITES - 1);
+  for (size_t n = 0; n < OBJC_PROFILE_SITES; n++, i = (i + 1) & (OBJC_PROFILE_SITES - 1)) {
+    prof_site_t *site = &prof.sites[i];
+    if (!site->hash) {
+      if (prof.nsites >= OBJC_PROFILE_SITES * 3 / 4)
+        return NULL;
+      site->hash = hash;
+      site->cache = cache;
+      site->size = cache->size;
+      if (cache->name)
+        strncpy(site->name, cache->name, sizeof(site->name) - 1);
+      site->depth = depth;
+      memcpy(site->pcs, pcs, depth * sizeof(void *));
+      prof.nsites++;
+      return site;
+    }
+    if (site->hash == hash && site->cache == cache && site->depth == depth &&
+        memcmp(site->pcs, pcs, depth * sizeof(void *)) == 0)
+      return site;
+  }
+  return NULL;
+}
+
+void profile_sample(objc_cache_t *cache, void *obj) {
+  if (in_profile)
+    return;
+  if (!atomic_load_explicit(&prof.active, memory_order_relaxed)) {
+    profile_countdown = OBJC_PROFILE_IDLE;
+    return;
+  }
+  profile_countdown = (int64_t)(neg_log_uniform() * atomic_load_explicit(&prof.rate, memory_order_relaxed)) + 1;
+  if (!obj || (cache->flags & OBJC_CACHE_NOTRACE))
+    return;
+
+  in_profile = 1;
+  void *pcs[OBJC_PROFILE_SKIP + OBJC_PROFILE_DEPTH];
+  int depth = backtrace(pcs, OBJC_PROFILE_SKIP + OBJC_PROFILE_DEPTH) - OBJC_PROFILE_SKIP;
+  if (depth < 0)
+    depth = 0;
+  uint64_t hash = stack_hash(cache, pcs + OBJC_PROFILE_SKIP, depth);
+
+  pthread_mutex_lock(&prof.lock);
+  prof.samples++;
+  prof_site_t *site = site_get(cache, hash, pcs + OBJC_PROFILE_SKIP, depth);
+  if (site) {
+    site->alloc_objs++;
+    if (live_insert(obj, site - prof.sites) == 0) {
+      site->live_objs++;
+      prof.live++;
+      atomic_fetch_add(&cache->prof_live, 1);
+    } else {
+      prof.dropped++;
+    }
+  } else {
+    prof.dropped++;
+  }
+  pthread_mutex_unlock(&prof.lock);
+  in_profile = 0;
+}
+
+void profile_free(objc_cache_t *cache, void *obj) {
+  if (!live_find(obj))
+    return;
+  pthread_mutex_lock(&prof.lock);
+  ssize_t i = live_slot(obj);
+  if (i >= 0)
+    live_release(cache, i);
+  pthread_mutex_unlock(&prof.lock);
+}
+
+void profile_move(objc_cache_t *cache, void *old_obj, void *new_obj) {
+  pthread_mutex_lock(&prof.lock);
+  ssize_t i = live_slot(old_obj);
+  if (i >= 0) {
+    uint32_t site = prof.key_site[i];
+    live_remove(i);
+    prof.live--;
+    if (live_insert(new_obj, site) == 0) {
+      prof.live++;
+    } else {
+      prof.sites[site].live_objs--;
+      atomic_fetch_sub(&cache->prof_live, 1);
+      prof.dropped++;
+    }
+  }
+  pthread_mutex_unlock(&prof.lock);
+}
+
+/*The objects of a destroyed cache are no longer in use, and a new cache at the same address gets its own sites.*/
+void profile_forget(objc_cache_t *cache) {
+  pthread_mutex_lock(&prof.lock);
+  for (size_t i = 0; i < OBJC_PROFILE_LIVE; i++) {
+    /*A removal can move the next key into slot `i`.*/
+    uintptr_t key;
+    while ((key = atomic_load_explicit(&prof.keys[i], memory_order_relaxed)) &&
+           prof.sites[prof.key_site[i]].cache == cache)
+      live_release(cache, i);
+  }
+  for (size_t i = 0; i < OBJC_PROFILE_SITES; i++) {
+    if (prof.sites[i].hash && prof.sites[i].cache == cache)
+      prof.sites[i].cache = NULL;
+  }
+  pthread_mutex_unlock(&prof.lock);
+}
+
+int objc_profile_start(size_t sample_bytes) {
+  if (!sample_bytes)
+    return -1;
+  /*The first backtrace loads the unwinder, which allocates.*/
+  void *pc;
+  in_profile = 1;
+  backtrace(&pc, 1);
+  in_profile = 0;
+
+  pthread_mutex_lock(&prof.lock);
+  if (atomic_load(&prof.active)) {
+    pthread_mutex_unlock(&prof.lock);
+    return -1;
+  }
+  /*Objects of the previous profile still in use are forgotten.*/
+  atomic_fetch_add(&prof.seq, 1);
+  for (size_t i = 0; i < OBJC_PROFILE_LIVE; i++) {
+    if (atomic_load_explicit(&prof.keys[i], memory_order_relaxed)) {
+      atomic_fetch_sub(&prof.sites[prof.key_site[i]].cache->prof_live, 1);
+      atomic_store_explicit(&prof.keys[i], 0, memory_order_relaxed);
+    }
+  }
+  atomic_fetch_add(&prof.seq, 1);
+  memset(prof.sites, 0, sizeof(prof.sites));
+  prof.samples = prof.live = prof.nsites = prof.dropped = 0;
+  atomic_store(&prof.rate, sample_bytes);
+  atomic_store(&prof.active, 1);
+  pthread_mutex_unlock(&prof.lock);
+  return 0;
+}
+
+void objc_profile_stop(void) { atomic_store(&prof.active, 0); }
+
+objc_profile_stats_t objc_profile_stats(void) {
+  pthread_mutex_lock(&prof.lock);
+  objc_profile_stats_t stats = {.sample_bytes = atomic_load(&prof.rate),
+                                .samples = prof.samples,
+                                .live = prof.live,
+                                .sites = prof.nsites,
+                                .dropped = prof.dropped};
+  pthread_mutex_unlock(&prof.lock);
+  return stats;
+}
+
+/*Writes the name of a frame from its `backtrace_symbols` string `module(symbol+0xoff) [0xaddr]`: the symbol, or
+ * the file name of the module and the offset for frames without a dynamic symbol.*/
+static void frame_name(FILE *out, const char *sym) {
+  const char *open = strchr(sym, '(');
+  const char *close = open ? strchr(open, ')') : NULL;
+  if (!close) {
+    fprintf(out, "%.*s", (int)strcspn(sym, " "), sym);
+    return;
+  }
+  const char *plus = memchr(open, '+', close - open);
+  if (plus && plus > open + 1) {
+    fprintf(out, "%.*s", (int)(plus - open - 1), open + 1);
+    return;
+  }
+  const char *base = memrchr(sym, '/', open - sym);
+  base = base ? base + 1 : sym;
+  fprintf(out, "%.*s", (int)(open - base), base);
+  if (plus)
+    fprintf(out, "%.*s", (int)(close - plus), plus);
+}
+
+static void dump_folded(FILE *out, prof_site_t *sites, size_t n, size_t rate, int alloc) {
+  for (size_t s = 0; s < n; s++) {
+    prof_site_t *site = &sites[s];
+    uint64_t objs = alloc ? site->alloc_objs : site->live_objs;
+    if (!objs)
+      continue;
+    char **syms = backtrace_symbols(site->pcs, site->depth);
+    for (int i = site->depth - 1; i >= 0; i--) {
+      if (syms)
+        frame_name(out, syms[i]);
+      else
+        fprintf(out, "%p", site->pcs[i]);
+      fputc(';', out);
+    }
+    free(syms);
+    fprintf(out, "[%s] %llu\n", site->name, (unsigned long long)prof_unsample(objs, site->size, rate));
+  }
+}
+
+static void dump_pprof(FILE *out, prof_site_t *sites, size_t n, size_t rate) {
+  uint64_t live_objs = 0, live_bytes = 0, alloc_objs = 0, alloc_bytes = 0;
+  for (size_t s = 0; s < n; s++) {
+    live_objs += sites[s].live_objs;
+    live_bytes += sites[s].live_objs * sites[s].size;
+    alloc_objs += sites[s].alloc_objs;
+    alloc_bytes += sites[s].alloc_objs * sites[s].size;
+  }
+  fprintf(out, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu\n", (unsigned long long)live_objs,
+          (unsigned long long)live_bytes, (unsigned long long)alloc_objs, (unsigned long long)alloc_bytes, rate);
+  for (size_t s = 0; s < n; s++) {
+    prof_site_t *site = &sites[s];
+    fprintf(out, "%llu: %llu [%llu: %llu] @", (unsigned long long)site->live_objs,
+            (unsigned long long)(site->live_objs * site->size), (unsigned long long)site->alloc_objs,
+            (unsigned long long)(site->alloc_objs * site->size));
+    for (int i = 0; i < site->depth; i++)
+      fprintf(out, " %p", site->pcs[i]);
+    fputc('\n', out);
+  }
+  /*pprof symbolizes the addresses with the mappings of the process.*/
+  fprintf(out, "\nMAPPED_LIBRARIES:\n");
+  int fd = open("/proc/self/maps", O_RDONLY);
+  if (fd >= 0) {
+    char buf[4096];
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+      fwrite(buf, 1, len, out);
+    close(fd);
+  }
+}
+
+int objc_profile_dump(FILE *out, objc_profile_format_t format) {
+  in_profile = 1;
+  /*The sites are copied out so that the lock isn't held while symbols are looked up and the output written.*/
+  prof_site_t *sites = malloc(sizeof(prof.sites));
+  if (!sites) {
+    in_profile = 0;
+    return -1;
+  }
+  pthread_mutex_lock(&prof.lock);
+  size_t n = 0;
+  for (size_t i = 0; i < OBJC_PROFILE_SITES; i++) {
+    if (prof.sites[i].hash)
+      sites[n++] = prof.sites[i];
+  }
+  size_t rate = atomic_load(&prof.rate);
+  pthread_mutex_unlock(&prof.lock);
+
+  if (format == OBJC_PROFILE_PPROF)
+    dump_pprof(out, sites, n, rate ? rate : 1);
+  else
+    dump_folded(out, sites, n, rate ? rate : 1, format == OBJC_PROFILE_FOLDED_ALLOC);
+  free(sites);
+  in_profile = 0;
+  return fflush(out) == 0 && !ferror(out) ? 0 : -1;
+}
+
+static void sig_handler(int signo) {
+  int saved = errno;
+  char c = 0;
+  if (write(sig.pipe[1], &c, 1) < 0) {
+    /*The pipe is full: a dump is pending already.*/
+  }
+  errno = saved;
+}
+
+static void *sig_main(void *arg) {
+  char c;
+  for (;;) {
+    ssize_t n = read(sig.pipe[0], &c, 1);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return NULL;
+    char path[PATH_MAX];
+    pthread_mutex_lock(&sig.lock);
+    memcpy(path, sig.path, sizeof(path));
+    objc_profile_format_t format = sig.format;
+    pthread_mutex_unlock(&sig.lock);
+    FILE *out = fopen(path, "w");
+    if (out) {
+      objc_profile_dump(out, format);
+      fclose(out);
+    }
+  }
+}
+
+int objc_profile_signal(int signo, const char *path, objc_profile_format_t format) {
+  if (!path || strlen(path) >= sizeof(sig.path))
+    return -1;
+  pthread_mutex_lock(&sig.lock);
+  if (!sig.started) {
+    pthread_t thread;
+    if (pipe2(sig.pipe, O_CLOEXEC) < 0) {
+      pthread_mutex_unlock(&sig.lock);
+      return -1;
+    }
+    /*The handler must never block.*/
+    fcntl(sig.pipe[1], F_SETFL, O_NONBLOCK);
+    if (pthread_create(&thread, NULL, sig_main, NULL) != 0) {
+      close(sig.pipe[0]);
+      close(sig.pipe[1]);
+      pthread_mutex_unlock(&sig.lock);
+      return -1;
+    }
+    pthread_detach(thread);
+    sig.started = 1;
+  }
+  strcpy(sig.path, path);
+  sig.format = format;
+  struct sigaction sa = {.sa_handler = sig_handler, .sa_flags = SA_RESTART};
+  sigemptyset(&sa.sa_mask);
+  int ret = sigaction(signo, &sa, NULL);
+  pthread_mutex_unlock(&sig.lock);
+  return ret;
+}
@@ -0,0 +1,141 @@
+#include "objc_internal.h"
+#include "objcache.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*Background reaper. Every interval it trims each cache of the registry down to its working set: the free slabs a
+ * cache kept through the whole interval (the lowest number of free slabs it had since the previous pass) are
+ * released, the slabs it went through are kept for the next burst. Before every pass the pressure check runs, and
+ * while it reports pressure every cache gives back all of its free slabs and the objects held by its depot.*/
+
+static struct {
+  pthread_mutex_t lock; // protects the fields below
+  pthread_cond_t wake;
+  pthread_t thread;
+  int running;
+  int stopping; // set while `objc_reaper_stop` waits for the thread
+  unsigned int interval_ms;
+  size_t rss_limit;
+  int (*pressure)(void *arg);
+  void *arg;
+} reaper = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static pthread_once_t wake_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pass_lock = PTHREAD_MUTEX_INITIALIZER; // one pass at a time
+
+int objc_pressure_rss(void *arg) {
+  size_t limit = *(size_t *)arg;
+  char buf[64];
+  int fd = open("/proc/self/statm", O_RDONLY);
+  if (fd < 0)
+    return 0;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return 0;
+  buf[n] = '\0';
+  /*The second field is the resident set size in pages.*/
+  char *p = buf;
+  strtoull(p, &p, 10);
+  unsigned long long resident = strtoull(p, NULL, 10);
+  return limit && resident * sysconf(_SC_PAGESIZE) > limit;
+}
+
+/*Called with the cache pinned in the registry, so it can't be destroyed under us. The registry isn't locked:
+ * destructors run by the trim may create and destroy caches.*/
+static void pass_trim(objc_cache_t *cache, void *reaped) { *(size_t *)reaped += cache_trim(cache); }
+
+static void pass_reap(objc_cache_t *cache, void *reaped) { *(size_t *)reaped += objc_cache_reap(cache, 0); }
+
+size_t objc_reaper_run(int pressure) {
+  pthread_mutex_lock(&pass_lock);
+  size_t reaped = 0;
+  registry_foreach_unlocked(pressure ? pass_reap : pass_trim, &reaped);
+  pthread_mutex_unlock(&pass_lock);
+  return reaped;
+}
+
+static void wake_init(void) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&reaper.wake, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+static void *reaper_main(void *arg) {
+  pthread_mutex_lock(&reaper.lock);
+  while (reaper.running) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += reaper.interval_ms / 1000;
+    ts.tv_nsec += (long)(reaper.interval_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    while (reaper.running && pthread_cond_timedwait(&reaper.wake, &reaper.lock, &ts) == 0)
+      ;
+    if (!reaper.running)
+      break;
+    int (*pressure)(void *) = reaper.pressure;
+    void *parg = reaper.arg;
+    pthread_mutex_unlock(&reaper.lock);
+
+    objc_reaper_run(pressure && pressure(parg));
+
+    pthread_mutex_lock(&reaper.lock);
+  }
+  pthread_mutex_unlock(&reaper.lock);
+  return NULL;
+}
+
+int objc_reaper_start(unsigned int interval_ms, size_t rss_limit) {
+  pthread_once(&wake_once, wake_init);
+  pthread_mutex_lock(&reaper.lock);
+  if (reaper.running || reaper.stopping || !interval_ms) {
+    pthread_mutex_unlock(&reaper.lock);
+    return -1;
+  }
+  reaper.interval_ms = interval_ms;
+  reaper.rss_limit = rss_limit;
+  if (rss_limit) {
+    reaper.pressure = objc_pressure_rss;
+    reaper.arg = &reaper.rss_limit;
+  }
+  reaper.running = 1;
+  if (pthread_create(&reaper.thread, NULL, reaper_main, NULL) != 0) {
+    reaper.running = 0;
+    pthread_mutex_unlock(&reaper.lock);
+    return -1;
+  }
+  pthread_mutex_unlock(&reaper.lock);
+  return 0;
+}
+
+void objc_reaper_stop(void) {
+  pthread_mutex_lock(&reaper.lock);
+  if (!reaper.running) {
+    pthread_mutex_unlock(&reaper.lock);
+    return;
+  }
+  reaper.running = 0;
+  reaper.stopping = 1;
+  pthread_cond_signal(&reaper.wake);
+  pthread_mutex_unlock(&reaper.lock);
+  pthread_join(reaper.thread, NULL);
+  pthread_mutex_lock(&reaper.lock);
+  reaper.stopping = 0;
+  pthread_mutex_unlock(&reaper.lock);
+}
+
+void objc_reaper_set_pressure(int (*fn)(void *arg), void *arg) {
+  pthread_mutex_lock(&reaper.lock);
+  reaper.pressure = fn;
+  reaper.arg = arg;
+  pthread_mutex_unlock(&reaper.lock);
+}
@@ -0,0 +1,174 @@
+#include "objc_internal.h"
+#include "objcache.h"
+#include <pthread.h>
+#include <stdio.h>
+
+/*Registry of all live caches and their statistics. Hot path counters are bumped by the thread that owns them:
+ * magazine hits in the thread's tcache and slab layer events in the cache under its lock. They are only added
+ * up when the stats are read.*/
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t registry_unpinned = PTHREAD_COND_INITIALIZER;
+static objc_cache_t *registry;
+
+void registry_add(objc_cache_t *cache) {
+  pthread_mutex_lock(&registry_lock);
+  cache->reg_pins = 0;
+  cache->reg_prev = NULL;
+  cache->reg_next = registry;
+  if (registry)
+    registry->reg_prev = cache;
+  registry = cache;
+  pthread_mutex_unlock(&registry_lock);
+  trace_register(cache);
+}
+
+/*Waits until no `registry_foreach_unlocked` is on the cache, its links are followed once it returns.*/
+void registry_del(objc_cache_t *cache) {
+  pthread_mutex_lock(&registry_lock);
+  while (cache->reg_pins)
+    pthread_cond_wait(&registry_unpinned, &registry_lock);
+  if (cache->reg_prev)
+    cache->reg_prev->reg_next = cache->reg_next;
+  else
+    registry = cache->reg_next;
+  if (cache->reg_next)
+    cache->reg_next->reg_prev = cache->reg_prev;
+  pthread_mutex_unlock(&registry_lock);
+}
+
+/*Calls `fn` on every live cache with the registry locked.*/
+void registry_foreach(void (*fn)(objc_cache_t *cache)) {
+  pthread_mutex_lock(&registry_lock);
+  for (objc_cache_t *cache = registry; cache; cache = cache->reg_next)
+    fn(cache);
+  pthread_mutex_unlock(&registry_lock);
+}
+
+/*Calls `fn` on every live cache without holding the registry lock, so that `fn` may take cache locks or run
+ * destructors that create or destroy caches. The cache being visited is pinned: it stays in the registry, and can't be
+ * destroyed, until `fn` returns. Caches created meanwhile may be skipped.*/
+void registry_foreach_unlocked(void (*fn)(objc_cache_t *cache, void *arg), void *arg) {
+  pthread_mutex_lock(&registry_lock);
+  objc_cache_t *cache = registry;
+  while (cache) {
+    cache->reg_pins++;
+    pthread_mutex_unlock(&registry_lock);
+    fn(cache, arg);
+    pthread_mutex_lock(&registry_lock);
+    objc_cache_t *next = cache->reg_next;
+    if (--cache->reg_pins == 0)
+      pthread_cond_broadcast(&registry_unpinned);
+    cache = next;
+  }
+  pthread_mutex_unlock(&registry_lock);
+}
+
+objc_cache_stats_t objc_cache_stats(objc_cache_t *cache) {
+  objc_cache_stats_t stats;
+
+  pthread_mutex_lock(&cache->lock);
+  stats = cache->stats;
+  stats.slabs_full = stats.slabs_partial = stats.slabs_free = 0;
+  stats.partial_inuse = 0;
+  for (objc_slabctl_t *cur = cache->slabs_full; cur; cur = cur->next)
+    stats.slabs_full++;
+  for (objc_slabctl_t *cur = cache->slabs_free; cur; cur = cur->next)
+    stats.slabs_free++;
+  for (int i = 0; i < OBJC_PARTIAL_BINS; i++) {
+    for (objc_slabctl_t *cur = cache->slabs_partial[i]; cur; cur = cur->next) {
+      stats.slabs_partial++;
+      stats.partial_inuse += cur->ref_count;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  /*Slab layer counters only see the objects that went through the slabs. Magazine hits are added on top.*/
+  stats.inuse = stats.allocs - stats.frees;
+  stats.partial_occupancy =
+      stats.slabs_partial ? (double)stats.partial_inuse / ((double)stats.slabs_partial * cache->total_buf) : 0;
+
+  uint64_t mag_allocs = 0, mag_frees = 0;
+  if (cache->mag_size) {
+    pthread_mutex_lock(&cache->depot_lock);
+    mag_allocs = cache->stats.mag_allocs;
+    mag_frees = cache->stats.mag_frees;
+    for (objc_tcache_t *tc = cache->tcaches; tc; tc = tc->next) {
+      mag_allocs += atomic_load_explicit(&tc->allocs, memory_order_relaxed);
+      mag_frees += atomic_load_explicit(&tc->frees, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&cache->depot_lock);
+  }
+  stats.mag_allocs = mag_allocs;
+  stats.mag_frees = mag_frees;
+  stats.allocs += mag_allocs;
+  stats.frees += mag_frees;
+  /*The counters are read one after the other so a concurrent free can be seen before its allocation.*/
+  stats.live = stats.allocs > stats.frees ? stats.allocs - stats.frees : 0;
+  return stats;
+}
+
+/*Writes `name` as a JSON string.*/
+static void json_string(FILE *out, const char *name) {
+  fputc('"', out);
+  for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+    if (*p == '"' || *p == '\\')
+      fprintf(out, "\\%c", *p);
+    else if (*p < 0x20)
+      fprintf(out, "\\u%04x", *p);
+    else
+      fputc(*p, out);
+  }
+  fputc('"', out);
+}
+
+typedef struct dump {
+  FILE *out;
+  objc_stats_format_t format;
+  int count; // caches written so far
+} dump_t;
+
+static void dump_cache(objc_cache_t *cache, void *arg) {
+  dump_t *dump = arg;
+  FILE *out = dump->out;
+  objc_cache_stats_t st = objc_cache_stats(cache);
+  /*Keys are written in the same order for both formats.*/
+  const char *keys[] = {"size",         "slab_size",  "total_buf",     "slabs",          "slabs_full",
+                        "slabs_partial", "slabs_free", "allocs",        "frees",          "mag_allocs",
+                        "mag_frees",     "partial_hits", "free_hits",   "slabs_created",  "slabs_released",
+                        "ctor_calls",    "bitmap_hits", "remote_frees", "live",           "inuse",
+                        "peak_inuse",    "partial_inuse"};
+  uint64_t slabs = st.slabs_full + st.slabs_partial + st.slabs_free; // counted under the cache lock
+  uint64_t values[] = {cache->size,      cache->slab_size,  cache->total_buf,  slabs,
+                       st.slabs_full,    st.slabs_partial,  st.slabs_free,     st.allocs,
+                       st.frees,         st.mag_allocs,     st.mag_frees,      st.partial_hits,
+                       st.free_hits,     st.slabs_created,  st.slabs_released, st.ctor_calls,
+                       st.bitmap_hits,   st.remote_frees,   st.live,           st.inuse,
+                       st.peak_inuse,    st.partial_inuse};
+  int n = sizeof(values) / sizeof(values[0]);
+
+  if (dump->format == OBJC_STATS_JSON) {
+    fprintf(out, "%s{\"name\": ", dump->count ? ", " : "");
+    json_string(out, cache->name);
+    for (int i = 0; i < n; i++)
+      fprintf(out, ", \"%s\": %llu", keys[i], (unsigned long long)values[i]);
+    fprintf(out, ", \"partial_occupancy\": %.4f}", st.partial_occupancy);
+  } else {
+    fprintf(out, "cache=%s", cache->name);
+    for (int i = 0; i < n; i++)
+      fprintf(out, " %s=%llu", keys[i], (unsigned long long)values[i]);
+    fprintf(out, " partial_occupancy=%.4f\n", st.partial_occupancy);
+  }
+  dump->count++;
+}
+
+/*Goes through the pinned walk: the registry lock isn't held while a cache is locked, so a destructor that creates a
+ * cache under the lock of another one can't deadlock with a dump.*/
+void objc_stats_dump(FILE *out, objc_stats_format_t format) {
+  dump_t dump = {out, format, 0};
+  if (format == OBJC_STATS_JSON)
+    fprintf(out, "{\"caches\": [");
+  registry_foreach_unlocked(dump_cache, &dump);
+  if (format == OBJC_STATS_JSON)
+    fprintf(out, "]}\n");
+}
@@ -0,0 +1,155 @@
+#include "objc_internal.h"
+#include "objcache.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/*Allocation trace recording. While a trace is active every alloc and free of a traced cache appends a 16 byte
+ * record to a ring of records in a file mapped with `MAP_SHARED`, so the trace survives a crash of the process.
+ * A record slot is reserved with a single atomic add on the head of the ring. When the ring is full the oldest
+ * records are overwritten. The caches are described once in the header of the file, see `objc_trace_hdr_t`.*/
+
+atomic_int trace_active;
+
+static struct {
+  pthread_mutex_t lock; // serializes start/stop
+  objc_trace_hdr_t *hdr;
+  objc_trace_rec_t *recs;
+  size_t map_size;
+  atomic_int writers; // recorders currently writing into the mapping
+  atomic_int threads; // number of threads that recorded so far
+  atomic_int gen;     // bumped by every start so that threads get new ids in every trace
+} trace = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static __thread uint8_t trace_thread;
+static __thread int trace_gen;
+static __thread uint64_t trace_last_ns;
+
+static uint64_t trace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*Gives the cache an id in the active trace and describes it in the header. Caches that don't fit in the header
+ * and internal caches keep the id 0 and are not traced. Caller must hold `trace.lock`.*/
+static void trace_add(objc_cache_t *cache) {
+  if (!trace.hdr || atomic_load(&cache->trace_id) || (cache->flags & OBJC_CACHE_NOTRACE))
+    return;
+  uint32_t n = trace.hdr->ncaches;
+  if (n == OBJC_TRACE_MAX_CACHES)
+    return;
+  objc_trace_cache_t *tc = &trace.hdr->caches[n];
+  tc->size = cache->size;
+  tc->align = cache->align;
+  tc->flags = cache->flags;
+  strncpy(tc->name, cache->name, sizeof(tc->name) - 1);
+  trace.hdr->ncaches = n + 1;
+  atomic_store(&cache->trace_id, n + 1);
+}
+
+static void trace_del(objc_cache_t *cache) { atomic_store(&cache->trace_id, 0); }
+
+/*Called for every new cache.*/
+void trace_register(objc_cache_t *cache) {
+  pthread_mutex_lock(&trace.lock);
+  trace_add(cache);
+  pthread_mutex_unlock(&trace.lock);
+}
+
+void trace_record(objc_cache_t *cache, int op, void *obj) {
+  uint16_t id = atomic_load_explicit(&cache->trace_id, memory_order_relaxed);
+  if (!id || !obj)
+    return;
+  atomic_fetch_add(&trace.writers, 1);
+  /*`objc_trace_stop` may have unmapped the trace between the check of `trace_active` and now.*/
+  if (atomic_load(&trace_active)) {
+    int gen = atomic_load_explicit(&trace.gen, memory_order_relaxed);
+    if (trace_gen != gen) {
+      /*Threads past the 255th share the last id.*/
+      int n = atomic_fetch_add(&trace.threads, 1) + 1;
+      trace_thread = n > UINT8_MAX ? UINT8_MAX : n;
+      trace_gen = gen;
+      trace_last_ns = 0;
+    }
+    uint64_t now = trace_now();
+    uint64_t delta = trace_last_ns ? now - trace_last_ns : 0;
+    trace_last_ns = now;
+
+    uint64_t i = atomic_fetch_add_explicit(&trace.hdr->head, 1, memory_order_relaxed);
+    objc_trace_rec_t *rec = &trace.recs[i % trace.hdr->capacity];
+    rec->obj = (uint64_t)(uintptr_t)obj;
+    rec->delta = delta > UINT32_MAX ? UINT32_MAX : (uint32_t)delta;
+    rec->cache = id;
+    rec->op = op;
+    rec->thread = trace_thread;
+  }
+  atomic_fetch_sub(&trace.writers, 1);
+}
+
+int objc_trace_start(const char *path, size_t capacity) {
+  if (!capacity)
+    return -1;
+  pthread_mutex_lock(&trace.lock);
+  if (trace.hdr) {
+    pthread_mutex_unlock(&trace.lock);
+    return -1;
+  }
+
+  size_t hdr_size = ALIGN_UP(sizeof(objc_trace_hdr_t), PAGE_SIZE);
+  size_t map_size = hdr_size + capacity * sizeof(objc_trace_rec_t);
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    pthread_mutex_unlock(&trace.lock);
+    return -1;
+  }
+  void *p = MAP_FAILED;
+  if (ftruncate(fd, map_size) == 0)
+    p = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    pthread_mutex_unlock(&trace.lock);
+    return -1;
+  }
+
+  /*The file was truncated so the header starts zeroed.*/
+  objc_trace_hdr_t *hdr = p;
+  hdr->magic = OBJC_TRACE_MAGIC;
+  hdr->version = OBJC_TRACE_VERSION;
+  hdr->rec_size = sizeof(objc_trace_rec_t);
+  hdr->rec_offset = hdr_size;
+  hdr->capacity = capacity;
+  trace.hdr = hdr;
+  trace.recs = (objc_trace_rec_t *)((char *)p + hdr_size);
+  trace.map_size = map_size;
+  atomic_store(&trace.threads, 0);
+  atomic_fetch_add(&trace.gen, 1);
+
+  /*Every live cache is described in the header before the first record.*/
+  registry_foreach(trace_add);
+  atomic_store(&trace_active, 1);
+  pthread_mutex_unlock(&trace.lock);
+  return 0;
+}
+
+void objc_trace_stop(void) {
+  pthread_mutex_lock(&trace.lock);
+  if (!trace.hdr) {
+    pthread_mutex_unlock(&trace.lock);
+    return;
+  }
+  atomic_store(&trace_active, 0);
+  while (atomic_load(&trace.writers))
+    sched_yield();
+
+  registry_foreach(trace_del);
+  msync(trace.hdr, trace.map_size, MS_SYNC);
+  munmap(trace.hdr, trace.map_size);
+  trace.hdr = NULL;
+  trace.recs = NULL;
+  pthread_mutex_unlock(&trace.lock);
+}
@@ -0,0 +1,206 @@
+#include "objc_internal.h"
+#include "objcache.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*Iteration over the allocated objects of a cache. The cache stays locked for the whole walk. The full and partial
+ * slabs are collected and sorted by address, free slabs are never looked at. Every buffer of a full slab is
+ * allocated. For a partial slab a map of its free buffers is built from its free list first and only the other
+ * buffers are visited, in address order.*/
+
+struct objc_walk {
+  objc_cache_t *cache;
+  objc_slabctl_t **slabs; // full and partial slabs sorted by address
+  size_t nslabs;
+  size_t slab;            // slab being walked
+  uint32_t idx;           // next buffer of the slab
+  uint8_t *free_map;      // bit `i` set if buffer `i` of the slab is free
+};
+
+static int slab_cmp(const void *a, const void *b) {
+  char *x = (char *)*(objc_slabctl_t *const *)a, *y = (char *)*(objc_slabctl_t *const *)b;
+  return (x > y) - (x < y);
+}
+
+/*Marks the free buffers of a partial slab in `free_map`. Objects on the remote free list aren't marked, they are
+ * still allocated as far as the slab knows.*/
+void slab_free_map(objc_cache_t *cache, objc_slabctl_t *slabctl, uint8_t *free_map) {
+  memset(free_map, 0, BM_BYTES(cache->total_buf));
+  if (slabctl->ref_count == (int)cache->total_buf)
+    return;
+  if (cache->idx_size) {
+    void *idx_list = (char *)slabctl + cache->idx_offset;
+    for (uint32_t idx = slabctl->free_idx; idx != OBJC_IDX_NONE; idx = idx_get(cache, idx_list, idx))
+      bm_set(free_map, idx);
+  } else {
+    for (objc_bufctl_t *b = slabctl->freebuf; b; b = b->next)
+      bm_set(free_map, getobj_idx(cache, slabctl, (char *)b - cache->bufctl_offset));
+  }
+}
+
+/*Fills `objs` with up to `n` allocated objects of `slabctl` starting at buffer `*idx`.*/
+static int slab_next(objc_cache_t *cache, objc_slabctl_t *slabctl, uint8_t *free_map, uint32_t *idx, void **objs,
+                     int n) {
+  char *bufs = slab_bufs(cache, slabctl);
+  int count = 0;
+  for (; *idx < cache->total_buf && count < n; (*idx)++) {
+    if (!bm_get(free_map, *idx))
+      objs[count++] = bufs + (size_t)*idx * cache->buffer_size;
+  }
+  return count;
+}
+
+objc_walk_t *objc_walk_begin(objc_cache_t *cache) {
+  objc_walk_t *walk = malloc(sizeof(*walk));
+  if (!walk)
+    return NULL;
+  walk->free_map = malloc(BM_BYTES(cache->total_buf));
+  /*Objects held by the depot are free for the application, give them back to their slabs first.*/
+  if (cache->mag_size)
+    mag_purge(cache);
+
+  pthread_mutex_lock(&cache->lock);
+  remote_drain(cache);
+  size_t nslabs = cache->slab_count;
+  walk->slabs = malloc((nslabs ? nslabs : 1) * sizeof(objc_slabctl_t *));
+  if (!walk->slabs || !walk->free_map) {
+    pthread_mutex_unlock(&cache->lock);
+    free(walk->slabs);
+    free(walk->free_map);
+    free(walk);
+    return NULL;
+  }
+  walk->nslabs = 0;
+  for (objc_slabctl_t *cur = cache->slabs_full; cur; cur = cur->next)
+    walk->slabs[walk->nslabs++] = cur;
+  for (int i = 0; i < OBJC_PARTIAL_BINS; i++) {
+    for (objc_slabctl_t *cur = cache->slabs_partial[i]; cur; cur = cur->next)
+      walk->slabs[walk->nslabs++] = cur;
+  }
+  /*Slabctls are at the same offset of every slab, or off-slab in which case the base is compared.*/
+  if (cache->flags & OBJC_CACHE_OFFSLAB) {
+    for (size_t i = 0; i < walk->nslabs; i++)
+      walk->slabs[i] = (objc_slabctl_t *)((objc_offslab_t *)walk->slabs[i])->base;
+    qsort(walk->slabs, walk->nslabs, sizeof(objc_slabctl_t *), slab_cmp);
+    for (size_t i = 0; i < walk->nslabs; i++)
+      walk->slabs[i] = offslab_lookup(cache, walk->slabs[i]);
+  } else {
+    qsort(walk->slabs, walk->nslabs, sizeof(objc_slabctl_t *), slab_cmp);
+  }
+  walk->cache = cache;
+  walk->slab = 0;
+  walk->idx = 0;
+  if (walk->nslabs)
+    slab_free_map(cache, walk->slabs[0], walk->free_map);
+  return walk;
+}
+
+int objc_walk_next(objc_walk_t *walk, void **objs, int n) {
+  int count = 0;
+  while (count < n && walk->slab < walk->nslabs) {
+    count += slab_next(walk->cache, walk->slabs[walk->slab], walk->free_map, &walk->idx, objs + count, n - count);
+    if (walk->idx == walk->cache->total_buf && ++walk->slab < walk->nslabs) {
+      walk->idx = 0;
+      slab_free_map(walk->cache, walk->slabs[walk->slab], walk->free_map);
+    }
+  }
+  return count;
+}
+
+void objc_walk_end(objc_walk_t *walk) {
+  pthread_mutex_unlock(&walk->cache->lock);
+  free(walk->slabs);
+  free(walk->free_map);
+  free(walk);
+}
+
+#define WALK_CHUNK 64
+
+int objc_cache_walk(objc_cache_t *cache, objc_walk_fn fn, void *arg) {
+  objc_walk_t *walk = objc_walk_begin(cache);
+  if (!walk)
+    return -1;
+  void *objs[WALK_CHUNK];
+  int ret = 0;
+  for (int n; !ret && (n = objc_walk_next(walk, objs, WALK_CHUNK)) > 0;) {
+    for (int i = 0; i < n && !ret; i++)
+      ret = fn(objs[i], arg);
+  }
+  objc_walk_end(walk);
+  return ret;
+}
+
+/*A worker of a parallel walk visits a contiguous range of the sorted slabs.*/
+typedef struct walk_worker {
+  pthread_t tid;
+  int started;
+  objc_walk_t *walk;
+  size_t first, last;
+  objc_walk_fn fn;
+  void *arg;
+  _Atomic int *stop; // first non-zero value returned by `fn` in any worker
+  uint8_t *free_map;
+} walk_worker_t;
+
+static void *walk_worker(void *p) {
+  walk_worker_t *w = p;
+  objc_cache_t *cache = w->walk->cache;
+  void *objs[WALK_CHUNK];
+  for (size_t s = w->first; s < w->last && !atomic_load_explicit(w->stop, memory_order_relaxed); s++) {
+    objc_slabctl_t *slabctl = w->walk->slabs[s];
+    slab_free_map(cache, slabctl, w->free_map);
+    uint32_t idx = 0;
+    for (int n; (n = slab_next(cache, slabctl, w->free_map, &idx, objs, WALK_CHUNK)) > 0;) {
+      for (int i = 0; i < n; i++) {
+        int ret = w->fn(objs[i], w->arg);
+        if (ret) {
+          int expected = 0;
+          atomic_compare_exchange_strong(w->stop, &expected, ret);
+          return NULL;
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+int objc_cache_walk_parallel(objc_cache_t *cache, objc_walk_fn fn, void *arg, int nthreads) {
+  if (nthreads <= 1)
+    return objc_cache_walk(cache, fn, arg);
+  objc_walk_t *walk = objc_walk_begin(cache);
+  if (!walk)
+    return -1;
+  walk_worker_t *workers = calloc(nthreads, sizeof(walk_worker_t));
+  uint8_t *maps = malloc((size_t)nthreads * BM_BYTES(cache->total_buf));
+  if (!workers || !maps) {
+    objc_walk_end(walk);
+    free(workers);
+    free(maps);
+    return -1;
+  }
+  _Atomic int stop = 0;
+  /*The calling thread is worker 0. Workers whose thread can't be created are walked by it too.*/
+  for (int i = 0; i < nthreads; i++) {
+    walk_worker_t *w = &workers[i];
+    w->walk = walk;
+    w->first = walk->nslabs * i / nthreads;
+    w->last = walk->nslabs * (i + 1) / nthreads;
+    w->fn = fn;
+    w->arg = arg;
+    w->stop = &stop;
+    w->free_map = maps + (size_t)i * BM_BYTES(cache->total_buf);
+    w->started = i > 0 && pthread_create(&w->tid, NULL, walk_worker, w) == 0;
+  }
+  walk_worker(&workers[0]);
+  for (int i = 1; i < nthreads; i++) {
+    if (workers[i].started)
+      pthread_join(workers[i].tid, NULL);
+    else
+      walk_worker(&workers[i]);
+  }
+  objc_walk_end(walk);
+  free(workers);
+  free(maps);
+  return atomic_load(&stop);
+}
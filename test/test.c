@@ -1,9 +1,16 @@
 #include "objc_internal.h"
 #include "objcache.h"
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 typedef struct test {
   int x, y;
@@ -41,6 +48,9 @@ void c2(void *p, size_t size) {
   total_c1_runs++;
 }
 
+static int total_d_runs = 0;
+void d(void *p, size_t size) { total_d_runs++; }
+
 static inline void objc_printf(objc_cache_t *cache) {
   printf("---------------------------\n"
          "%-18s %5zu B\n"
@@ -54,27 +64,104 @@ static inline void objc_printf(objc_cache_t *cache) {
          "Total buf:", cache->total_buf, "Size of each buf:", cache->buffer_size, "Slab count:", cache->slab_count);
 }
 
+/*Counts the slabs in a full/partial/free slab list.*/
+static int slab_list_len(objc_slabctl_t *head) {
+  int n = 0;
+  for (objc_slabctl_t *cur = head; cur; cur = cur->next)
+    n++;
+  return n;
+}
+
 static void test_create_multiple_slabs(objc_cache_t *cache);
 static void test_slab_list(objc_cache_t *cache);
+static void test_slab_dense(objc_cache_t *cache);
 static void test_slab_bm(objc_cache_t *cache);
+static void test_magazine(objc_cache_t *cache);
+static void test_reap(objc_cache_t *cache);
+static void test_arena(objc_cache_t *cache);
+static void test_slab_order(void);
+static void test_large_object(void);
+static void test_slab_color(void);
+static void test_bulk(void);
+static void test_compact(void);
+static void test_align(void);
+static void test_remote_free(void);
+static void test_stats(void);
+static void test_trace(void);
+static void test_malloc(void);
+static void test_proto(void);
+static void test_reaper(void);
+static void test_walk(void);
+static void test_defrag(void);
+static void test_epoch(void);
+static void test_persist(void);
+static void test_reserve(void);
+static void test_profile(void);
 
 int main(void) {
   objc_cache_t *cache1 = objc_cache_create("rand", sizeof(test_t), 0, c, NULL);
   test_create_multiple_slabs(cache1);
 
-  objc_cache_t *cache2 = objc_cache_create("rand1", sizeof(test_t1), 0, c1, NULL);
+  objc_cache_t *cache2 = objc_cache_create_ex("rand1", sizeof(test_t1), 0, c1, NULL, OBJC_CACHE_BUFCTL);
   test_slab_list(cache2);
 
+  objc_cache_t *cache_dense = objc_cache_create("dense", sizeof(test_t1), 0, c1, NULL);
+  test_slab_dense(cache_dense);
+
   objc_cache_t *cache3 = objc_cache_create("rand2", sizeof(test_bm_t), 0, c2, NULL);
   test_slab_bm(cache3);
 
+  objc_cache_t *cache4 = objc_cache_create("mag", sizeof(test_t), 0, c, NULL);
+  test_magazine(cache4);
+
+  objc_cache_t *cache5 = objc_cache_create("reap", sizeof(test_t), 0, c, d);
+  test_reap(cache5);
+
+  objc_cache_t *cache6 = objc_cache_create("arena", sizeof(test_t), 0, c, NULL);
+  test_arena(cache6);
+
+  test_slab_order();
+
+  test_large_object();
+
+  test_slab_color();
+
+  test_bulk();
+
+  test_compact();
+
+  test_align();
+
+  test_remote_free();
+
+  test_stats();
+
+  test_trace();
+
+  test_malloc();
+
+  test_proto();
+
+  test_reaper();
+
+  test_walk();
+
+  test_defrag();
+
+  test_epoch();
+
+  test_persist();
+
+  test_reserve();
+
+  test_profile();
+
   return 0;
 }
 
-/*Allocates object for `cache_info.total_buf * i + 1` times i.e. 4 slabs will be created which will form
- * a circular doubly linked list.
- * <-- SLAB 1 <--> SLAB 2 <--> SLAB 3 <--> SLAB 4 -->
- * where, all are empty slabs except for SLAB 4 where only 1 object is allocated.
+/*Allocates object for `cache_info.total_buf * i + 1` times i.e. 4 slabs will be created where
+ * SLAB 1, SLAB 2 and SLAB 3 are in the full list and SLAB 4, where only 1 object is allocated, is in the
+ * partial list.
  * */
 static void test_create_multiple_slabs(objc_cache_t *cache) {
   uint8_t t = 3;
@@ -84,14 +171,15 @@ static void test_create_multiple_slabs(objc_cache_t *cache) {
   unsigned short slab_count = cache->slab_count;
   // slab count should be t + 1
   assert(slab_count == t + 1);
+  assert(slab_list_len(cache->slabs_full) == t);
+  assert(slab_list_len(cache->slabs_partial[0]) == 1);
   printf("test_create_multiple_slabs() success\n");
   objc_printf(cache);
   objc_cache_destroy(cache);
 }
 
-/*Validate whether the slabs are arranged in a circular doubly linked list.
- * Also validate if the slabs are rearranged correctly in the list after
- * freeing object of the empty/partial slab.*/
+/*Validate whether the slabs are kept in the right full/partial/free list and moved correctly between
+ * the lists after allocating and freeing objects.*/
 static void test_slab_list(objc_cache_t *cache) {
   uint8_t t = 3;
   void *obj_last;
@@ -119,106 +207,67 @@ static void test_slab_list(objc_cache_t *cache) {
   }
   /*When `cache->total_buf * t` number of allocations are done, it will have to create `t` slabs
    * to fit all allocations since each slab can allocate upto `total_buf` number of objects. So, the above
-   * loop will create `t` slabs and allocate objects in it making all the slabs empty slabs i.e. all objects
+   * loop will create `t` slabs and allocate objects in it making all the slabs full i.e. all objects
    * allocated.*/
+  assert(slab_list_len(cache->slabs_full) == t);
+  assert(cache->partial_mask == 0 && cache->slabs_free == NULL);
 
-  /*cur_slabctl is the slab that is currently being pointed by `cache->free_slab`.
-   * This slab should be in the tail of the list.*/
-  objc_slabctl_t *cur_slabctl = GET_SLABCTL(cache, cache->free_slab);
-
-  /*Verify the circular linked list.
-  Since there are 3 slabs, going `prev` 3 times should reach at the cur_slabctl to realize a
-   * circular doubly linked list.*/
-  assert(cur_slabctl->prev->prev->prev == cur_slabctl);
+  /*The slab that became full last is at the head of the full list.*/
+  assert(GET_SLABBASE(cache, obj_last) == GET_SLABBASE(cache, cache->slabs_full));
 
-  /* Calculate the base address of the current slab using `obj` which is the buffer
-   * in the current slab. It should be equal to the base address using cur_slabctl.*/
-  assert(GET_SLABBASE(obj_last) == GET_SLABBASE(cur_slabctl));
-
-  /* All slabs should be empty i.e. all buffers allocated. Since `cache->total_buf * t` allocations were made, `t`
-   * number of slabs should be created and all buffers should be allocated.
-   * */
-  objc_slabctl_t *cur = cur_slabctl;
-  do {
+  /* All slabs should be full i.e. all buffers allocated.*/
+  for (objc_slabctl_t *cur = cache->slabs_full; cur; cur = cur->next) {
     assert(cur->freebuf == NULL);
-    cur = cur->prev;
-  } while (cur != cur_slabctl);
+    assert(cur->ref_count == cache->total_buf);
+  }
 
-  /*Freeing an object from empty slab should link the slab to the tail because empty slabs reside in the beginning of
-   * the list then comes partial slabs followed by complete slabs.*/
+  /*Freeing an object from a full slab should move the slab to the partial list.*/
   objc_free(cache, obj_first);
   // Slab from which object was just freed to become partial slab
-  objc_slabctl_t *partial_slab = GET_SLABCTL(cache, obj_first);
-  /*If the slab from where object was just freed is moved to the tail then the previous slabs
-   * should be empty slab which can also be verified if ref_count == total_buf.*/
-  assert(partial_slab->prev->ref_count == cache->total_buf);
-  assert(partial_slab->prev->prev->ref_count == cache->total_buf);
+  objc_slabctl_t *partial_slab = GET_SLABCTL(cache, GET_SLABBASE(cache, obj_first));
+  assert(cache->slabs_partial[0] == partial_slab);
+  assert(slab_list_len(cache->slabs_full) == t - 1);
   /*`freebuf` shouldn't be NULL because an object is just freed.*/
   assert(partial_slab->freebuf != NULL);
 
-  /*If partial/complete slab exists then new slab shouldn't be created during new allocations. Allocator should first
-   * search for the partial/complete slab and use it.*/
+  /*If a partial slab exists then new slab shouldn't be created during new allocations.*/
   void *newobj = objc_cache_alloc(cache);
   /*`newobj` address and `obj_first` address should be same if allocation has happened in the partial slab free
    * buffer. Slab count should also not change from `t`.*/
   assert(newobj == obj_first);
   assert(cache->slab_count == t);
-  /*`freebuf` should be NULL because an object is just allocated.*/
+  /*`freebuf` should be NULL because an object is just allocated and the slab is back in the full list.*/
   assert(partial_slab->freebuf == NULL);
+  assert(cache->slabs_full == partial_slab && cache->partial_mask == 0);
 
-  /*Allocating again should create a new slab since no partial/complete slabs are remaining.*/
+  /*Allocating again should create a new slab since no partial/free slabs are remaining.*/
   objc_cache_alloc(cache);
   assert(cache->slab_count == t + 1);
-  /*Now `cache->freeslab` should point at this new slab and it should have `ref_count=1`*/
-  assert(GET_SLABCTL(cache, cache->free_slab)->ref_count == 1);
-
-  /* Cache structure at this point -
-   *
-   * --------      ---------      ---------        ----------
-   *  SLAB 1  <-->   SLAB 2  <-->   SLAB 3   <-->    SLAB 4
-   * --------      ---------      ---------        ----------
-   *                                               ^
-   *                                               '
-   *                                               '
-   *                                               `- cache->free_slab
-   * SLAB 1, SLAB 2 and SLAB 3 are empty.
-   * SLAB 4 is partial slab with ref_count = 1 and cache->free_slab points at SLAB 4.
-   *
-   */
-
-  /*Free objc_slab1[0] which belongs to SLAB 3 in the list now. Recall, SLAB 3 moved to the tail from the head when
-   * an object from the slab was freed earlier in objc_free(cache, obj_first); */
+  /*The new slab should be the only partial slab and it should have `ref_count=1`*/
+  objc_slabctl_t *new_slab = cache->slabs_partial[0];
+  assert(new_slab->ref_count == 1 && new_slab->next == NULL);
+
+  /*Free obj_slab1[0] which makes SLAB 1 partial. It is pushed to the head of the partial list and
+   * the next allocation should come from it.*/
   objc_free(cache, obj_slab1[0]);
-  /*Now `cache->free_slab` should point to the base of SLAB 3 i.e. obj_slab1[0].*/
-  assert(cache->free_slab == obj_slab1[0]);
-  /* Cache structure at this point -
-   *
-   * --------      ---------      ---------        ----------
-   *  SLAB 1  <-->   SLAB 2  <-->   SLAB 3   <-->    SLAB 4
-   * --------      ---------      ---------        ----------
-   *                              ^
-   *                              '
-   *                              '
-   *                              `- cache->free_slab
-   * SLAB 1, SLAB 2 are empty.
-   * SLAB 3 is partial slab with only one free_buf left and cache->free_slab points at SLAB 3.
-   * SLAB 4 is partial slab with ref_count = 1.
-   *
-   */
-
-  /*Allocates in SLAB 3 because it has one free_buf left.*/
+  assert(cache->slabs_partial[0] == partial_slab);
+  assert(slab_list_len(cache->slabs_partial[0]) == 2);
+  assert(objc_cache_alloc(cache) == obj_slab1[0]);
+  /*Allocates in the new slab and makes ref_count = 2.*/
   objc_cache_alloc(cache);
-  /*Allocates in SLAB 4 and makes ref_count = 2.*/
-  objc_cache_alloc(cache);
-  assert(GET_SLABCTL(cache, cache->free_slab)->ref_count == 2);
+  assert(new_slab->ref_count == 2);
 
-  /*Freeing all objects of the slab should bring it to the tail since complete slab (i.e. all objects free) resides
-   * towards the tail.*/
+  /*Freeing all objects of the slab should move it to the free list.*/
   for (int i = 0; i < cache->total_buf; i++) {
     objc_free(cache, obj_slab1[i]);
   }
-  assert(GET_SLABCTL(cache, cache->free_slab)->next->ref_count == 0);
-  assert(GET_SLABBASE(GET_SLABCTL(cache, cache->free_slab)->next) == obj_slab1[0]);
+  assert(cache->slabs_free == partial_slab && partial_slab->next == NULL);
+  assert(partial_slab->ref_count == 0);
+  assert(slab_list_len(cache->slabs_full) == t - 1);
+
+  /*Partial slabs are preferred over free slabs.*/
+  objc_cache_alloc(cache);
+  assert(new_slab->ref_count == 3);
 
   printf("test_slab_list() success\n");
   objc_printf(cache);
@@ -226,20 +275,55 @@ static void test_slab_list(objc_cache_t *cache) {
   free(obj_slab1);
 }
 
+/*With `OBJC_SLAB_DENSE`, allocations should go to the most allocated partial slab.*/
+static void test_slab_dense(objc_cache_t *cache) {
+  assert(objc_cache_set_policy(cache, OBJC_SLAB_DENSE) == 0);
+
+  int n = cache->total_buf * 2;
+  void **objs = malloc(n * sizeof(void *));
+  for (int i = 0; i < n; i++)
+    objs[i] = objc_cache_alloc(cache);
+  objc_slabctl_t *slab1 = GET_SLABCTL(cache, GET_SLABBASE(cache, objs[0]));
+  objc_slabctl_t *slab2 = GET_SLABCTL(cache, GET_SLABBASE(cache, objs[n - 1]));
+
+  /*Leave SLAB 1 sparse and SLAB 2 nearly full. SLAB 1 is freed last so it would be picked by LIFO.*/
+  for (int i = 0; i < 2; i++)
+    objc_free(cache, objs[n - 1 - i]);
+  for (int i = 0; i < cache->total_buf - 2; i++)
+    objc_free(cache, objs[i]);
+  assert(slab1->ref_count == 2 && slab2->ref_count == cache->total_buf - 2);
+
+  void *obj = objc_cache_alloc(cache);
+  assert(GET_SLABCTL(cache, GET_SLABBASE(cache, obj)) == slab2);
+  obj = objc_cache_alloc(cache);
+  assert(GET_SLABCTL(cache, GET_SLABBASE(cache, obj)) == slab2);
+  assert(slab2->ref_count == cache->total_buf && cache->slabs_full == slab2);
+
+  /*The only partial slab left is SLAB 1.*/
+  obj = objc_cache_alloc(cache);
+  assert(GET_SLABCTL(cache, GET_SLABBASE(cache, obj)) == slab1);
+  assert(cache->slab_count == 2);
+
+  printf("test_slab_dense() success\n");
+  objc_printf(cache);
+  objc_cache_destroy(cache);
+  free(objs);
+}
+
 void test_slab_bm(objc_cache_t *cache) {
   void **obj_arr = malloc(sizeof(void *) * cache->total_buf);
   for (int i = 0; i < cache->total_buf; i++) {
     void *obj = objc_cache_alloc(cache);
     obj_arr[i] = obj;
   }
-  assert(GET_SLABCTL(cache, cache->free_slab)->ref_count == cache->total_buf);
-  assert(GET_SLABCTL(cache, cache->free_slab)->freebuf == NULL);
+  assert(GET_SLABCTL(cache, GET_SLABBASE(cache, obj_arr[0]))->ref_count == cache->total_buf);
+  assert(GET_SLABCTL(cache, GET_SLABBASE(cache, obj_arr[0]))->freebuf == NULL);
 
   int idx = 50; // let's free 50th buffer from the slab
 
   objc_free(cache, obj_arr[idx]);
   void *freed_obj = obj_arr[idx];
-  assert(((char *)freed_obj - (char *)GET_SLABBASE(freed_obj)) / cache->buffer_size == idx);
+  assert(((char *)freed_obj - (char *)GET_SLABBASE(cache, freed_obj)) / cache->buffer_size == idx);
 
   void *obj = objc_cache_alloc(cache);
   assert(freed_obj == obj);
@@ -252,3 +336,1674 @@ void test_slab_bm(objc_cache_t *cache) {
   objc_cache_destroy(cache);
   free(obj_arr);
 }
+
+#define MAG_THREADS 4
+#define MAG_OBJS 1000
+
+/*Each thread stamps its id into the objects it owns and checks that no other thread got the same object
+ * before freeing them back through the magazines.*/
+static void *magazine_worker(void *arg) {
+  objc_cache_t *cache = arg;
+  void **objs = malloc(MAG_OBJS * sizeof(void *));
+  int id = (int)(uintptr_t)pthread_self();
+  for (int round = 0; round < 50; round++) {
+    for (int i = 0; i < MAG_OBJS; i++) {
+      objs[i] = objc_cache_alloc(cache);
+      assert(objs[i] != NULL);
+      ((test_t *)objs[i])->x = id;
+    }
+    for (int i = 0; i < MAG_OBJS; i++) {
+      assert(((test_t *)objs[i])->x == id);
+      // constructed state survives the round trip through the magazines
+      ((test_t *)objs[i])->x = 33;
+      objc_free(cache, objs[i]);
+    }
+  }
+  free(objs);
+  return NULL;
+}
+
+static void test_magazine(objc_cache_t *cache) {
+  int mag_size = 8;
+  assert(objc_cache_set_magsize(cache, mag_size) == 0);
+
+  /*Objects freed into the magazine should be handed out again in LIFO order without touching the slab.*/
+  void *obj[2 * 8];
+  for (int i = 0; i < 2 * mag_size; i++)
+    obj[i] = objc_cache_alloc(cache);
+  objc_slabctl_t *slabctl = GET_SLABCTL(cache, GET_SLABBASE(cache, obj[0]));
+  int ref_count = slabctl->ref_count;
+  for (int i = 0; i < 2 * mag_size; i++)
+    objc_free(cache, obj[i]);
+  // both `loaded` and `previous` are full so the slab hasn't seen any free
+  assert(slabctl->ref_count == ref_count);
+  assert(objc_cache_alloc(cache) == obj[2 * mag_size - 1]);
+  objc_free(cache, obj[2 * mag_size - 1]);
+
+  /*Magazine size can't be changed once the cache is in use.*/
+  assert(objc_cache_set_magsize(cache, 16) == -1);
+
+  pthread_t threads[MAG_THREADS];
+  for (int i = 0; i < MAG_THREADS; i++)
+    pthread_create(&threads[i], NULL, magazine_worker, cache);
+  for (int i = 0; i < MAG_THREADS; i++)
+    pthread_join(threads[i], NULL);
+
+  printf("test_magazine() success\n");
+  objc_printf(cache);
+  objc_cache_destroy(cache);
+}
+
+/*Reaping should keep `keep` free slabs, release the rest and run the destructor only on the constructed
+ * buffers of the released slabs.*/
+static void test_reap(objc_cache_t *cache) {
+  int t = 4;
+  int n = cache->total_buf * t;
+  void **objs = malloc(n * sizeof(void *));
+  for (int i = 0; i < n; i++)
+    objs[i] = objc_cache_alloc(cache);
+  void *obj = objc_cache_alloc(cache); // 1 object in SLAB 5 so that only the first buffer is constructed
+  assert(cache->slab_count == t + 1);
+
+  /*Nothing to reap while all slabs hold objects.*/
+  assert(objc_cache_reap(cache, 0) == 0);
+
+  for (int i = 0; i < n; i++)
+    objc_free(cache, objs[i]);
+  objc_free(cache, obj);
+  assert(slab_list_len(cache->slabs_free) == t + 1);
+
+  size_t reaped = objc_cache_reap(cache, 2);
+  assert(reaped == (t - 1) * cache->slab_size);
+  assert(cache->slab_count == 2);
+  assert(slab_list_len(cache->slabs_free) == 2);
+  /*SLAB 5 was the last slab to become free so it is at the head of the free list and kept warm.*/
+  assert(cache->slabs_free == GET_SLABCTL(cache, GET_SLABBASE(cache, obj)));
+  assert(total_d_runs == (t - 1) * cache->total_buf);
+
+  /*Reaping the remaining slabs runs the destructor only once for SLAB 5.*/
+  reaped = objc_cache_reap(cache, 0);
+  assert(reaped == 2 * cache->slab_size);
+  assert(cache->slab_count == 0);
+  assert(total_d_runs == t * cache->total_buf + 1);
+
+  /*The cache is still usable after everything was reaped.*/
+  obj = objc_cache_alloc(cache);
+  assert(obj != NULL && cache->slab_count == 1);
+  objc_free(cache, obj);
+
+  printf("test_reap() success\n");
+  objc_printf(cache);
+  objc_cache_destroy(cache);
+  free(objs);
+}
+
+/*Slabs should come from the page arena and freed slabs should be recycled from its free lists.*/
+static void test_arena(objc_cache_t *cache) {
+  objc_arena_stats_t before = objc_arena_stats();
+  int t = 3;
+  int n = cache->total_buf * t;
+  void **objs = malloc(n * sizeof(void *));
+  for (int i = 0; i < n; i++)
+    objs[i] = objc_cache_alloc(cache);
+
+  objc_arena_stats_t stats = objc_arena_stats();
+  assert(stats.committed == before.committed + t * PAGE_SIZE);
+  assert(stats.reserved >= stats.committed + stats.free);
+  size_t free_bytes = stats.free;
+  /*Slabs are aligned to the slab size and the bitmap lives inside the slab.*/
+  for (int i = 0; i < n; i += cache->total_buf) {
+    objc_slabctl_t *slabctl = GET_SLABCTL(cache, GET_SLABBASE(cache, objs[i]));
+    assert((char *)slabctl->bm_const > (char *)GET_SLABBASE(cache, objs[i]));
+    assert((char *)slabctl->bm_const < (char *)slabctl);
+  }
+
+  for (int i = 0; i < n; i++)
+    objc_free(cache, objs[i]);
+  void *slab = GET_SLABBASE(cache, objs[0]);
+  assert(objc_cache_reap(cache, 0) == t * PAGE_SIZE);
+  stats = objc_arena_stats();
+  assert(stats.committed == before.committed);
+  assert(stats.free == free_bytes + t * PAGE_SIZE);
+
+  /*The next slab is recycled from the page free list instead of bumping the region. SLAB 1 became free
+   * first so it was the last slab returned to the arena.*/
+  void *obj = objc_cache_alloc(cache);
+  assert(GET_SLABBASE(cache, obj) == slab);
+  assert(objc_arena_stats().free == stats.free - PAGE_SIZE);
+  /*Recycled pages are released with MADV_DONTNEED so the constructed state is cleared.*/
+  assert(bm_get(GET_SLABCTL(cache, GET_SLABBASE(cache, obj))->bm_const, 1) == 0);
+
+  printf("test_arena() success\n");
+  objc_printf(cache);
+  objc_cache_destroy(cache);
+  free(objs);
+}
+
+typedef struct test_large {
+  char buf[512];
+} test_large_t;
+
+typedef struct test_8k {
+  char buf[8 * 1024];
+} test_8k_t;
+
+/*Allocates `n` objects, checks that every object resolves to the slab it was allocated from and frees them.*/
+static void slab_order_roundtrip(objc_cache_t *cache, int n) {
+  void **objs = malloc(n * sizeof(void *));
+  for (int i = 0; i < n; i++) {
+    objs[i] = objc_cache_alloc(cache);
+    assert(objs[i] != NULL);
+    void *slab = GET_SLABBASE(cache, objs[i]);
+    assert(((uintptr_t)slab & (cache->slab_size - 1)) == 0);
+    assert((char *)objs[i] + cache->size <= (char *)slab + cache->bm_offset);
+    assert(slab_ctl(cache, slab)->ref_count > 0);
+  }
+  for (int i = 0; i < n; i++)
+    objc_free(cache, objs[i]);
+  assert(cache->partial_mask == 0 && cache->slabs_full == NULL);
+  free(objs);
+}
+
+/*The slab order should be picked at creation to keep the unused bytes low and the slab base should be found
+ * for any order.*/
+static void test_slab_order(void) {
+  /*Small objects fit well in a single page.*/
+  objc_cache_t *cache = objc_cache_create("order0", sizeof(test_t), 0, c, NULL);
+  assert(cache->slab_size == PAGE_SIZE);
+  objc_cache_destroy(cache);
+
+  objc_cache_t *caches[] = {
+      objc_cache_create("order512", sizeof(test_large_t), 0, NULL, NULL),
+      objc_cache_create("order8k", sizeof(test_8k_t), 0, NULL, NULL),
+  };
+  /*512 byte objects pack exactly into a page once their metadata is off-slab.*/
+  assert(caches[0]->slab_size == PAGE_SIZE && caches[0]->unused == 0);
+  assert(caches[1]->slab_size > PAGE_SIZE);
+
+  for (int i = 0; i < 2; i++) {
+    cache = caches[i];
+    assert(cache->total_buf >= OBJC_SLAB_MIN_OBJS);
+    assert(cache->unused * OBJC_SLAB_WASTE <= cache->slab_size);
+    slab_order_roundtrip(cache, cache->total_buf * 3 + 1);
+    assert(cache->slab_count == 4);
+    /*Off-slab caches also release the slabs of their slabctl cache.*/
+    assert(objc_cache_reap(cache, 0) >= 4 * cache->slab_size);
+    objc_printf(cache);
+    objc_cache_destroy(cache);
+  }
+
+  /*The order can be given explicitly.*/
+  cache = objc_cache_create_ex("order3", sizeof(test_t), 0, c, NULL, OBJC_CACHE_ORDER(3));
+  assert(cache->slab_size == PAGE_SIZE << 3);
+  slab_order_roundtrip(cache, cache->total_buf + 1);
+  objc_cache_destroy(cache);
+
+  /*Huge page slabs are always 2M.*/
+  unsigned int flags[] = {OBJC_CACHE_HUGEPAGE, OBJC_CACHE_HUGETLB};
+  for (int i = 0; i < 2; i++) {
+    cache = objc_cache_create_ex("huge", sizeof(test_large_t), 0, NULL, NULL, flags[i]);
+    assert(cache->slab_size == 2 * 1024 * 1024);
+    slab_order_roundtrip(cache, cache->total_buf + 1);
+    objc_cache_destroy(cache);
+  }
+
+  /*Objects that don't fit in the largest slab can't be cached.*/
+  assert(objc_cache_create("too_large", 4 * 1024 * 1024, 0, NULL, NULL) == NULL);
+
+  printf("test_slab_order() success\n");
+}
+
+static int total_large_c_runs = 0;
+void c_large(void *p, size_t size) {
+  ((char *)p)[0] = 'L';
+  ((char *)p)[size - 1] = 'L';
+  total_large_c_runs++;
+}
+
+/*Large objects should be packed back to back without any bufctl and freed through the hash table from slab
+ * base to the off-slab slabctl.*/
+static void test_large_object(void) {
+  size_t sizes[] = {16 * 1024, 64 * 1024};
+  for (int s = 0; s < 2; s++) {
+    objc_cache_t *cache = objc_cache_create("large", sizes[s], 0, c_large, d);
+    assert(cache != NULL);
+    assert(cache->flags & OBJC_CACHE_OFFSLAB);
+    assert(cache->buffer_size == sizes[s] && cache->unused == 0);
+
+    /*Enough slabs to make the hash table grow.*/
+    int n = cache->total_buf * (OBJC_HASH_MIN_BUCKETS + 10) / (s + 1);
+    void **objs = malloc(n * sizeof(void *));
+    for (int i = 0; i < n; i++) {
+      objs[i] = objc_cache_alloc(cache);
+      assert(((char *)objs[i])[0] == 'L' && ((char *)objs[i])[sizes[s] - 1] == 'L');
+    }
+    assert(cache->hbuckets > OBJC_HASH_MIN_BUCKETS || s == 1);
+    assert(cache->hcount == cache->slab_count);
+
+    /*Objects of a slab are adjacent.*/
+    assert((char *)objs[1] - (char *)objs[0] == sizes[s]);
+
+    for (int i = 0; i < n; i += 2)
+      objc_free(cache, objs[i]);
+    /*Freed objects are handed out again without running the constructor.*/
+    int runs = total_large_c_runs;
+    for (int i = 0; i < n; i += 2)
+      objs[i] = objc_cache_alloc(cache);
+    assert(total_large_c_runs == runs);
+    for (int i = 0; i < n; i++)
+      objc_free(cache, objs[i]);
+    assert(cache->partial_mask == 0 && cache->slabs_full == NULL);
+
+    int d_runs = total_d_runs;
+    int slabs = cache->slab_count;
+    assert(objc_cache_reap(cache, 0) >= slabs * cache->slab_size);
+    assert(total_d_runs - d_runs == n);
+    assert(cache->hcount == 0);
+
+    objc_printf(cache);
+    objc_cache_destroy(cache);
+    free(objs);
+  }
+  printf("test_large_object() success\n");
+}
+
+typedef struct test_color {
+  char buf[200];
+} test_color_t;
+
+/*Successive slabs should start their first buffer at rotating cache line offsets within the unused bytes and
+ * objects should still resolve to their buffer index.*/
+static void test_slab_color(void) {
+  objc_cache_t *cache =
+      objc_cache_create_ex("color", sizeof(test_color_t), 0, NULL, NULL, OBJC_CACHE_ORDER(0) | OBJC_CACHE_BUFCTL);
+  assert(cache->color_max > 0 && cache->color_max <= cache->unused);
+  assert(cache->color_max % OBJC_CACHELINE == 0);
+  int colors = cache->color_max / OBJC_CACHELINE + 1;
+
+  int t = colors + 1;
+  int n = cache->total_buf * t;
+  void **objs = malloc(n * sizeof(void *));
+  for (int i = 0; i < n; i++)
+    objs[i] = objc_cache_alloc(cache);
+  for (int k = 0; k < t; k++) {
+    void *first = objs[k * cache->total_buf];
+    objc_slabctl_t *slabctl = GET_SLABCTL(cache, GET_SLABBASE(cache, first));
+    /*The color wraps back to 0 after the largest color.*/
+    assert(slabctl->color == (k % colors) * OBJC_CACHELINE);
+    assert((char *)first - (char *)GET_SLABBASE(cache, first) == slabctl->color);
+    /*The last buffer still ends before the bitmap.*/
+    void *last = objs[(k + 1) * cache->total_buf - 1];
+    assert((char *)last + cache->buffer_size <= (char *)GET_SLABBASE(cache, last) + cache->bm_offset);
+    assert(getobj_idx(cache, slabctl, last) == cache->total_buf - 1);
+  }
+
+  /*Freed objects go back to the right buffer of their colored slab.*/
+  objc_free(cache, objs[cache->total_buf + 3]);
+  assert(objc_cache_alloc(cache) == objs[cache->total_buf + 3]);
+  for (int i = 0; i < n; i++)
+    objc_free(cache, objs[i]);
+  objc_printf(cache);
+  objc_cache_destroy(cache);
+
+  /*Coloring can be turned off.*/
+  cache = objc_cache_create_ex("nocolor", sizeof(test_color_t), 0, NULL, NULL,
+                               OBJC_CACHE_ORDER(0) | OBJC_CACHE_BUFCTL | OBJC_CACHE_NOCOLOR);
+  assert(cache->color_max == 0);
+  for (int i = 0; i < n; i++)
+    objs[i] = objc_cache_alloc(cache);
+  for (int k = 0; k < t; k++)
+    assert(GET_SLABBASE(cache, objs[k * cache->total_buf]) == objs[k * cache->total_buf]);
+  objc_cache_destroy(cache);
+  free(objs);
+  printf("test_slab_color() success\n");
+}
+
+static int total_bulk_c_runs = 0;
+void c_bulk(void *p, size_t size) {
+  *(int *)p = 0xb1;
+  total_bulk_c_runs++;
+}
+
+static int ptr_cmp(const void *a, const void *b) {
+  uintptr_t x = *(uintptr_t *)a, y = *(uintptr_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/*Bulk allocations should take whole runs of buffers from a slab, run the constructor once per buffer and bulk
+ * frees should put every slab back in the right list.*/
+static void test_bulk(void) {
+  size_t sizes[] = {sizeof(test_t), 1024};
+  for (int s = 0; s < 2; s++) {
+    for (int mag = 0; mag < 2; mag++) {
+      objc_cache_t *cache = objc_cache_create("bulk", sizes[s], 0, c_bulk, NULL);
+      if (mag)
+        assert(objc_cache_set_magsize(cache, 8) == 0);
+      int n = cache->total_buf * 3;
+      void **objs = malloc(n * sizeof(void *));
+      void **again = malloc(n * sizeof(void *));
+
+      total_bulk_c_runs = 0;
+      assert(objc_cache_alloc_bulk(cache, n, objs) == n);
+      assert(total_bulk_c_runs == n && cache->slab_count == 3);
+      assert(slab_list_len(cache->slabs_full) == 3 && cache->partial_mask == 0);
+      qsort(objs, n, sizeof(void *), ptr_cmp);
+      for (int i = 0; i < n; i++) {
+        assert(*(int *)objs[i] == 0xb1);
+        assert(i == 0 || objs[i] != objs[i - 1]);
+      }
+
+      objc_free_bulk(cache, n, objs);
+      if (!mag) {
+        assert(slab_list_len(cache->slabs_free) == 3);
+        assert(cache->partial_mask == 0 && cache->slabs_full == NULL);
+      }
+
+      /*The same buffers are handed out again, already constructed.*/
+      assert(objc_cache_alloc_bulk(cache, n, again) == n);
+      assert(total_bulk_c_runs == n && cache->slab_count == 3);
+      qsort(again, n, sizeof(void *), ptr_cmp);
+      assert(memcmp(objs, again, n * sizeof(void *)) == 0);
+
+      /*A bulk allocation that mixes constructed and new buffers constructs only the new ones.*/
+      objc_free_bulk(cache, 10, again);
+      assert(objc_cache_alloc_bulk(cache, 10 + cache->total_buf, objs) == 10 + cache->total_buf);
+      assert(total_bulk_c_runs == n + cache->total_buf);
+      assert(cache->slab_count == 4);
+
+      /*Objects of single allocations can be freed in bulk and vice versa.*/
+      objc_free_bulk(cache, n - 10, again + 10);
+      objc_free_bulk(cache, 10 + cache->total_buf, objs);
+      if (!mag)
+        assert(slab_list_len(cache->slabs_free) == 4);
+
+      objc_printf(cache);
+      objc_cache_destroy(cache);
+      free(objs);
+      free(again);
+    }
+  }
+  printf("test_bulk() success\n");
+}
+
+/*Small objects should be packed at their size with an index free list before the slabctl when more objects fit
+ * than with a bufctl per object.*/
+static void test_compact(void) {
+  size_t sizes[] = {8, 16, 32};
+  int idx_sizes[] = {2, 1, 1};
+  for (int s = 0; s < 3; s++) {
+    objc_cache_t *bufctl = objc_cache_create_ex("bufctl", sizes[s], 0, NULL, NULL, OBJC_CACHE_BUFCTL);
+    objc_cache_t *cache = objc_cache_create("compact", sizes[s], 0, c_bulk, NULL);
+    assert(bufctl->idx_size == 0 && bufctl->buffer_size == sizes[s] + sizeof(objc_bufctl_t));
+    assert(cache->idx_size == idx_sizes[s] && cache->buffer_size == sizes[s]);
+    assert(cache->slab_size == bufctl->slab_size && cache->total_buf > bufctl->total_buf);
+    /*| buffers | unused | bm_const | idx_list | slabctl |*/
+    assert(cache->bm_offset + BM_BYTES(cache->total_buf) == cache->slabctl_offset + cache->idx_offset);
+    assert(cache->total_buf * cache->idx_size <= -cache->idx_offset);
+    assert(cache->slabctl_offset + sizeof(objc_slabctl_t) == cache->slab_size);
+    objc_cache_destroy(bufctl);
+
+    int n = cache->total_buf * 2;
+    void **objs = malloc(n * sizeof(void *));
+    total_bulk_c_runs = 0;
+    for (int i = 0; i < n; i++) {
+      objs[i] = objc_cache_alloc(cache);
+      assert(*(int *)objs[i] == 0xb1);
+    }
+    /*Objects are adjacent and the last one ends before the bitmap.*/
+    assert((char *)objs[1] - (char *)objs[0] == sizes[s]);
+    void *last = objs[cache->total_buf - 1];
+    assert((char *)last + sizes[s] <= (char *)GET_SLABBASE(cache, last) + cache->bm_offset);
+    assert(slab_list_len(cache->slabs_full) == 2);
+
+    objc_free(cache, objs[5]);
+    objc_free(cache, objs[cache->total_buf + 7]);
+    assert(slab_list_len(cache->slabs_partial[0]) == 2);
+    assert(objc_cache_alloc(cache) == objs[cache->total_buf + 7]);
+    assert(objc_cache_alloc(cache) == objs[5]);
+    assert(total_bulk_c_runs == n);
+
+    for (int i = 0; i < n; i++)
+      objc_free(cache, objs[i]);
+    assert(slab_list_len(cache->slabs_free) == 2);
+    objc_printf(cache);
+    objc_cache_destroy(cache);
+    free(objs);
+  }
+  printf("test_compact() success\n");
+}
+
+/*Allocates objects over several slabs and checks that each one is aligned to `align`.*/
+static void align_roundtrip(objc_cache_t *cache, int align) {
+  int n = cache->total_buf * 3 + 1;
+  void **objs = malloc(n * sizeof(void *));
+  for (int i = 0; i < n; i++) {
+    objs[i] = objc_cache_alloc(cache);
+    assert(((uintptr_t)objs[i] & (align - 1)) == 0);
+    memset(objs[i], 0xaa, cache->size);
+  }
+  for (int i = 0; i < n; i++)
+    objc_free(cache, objs[i]);
+  free(objs);
+}
+
+/*Objects should be aligned to the `align` given at creation in every layout, and isolated objects should not
+ * share a cache line with any other object or metadata.*/
+static void test_align(void) {
+  /*Invalid alignments are rejected.*/
+  assert(objc_cache_create("align3", 24, 3, NULL, NULL) == NULL);
+  assert(objc_cache_create("align_neg", 24, -8, NULL, NULL) == NULL);
+  assert(objc_cache_create("align_big", 24, PAGE_SIZE * 2, NULL, NULL) == NULL);
+
+  size_t sizes[] = {4, 12, 24, 100, 700};
+  int aligns[] = {0, 8, 16, 32, 64, 128};
+  unsigned int flags[] = {0, OBJC_CACHE_BUFCTL};
+  for (int s = 0; s < 5; s++) {
+    for (int a = 0; a < 6; a++) {
+      for (int f = 0; f < 2; f++) {
+        objc_cache_t *cache = objc_cache_create_ex("align", sizes[s], aligns[a], NULL, NULL, flags[f]);
+        assert(cache != NULL);
+        objc_cache_info_t info = objc_cache_info(cache);
+        int align = aligns[a] ? aligns[a] : sizes[s] < 8 ? 4 : 8;
+        assert(info.align == align);
+        assert(cache->buffer_size % align == 0);
+        if (cache->idx_size == 0)
+          assert(info.padding == cache->buffer_size - sizes[s] - sizeof(objc_bufctl_t));
+        else
+          assert(info.padding == cache->buffer_size - sizes[s]);
+        align_roundtrip(cache, align);
+        objc_cache_destroy(cache);
+      }
+    }
+  }
+
+  /*Isolated objects take whole cache lines and the free list lives after the last buffer.*/
+  int lines[] = {64, 128};
+  for (int l = 0; l < 2; l++) {
+    objc_cache_t *cache = objc_cache_create_ex("isolate", 24, l ? 128 : 0, NULL, NULL, OBJC_CACHE_ISOLATE);
+    objc_cache_info_t info = objc_cache_info(cache);
+    assert(info.align == lines[l] && cache->buffer_size == lines[l]);
+    assert(info.padding == lines[l] - 24);
+    assert(cache->idx_size != 0);
+    align_roundtrip(cache, lines[l]);
+
+    void **objs = malloc(cache->total_buf * 2 * sizeof(void *));
+    for (int i = 0; i < cache->total_buf * 2; i++)
+      objs[i] = objc_cache_alloc(cache);
+    for (int i = 0; i < cache->total_buf * 2; i++) {
+      objc_slabctl_t *slabctl = GET_SLABCTL(cache, GET_SLABBASE(cache, objs[i]));
+      /*The bitmap, slabctl and index free list don't share a line with any buffer.*/
+      char *bufs_end = slab_bufs(cache, slabctl) + cache->total_buf * cache->buffer_size;
+      assert((char *)objs[i] + lines[l] <= bufs_end);
+      assert((uintptr_t)slabctl->bm_const / lines[l] >= (uintptr_t)bufs_end / lines[l]);
+    }
+    for (int i = 0; i < cache->total_buf * 2; i++)
+      objc_free(cache, objs[i]);
+    free(objs);
+    objc_printf(cache);
+    objc_cache_destroy(cache);
+  }
+  printf("test_align() success\n");
+}
+
+#define REMOTE_CONSUMERS 3
+#define REMOTE_OBJS 200000
+#define REMOTE_QUEUE 1024
+
+/*Queue from the producer to the consumers of `test_remote_free`.*/
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  void *objs[REMOTE_QUEUE];
+  int head, count, done;
+} remote_queue = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+static void *remote_consumer(void *arg) {
+  objc_cache_t *cache = arg;
+  for (;;) {
+    pthread_mutex_lock(&remote_queue.lock);
+    while (!remote_queue.count && !remote_queue.done)
+      pthread_cond_wait(&remote_queue.cond, &remote_queue.lock);
+    if (!remote_queue.count) {
+      pthread_mutex_unlock(&remote_queue.lock);
+      return NULL;
+    }
+    void *obj = remote_queue.objs[remote_queue.head];
+    remote_queue.head = (remote_queue.head + 1) % REMOTE_QUEUE;
+    remote_queue.count--;
+    pthread_cond_broadcast(&remote_queue.cond);
+    pthread_mutex_unlock(&remote_queue.lock);
+
+    assert(*(int *)obj == 0xb1);
+    objc_free_remote(cache, obj);
+  }
+}
+
+/*Objects freed by other threads should wait on the remote free list of their slab, still counted in `ref_count`,
+ * until the allocating side runs out of partial slabs and takes them back.*/
+static void test_remote_free(void) {
+  unsigned int flags[] = {OBJC_CACHE_BUFCTL, 0};
+  for (int f = 0; f < 2; f++) {
+    objc_cache_t *cache = objc_cache_create_ex("remote", 24, 0, c_bulk, NULL, flags[f]);
+    assert((cache->idx_size != 0) == f);
+    int n = cache->total_buf * 2;
+    void **objs = malloc(n * sizeof(void *));
+    for (int i = 0; i < n; i++)
+      objs[i] = objc_cache_alloc(cache);
+    objc_slabctl_t *slab1 = GET_SLABCTL(cache, GET_SLABBASE(cache, objs[0]));
+    objc_slabctl_t *slab2 = GET_SLABCTL(cache, GET_SLABBASE(cache, objs[n - 1]));
+
+    for (int i = 0; i < 3; i++)
+      objc_free_remote(cache, objs[i]);
+    for (int i = 0; i < 2; i++)
+      objc_free_remote(cache, objs[n - 1 - i]);
+    /*Both slabs are still full until the remote frees are drained.*/
+    assert(slab1->ref_count == cache->total_buf && slab2->ref_count == cache->total_buf);
+    assert(slab_list_len(cache->slabs_full) == 2);
+    assert(cache->remote_pending != NULL);
+
+    /*No partial slab is left so the next allocation drains the remote frees instead of creating a slab.*/
+    void *obj = objc_cache_alloc(cache);
+    assert(cache->remote_pending == NULL && cache->slab_count == 2);
+    assert(slab1->remote == 0 && slab2->remote == 0);
+    assert(slab1->ref_count + slab2->ref_count == n - 5 + 1);
+    assert(slab_list_len(cache->slabs_partial[0]) == 2);
+    int found = 0;
+    for (int i = 0; i < 3; i++)
+      found |= obj == objs[i] || obj == objs[n - 1 - i];
+    assert(found);
+
+    /*Reaping drains the remote frees too.*/
+    objc_free(cache, obj);
+    for (int i = 3; i < n - 2; i++) {
+      if (objs[i] != obj)
+        objc_free_remote(cache, objs[i]);
+    }
+    assert(objc_cache_reap(cache, 0) == 2 * cache->slab_size);
+    assert(cache->slab_count == 0);
+    objc_cache_destroy(cache);
+    free(objs);
+  }
+
+  /*One thread allocates and several threads free.*/
+  objc_cache_t *cache = objc_cache_create("remote_mt", 24, 0, c_bulk, NULL);
+  pthread_t threads[REMOTE_CONSUMERS];
+  for (int i = 0; i < REMOTE_CONSUMERS; i++)
+    pthread_create(&threads[i], NULL, remote_consumer, cache);
+  total_bulk_c_runs = 0;
+  for (int i = 0; i < REMOTE_OBJS; i++) {
+    void *obj = objc_cache_alloc(cache);
+    assert(*(int *)obj == 0xb1);
+    pthread_mutex_lock(&remote_queue.lock);
+    while (remote_queue.count == REMOTE_QUEUE)
+      pthread_cond_wait(&remote_queue.cond, &remote_queue.lock);
+    remote_queue.objs[(remote_queue.head + remote_queue.count) % REMOTE_QUEUE] = obj;
+    remote_queue.count++;
+    pthread_cond_broadcast(&remote_queue.cond);
+    pthread_mutex_unlock(&remote_queue.lock);
+  }
+  pthread_mutex_lock(&remote_queue.lock);
+  remote_queue.done = 1;
+  pthread_cond_broadcast(&remote_queue.cond);
+  pthread_mutex_unlock(&remote_queue.lock);
+  for (int i = 0; i < REMOTE_CONSUMERS; i++)
+    pthread_join(threads[i], NULL);
+
+  /*Buffers are recycled instead of growing the cache and every slab is free once drained.*/
+  assert(total_bulk_c_runs <= cache->slab_count * cache->total_buf);
+  assert(cache->slab_count * cache->total_buf < REMOTE_OBJS);
+  int slabs = cache->slab_count;
+  assert(objc_cache_reap(cache, 0) == slabs * cache->slab_size);
+  objc_printf(cache);
+  objc_cache_destroy(cache);
+  printf("test_remote_free() success\n");
+}
+
+/*The counters should follow the path every allocation took and the dump should list every live cache.*/
+static void test_stats(void) {
+  objc_cache_t *cache = objc_cache_create("stats", sizeof(test_t), 0, c_bulk, NULL);
+  int n = cache->total_buf + 1;
+  void **objs = malloc(n * sizeof(void *));
+  for (int i = 0; i < n; i++)
+    objs[i] = objc_cache_alloc(cache);
+  for (int i = 1; i < n; i++)
+    objc_free(cache, objs[i]);
+  objs[1] = objc_cache_alloc(cache);
+
+  objc_cache_stats_t st = objc_cache_stats(cache);
+  assert(st.slabs_full == 0 && st.slabs_partial == 1 && st.slabs_free == 1);
+  assert(st.partial_inuse == 2);
+  assert(st.partial_occupancy == 2.0 / cache->total_buf);
+#ifdef OBJC_STATS
+  assert(st.allocs == n + 1 && st.frees == n - 1 && st.live == 2 && st.inuse == 2);
+  assert(st.peak_inuse == n);
+  assert(st.slabs_created == 2 && st.free_hits == 2 && st.partial_hits == n - 1);
+  assert(st.ctor_calls == n && st.bitmap_hits == 1);
+  assert(st.mag_allocs == 0 && st.remote_frees == 0);
+#endif
+
+  objc_free_remote(cache, objs[1]);
+  objc_cache_reap(cache, 0);
+  st = objc_cache_stats(cache);
+  assert(st.slabs_free == 0 && st.slabs_partial == 1);
+#ifdef OBJC_STATS
+  assert(st.remote_frees == 1 && st.frees == n && st.live == 1);
+  assert(st.slabs_released == 1);
+#endif
+  objc_free(cache, objs[0]);
+  objc_cache_destroy(cache);
+
+  /*Magazine hits are counted per thread and added up on read.*/
+  cache = objc_cache_create("stats_mag", sizeof(test_t), 0, c_bulk, NULL);
+  objc_cache_set_magsize(cache, 8);
+  for (int i = 0; i < 4; i++)
+    objs[i] = objc_cache_alloc(cache);
+  for (int i = 0; i < 4; i++)
+    objc_free(cache, objs[i]);
+  for (int i = 0; i < 4; i++)
+    objs[i] = objc_cache_alloc(cache);
+  st = objc_cache_stats(cache);
+#ifdef OBJC_STATS
+  assert(st.mag_frees == 4 && st.mag_allocs == 4);
+  assert(st.allocs == 8 && st.frees == 4 && st.live == 4 && st.inuse == 4);
+#endif
+
+  /*Both caches are live and in the dump, newest first.*/
+  objc_cache_t *other = objc_cache_create("stats \"json\"", 64, 0, NULL, NULL);
+  char *buf;
+  size_t len;
+  FILE *out = open_memstream(&buf, &len);
+  objc_stats_dump(out, OBJC_STATS_TEXT);
+  fclose(out);
+  const char *text_head = "cache=stats \"json\" size=64 ";
+  assert(strncmp(buf, text_head, strlen(text_head)) == 0);
+  assert(strstr(buf, "\ncache=stats_mag size=") != NULL);
+  assert(strstr(buf, "cache=stats size=") == NULL);
+  free(buf);
+
+  out = open_memstream(&buf, &len);
+  objc_stats_dump(out, OBJC_STATS_JSON);
+  fclose(out);
+  const char *json_head = "{\"caches\": [{\"name\": \"stats \\\"json\\\"\", \"size\": 64,";
+  assert(strncmp(buf, json_head, strlen(json_head)) == 0);
+  assert(strstr(buf, "{\"name\": \"stats_mag\", \"size\": ") != NULL);
+  assert(strcmp(buf + len - 3, "]}\n") == 0);
+  free(buf);
+
+  objc_cache_destroy(other);
+  for (int i = 0; i < 4; i++)
+    objc_free(cache, objs[i]);
+  objc_cache_destroy(cache);
+  free(objs);
+  printf("test_stats() success\n");
+}
+
+/*Maps the trace file at `path` and returns its header.*/
+static objc_trace_hdr_t *trace_map(const char *path, size_t *size) {
+  FILE *f = fopen(path, "r");
+  assert(f);
+  fseek(f, 0, SEEK_END);
+  *size = ftell(f);
+  objc_trace_hdr_t *hdr = mmap(NULL, *size, PROT_READ, MAP_SHARED, fileno(f), 0);
+  fclose(f);
+  assert(hdr != MAP_FAILED);
+  assert(hdr->magic == OBJC_TRACE_MAGIC && hdr->version == OBJC_TRACE_VERSION);
+  assert(hdr->rec_size == sizeof(objc_trace_rec_t));
+  return hdr;
+}
+
+/*Every alloc and free while the trace is active should be in the trace file in order and the ring should keep
+ * only the newest records. Internal caches and operations outside of the trace should not show up.*/
+static void test_trace(void) {
+  char path[] = "/tmp/objc_trace_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+
+  objc_cache_t *before = objc_cache_create("trace_before", sizeof(test_t), 0, c, NULL);
+  void *untraced = objc_cache_alloc(before);
+  assert(objc_trace_start(path, 1024) == 0);
+  assert(objc_trace_start(path, 1024) == -1);
+  /*Large objects use an internal cache for their slab control.*/
+  objc_cache_t *large = objc_cache_create("trace_large", OBJC_LARGE_OBJECT, 0, NULL, NULL);
+  void *objs[4];
+  for (int i = 0; i < 4; i++)
+    objs[i] = objc_cache_alloc(i % 2 ? large : before);
+  for (int i = 0; i < 4; i++)
+    objc_free(i % 2 ? large : before, objs[i]);
+  objc_trace_stop();
+  objc_free(before, untraced);
+
+  size_t size;
+  objc_trace_hdr_t *hdr = trace_map(path, &size);
+  assert(hdr->capacity == 1024 && hdr->head == 8);
+  assert(size == hdr->rec_offset + hdr->capacity * hdr->rec_size);
+  /*Every traced cache is described once, the internal one is left out.*/
+  int id_before = 0, id_large = 0;
+  for (uint32_t i = 0; i < hdr->ncaches; i++) {
+    assert(strncmp(hdr->caches[i].name, "objc_", 5) != 0);
+    if (strcmp(hdr->caches[i].name, "trace_before") == 0)
+      id_before = i + 1;
+    if (strcmp(hdr->caches[i].name, "trace_large") == 0) {
+      id_large = i + 1;
+      assert(hdr->caches[i].size == OBJC_LARGE_OBJECT);
+    }
+  }
+  assert(id_before && id_large);
+  objc_trace_rec_t *recs = (objc_trace_rec_t *)((char *)hdr + hdr->rec_offset);
+  for (int i = 0; i < 8; i++) {
+    assert(recs[i].op == (i < 4 ? OBJC_TRACE_ALLOC : OBJC_TRACE_FREE));
+    assert(recs[i].cache == (i % 2 ? id_large : id_before));
+    assert(recs[i].obj == (uintptr_t)objs[i % 4]);
+    assert(recs[i].thread == 1);
+  }
+  munmap(hdr, size);
+
+  /*A small ring keeps the last `capacity` records.*/
+  assert(objc_trace_start(path, 4) == 0);
+  void *many[10];
+  for (int i = 0; i < 10; i++)
+    many[i] = objc_cache_alloc(before);
+  objc_trace_stop();
+  hdr = trace_map(path, &size);
+  recs = (objc_trace_rec_t *)((char *)hdr + hdr->rec_offset);
+  assert(hdr->head == 10 && hdr->ncaches == 2);
+  for (uint64_t i = hdr->head - hdr->capacity; i < hdr->head; i++)
+    assert(recs[i % hdr->capacity].obj == (uintptr_t)many[i]);
+  munmap(hdr, size);
+
+  for (int i = 0; i < 10; i++)
+    objc_free(before, many[i]);
+  objc_cache_destroy(large);
+  objc_cache_destroy(before);
+  unlink(path);
+  printf("test_trace() success\n");
+}
+
+/*Blocks of every size class should come from caches whose slabs point back to them, keep their contents when
+ * reallocated across classes and be found again from their address alone.*/
+static void test_malloc(void) {
+  size_t sizes[] = {0, 1, 8, 9, 16, 17, 33, 48, 49, 100, 200, 384, 385, 1000, 2048, 3000, 4096, 4097, 100000};
+  int n = sizeof(sizes) / sizeof(sizes[0]);
+  void *ptrs[n];
+  for (int i = 0; i < n; i++) {
+    ptrs[i] = objc_malloc(sizes[i]);
+    assert(ptrs[i]);
+    assert(((uintptr_t)ptrs[i] & (sizes[i] > 8 ? 15 : 7)) == 0);
+    size_t usable = objc_malloc_usable_size(ptrs[i]);
+    assert(usable >= sizes[i] && (sizes[i] > 4096 || usable <= sizes[i] * 2 || usable == 8));
+    memset(ptrs[i], 0x5a, sizes[i]);
+    if (sizes[i] <= 4096) {
+      objc_slabctl_t *slabctl = (objc_slabctl_t *)((char *)((uintptr_t)ptrs[i] & ~(uintptr_t)0xffff) + 0x10000 -
+                                                   sizeof(objc_slabctl_t));
+      assert(slabctl->cache->size == usable && slabctl->cache->slab_size == 0x10000);
+    }
+  }
+  /*Neighbouring blocks aren't touched by the writes.*/
+  for (int i = 0; i < n; i++) {
+    for (size_t j = 0; j < sizes[i]; j++)
+      assert(((unsigned char *)ptrs[i])[j] == 0x5a);
+    objc_free_ptr(ptrs[i]);
+  }
+
+  /*Freed blocks are reused dirty, calloc clears them.*/
+  char *p = objc_malloc(100);
+  memset(p, 0xff, 100);
+  objc_free_ptr(p);
+  char *q = objc_calloc(10, 10);
+  assert(q == p);
+  for (int i = 0; i < 100; i++)
+    assert(q[i] == 0);
+  assert(objc_calloc(SIZE_MAX / 2, 3) == NULL);
+
+  /*Growing through the classes and into libc and back keeps the contents.*/
+  for (int i = 0; i < 100; i++)
+    q[i] = i;
+  assert(objc_realloc(q, 110) == q);
+  char *r = objc_realloc(q, 5000);
+  for (int i = 0; i < 100; i++)
+    assert(r[i] == i);
+  r = objc_realloc(r, 20);
+  for (int i = 0; i < 20; i++)
+    assert(r[i] == i);
+  assert(objc_malloc_usable_size(r) == 32);
+  assert(objc_realloc(r, 0) == NULL);
+
+  /*Sized free and the slab back-pointer of an ordinary cache.*/
+  void *s = objc_malloc(700);
+  objc_free_sized(s, 700);
+  assert(objc_malloc(700) == s);
+  objc_free_sized(s, 700);
+  objc_cache_t *cache = objc_cache_create("backptr", sizeof(test_t), 0, c, NULL);
+  void *obj = objc_cache_alloc(cache);
+  assert(GET_SLABCTL(cache, GET_SLABBASE(cache, obj))->cache == cache);
+  objc_free(cache, obj);
+  objc_cache_destroy(cache);
+  printf("test_malloc() success\n");
+}
+
+typedef struct proto_obj {
+  uint64_t magic;
+  int refs;
+  char tag[20];
+} proto_obj_t;
+
+static int proto_d_runs;
+
+static void proto_d(void *p, size_t size) {
+  assert(((proto_obj_t *)p)->magic == 0xfeedfacecafebeefULL);
+  proto_d_runs++;
+}
+
+/*Every buffer of a prototype cache should hold the image from the start, in every layout, and keep the state it
+ * is freed in like any constructed object.*/
+static void test_proto(void) {
+  proto_obj_t image = {.magic = 0xfeedfacecafebeefULL, .refs = 1, .tag = "prototype"};
+  size_t sizes[] = {sizeof(proto_obj_t), 200, 1000};
+  unsigned int flags[] = {0, OBJC_CACHE_BUFCTL, 0};
+  for (int s = 0; s < 3; s++) {
+    char buf[1000];
+    memset(buf, 0x3c, sizeof(buf));
+    memcpy(buf, &image, sizeof(image));
+    objc_cache_t *cache = objc_cache_create_proto("proto", sizes[s], 0, buf, proto_d, flags[s]);
+    memset(buf, 0, sizeof(buf)); // the cache keeps its own copy
+    assert(cache && cache->c == NULL);
+    assert(s != 1 || cache->idx_size == 0);
+    assert(s != 2 || (cache->flags & OBJC_CACHE_OFFSLAB));
+
+    int n = cache->total_buf * 3;
+    void **objs = malloc(n * sizeof(void *));
+    for (int i = 0; i < n; i++) {
+      objs[i] = objc_cache_alloc(cache);
+      proto_obj_t *o = objs[i];
+      assert(o->magic == image.magic && o->refs == 1 && strcmp(o->tag, "prototype") == 0);
+      assert(((unsigned char *)objs[i])[sizes[s] - 1] == (sizes[s] > sizeof(image) ? 0x3c : 0));
+    }
+    /*The whole slab is marked constructed at once.*/
+    objc_slabctl_t *slabctl = slab_ctl(cache, GET_SLABBASE(cache, objs[0]));
+    for (int i = 0; i < cache->total_buf; i++)
+      assert(bm_get(slabctl->bm_const, i));
+
+    ((proto_obj_t *)objs[5])->refs = 7;
+    objc_free(cache, objs[5]);
+    assert(objc_cache_alloc(cache) == objs[5] && ((proto_obj_t *)objs[5])->refs == 7);
+
+    assert(objc_cache_alloc_bulk(cache, 4, objs) == 4);
+    for (int i = 0; i < 4; i++)
+      assert(((proto_obj_t *)objs[i])->magic == image.magic);
+    objc_free_bulk(cache, 4, objs);
+    int slabs = cache->slab_count;
+    proto_d_runs = 0;
+    objc_cache_reap(cache, 0);
+    assert(proto_d_runs == cache->total_buf && cache->slab_count == slabs - 1);
+    objc_cache_destroy(cache);
+    free(objs);
+  }
+  assert(objc_cache_create_proto("proto", 8, 0, NULL, NULL, 0) == NULL);
+  printf("test_proto() success\n");
+}
+
+/*Fills `n` slabs of the cache and frees everything, leaving `n` more free slabs.*/
+static void reaper_burst(objc_cache_t *cache, int n, void **objs) {
+  for (int i = 0; i < n * (int)cache->total_buf; i++)
+    objs[i] = objc_cache_alloc(cache);
+  for (int i = 0; i < n * (int)cache->total_buf; i++)
+    objc_free(cache, objs[i]);
+}
+
+static unsigned int reaper_slabs(objc_cache_t *cache) {
+  pthread_mutex_lock(&cache->lock);
+  unsigned int slabs = cache->slab_count;
+  pthread_mutex_unlock(&cache->lock);
+  return slabs;
+}
+
+/*Waits up to a second for the reaper thread to bring the cache down to `slabs` slabs.*/
+static int reaper_wait(objc_cache_t *cache, unsigned int slabs) {
+  for (int i = 0; i < 1000 && reaper_slabs(cache) != slabs; i++)
+    usleep(1000);
+  return reaper_slabs(cache) == slabs;
+}
+
+static int always_pressure(void *arg) {
+  (*(int *)arg)++;
+  return 1;
+}
+
+static _Atomic int reaper_dtor_runs;
+
+/*A destructor creating and destroying a cache of its own, which needs the registry.*/
+static void reaper_dtor(void *p, size_t size) {
+  objc_cache_t *tmp = objc_cache_create("reaper_tmp", 16, 0, NULL, NULL);
+  objc_free(tmp, objc_cache_alloc(tmp));
+  objc_cache_destroy(tmp);
+  atomic_fetch_add(&reaper_dtor_runs, 1);
+}
+
+static _Atomic int reaper_dumping;
+
+static void *reaper_dumper(void *arg) {
+  FILE *out = fopen("/dev/null", "w");
+  while (atomic_load(&reaper_dumping))
+    objc_stats_dump(out, OBJC_STATS_TEXT);
+  fclose(out);
+  return NULL;
+}
+
+static void test_reaper(void) {
+  objc_cache_t *cache = objc_cache_create("reaper", sizeof(test_t), 0, c, NULL);
+  void **objs = malloc(4 * cache->total_buf * sizeof(void *));
+
+  /*The first pass only sets the window. Free slabs that stay untouched for a whole pass are released, the ones a
+   * burst went through are kept.*/
+  reaper_burst(cache, 4, objs);
+  assert(cache->free_slabs == 4);
+  objc_reaper_run(0);
+  assert(cache->slab_count == 4 && cache->free_min == 4);
+  reaper_burst(cache, 2, objs);
+  assert(cache->free_min == 2);
+  objc_reaper_run(0);
+  assert(cache->slab_count == 2 && cache->free_slabs == 2);
+  objc_reaper_run(0);
+  assert(cache->slab_count == 0 && cache->free_slabs == 0);
+
+  /*Under pressure all free slabs go at once.*/
+  reaper_burst(cache, 3, objs);
+  assert(objc_reaper_run(1) >= 3 * cache->slab_size);
+  assert(cache->slab_count == 0 && cache->free_min == 0);
+
+  /*Background thread: an idle cache is trimmed to nothing after a couple of intervals.*/
+  assert(objc_reaper_start(5, 0) == 0);
+  assert(objc_reaper_start(5, 0) == -1);
+  reaper_burst(cache, 3, objs);
+  assert(reaper_wait(cache, 0));
+  objc_reaper_stop();
+
+  /*A pressure hook that always fires releases the free slabs on the first pass.*/
+  int checks = 0;
+  objc_reaper_set_pressure(always_pressure, &checks);
+  reaper_burst(cache, 2, objs);
+  assert(objc_reaper_start(5, 0) == 0);
+  assert(reaper_wait(cache, 0));
+  objc_reaper_stop();
+  assert(checks > 0);
+  objc_reaper_set_pressure(NULL, NULL);
+
+  /*Passes don't hold the registry while destructors run.*/
+  objc_cache_t *dcache = objc_cache_create("reaper_dtor", sizeof(test_t), 0, c, reaper_dtor);
+  reaper_burst(dcache, 1, objs);
+  objc_reaper_run(0);
+  objc_reaper_run(0);
+  assert(dcache->slab_count == 0 && reaper_dtor_runs == (int)dcache->total_buf);
+  reaper_burst(dcache, 1, objs);
+  objc_reaper_run(1);
+  assert(dcache->slab_count == 0 && reaper_dtor_runs == 2 * (int)dcache->total_buf);
+
+  /*Nor do stats dumps while they lock the caches one after the other.*/
+  pthread_t dumper;
+  atomic_store(&reaper_dumping, 1);
+  pthread_create(&dumper, NULL, reaper_dumper, NULL);
+  for (int i = 0; i < 20; i++) {
+    reaper_burst(dcache, 1, objs);
+    objc_reaper_run(1);
+  }
+  atomic_store(&reaper_dumping, 0);
+  pthread_join(dumper, NULL);
+  assert(reaper_dtor_runs == 22 * (int)dcache->total_buf);
+  objc_cache_destroy(dcache);
+
+  size_t limit = 1;
+  assert(objc_pressure_rss(&limit) == 1);
+  limit = (size_t)-1;
+  assert(objc_pressure_rss(&limit) == 0);
+
+  printf("test_reaper() success\n");
+  objc_cache_destroy(cache);
+  free(objs);
+}
+
+typedef struct walk_state {
+  _Atomic int visited;
+  char *last; // previous object visited, for the address order
+  int sorted;
+  int stop_after;
+} walk_state_t;
+
+static int walk_count(void *obj, void *arg) {
+  walk_state_t *st = arg;
+  test_t *t = obj;
+  assert(t->x == 33);
+  t->y++;
+  st->sorted &= (char *)obj > st->last;
+  st->last = obj;
+  return ++st->visited == st->stop_after ? 5 : 0;
+}
+
+static int walk_count_parallel(void *obj, void *arg) {
+  walk_state_t *st = arg;
+  atomic_fetch_add(&st->visited, 1);
+  __atomic_fetch_add(&((test_t *)obj)->y, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/*Frees every object visited, the walk keeps going over the rest of the slab.*/
+static int walk_free(void *obj, void *arg) {
+  objc_free(arg, obj);
+  return 0;
+}
+
+static void test_walk(void) {
+  unsigned int flags[] = {0, OBJC_CACHE_BUFCTL};
+  for (int f = 0; f < 2; f++) {
+    objc_cache_t *cache = objc_cache_create_ex("walk", sizeof(test_t), 0, c, NULL, flags[f]);
+    int n = 3 * cache->total_buf + 5;
+    test_t **objs = malloc(n * sizeof(test_t *));
+    for (int i = 0; i < n; i++)
+      objs[i] = objc_cache_alloc(cache);
+    /*One slab entirely free and holes in the others.*/
+    for (int i = cache->total_buf; i < 2 * (int)cache->total_buf; i++) {
+      objc_free(cache, objs[i]);
+      objs[i] = NULL;
+    }
+    for (int i = 0; i < n; i += 3) {
+      if (objs[i]) {
+        objc_free(cache, objs[i]);
+        objs[i] = NULL;
+      }
+    }
+    int live = 0;
+    for (int i = 0; i < n; i++) {
+      if (objs[i]) {
+        objs[i]->y = 0;
+        live++;
+      }
+    }
+
+    walk_state_t st = {.sorted = 1};
+    assert(objc_cache_walk(cache, walk_count, &st) == 0);
+    assert(st.visited == live && st.sorted);
+    for (int i = 0; i < n; i++)
+      assert(!objs[i] || objs[i]->y == 1);
+
+    /*Chunks don't stop at slab boundaries.*/
+    objc_walk_t *walk = objc_walk_begin(cache);
+    void *chunk[7];
+    char *last = NULL;
+    int total = 0;
+    for (int got; (got = objc_walk_next(walk, chunk, 7)) > 0; total += got) {
+      assert(got == 7 || total + got == live);
+      for (int i = 0; i < got; last = chunk[i++])
+        assert((char *)chunk[i] > last);
+    }
+    objc_walk_end(walk);
+    assert(total == live);
+
+    st = (walk_state_t){.sorted = 1, .stop_after = 10};
+    assert(objc_cache_walk(cache, walk_count, &st) == 5 && st.visited == 10);
+
+    st = (walk_state_t){0};
+    assert(objc_cache_walk_parallel(cache, walk_count_parallel, &st, 4) == 0);
+    assert(st.visited == live);
+    /*Every object visited once by each walk, the first 10 once more by the walk stopped early.*/
+    int extra = 0;
+    for (int i = 0; i < n; i++) {
+      assert(!objs[i] || objs[i]->y == 2 || objs[i]->y == 3);
+      extra += objs[i] && objs[i]->y == 3;
+    }
+    assert(extra == 10);
+
+    /*Objects freed during the walk go to the remote free lists and are back in their slabs afterwards.*/
+    assert(objc_cache_walk(cache, walk_free, cache) == 0);
+    st = (walk_state_t){.sorted = 1};
+    assert(objc_cache_walk(cache, walk_count, &st) == 0 && st.visited == 0);
+    objc_cache_destroy(cache);
+    free(objs);
+  }
+
+  /*Large object caches sort their off-slab slabctls by slab address.*/
+  objc_cache_t *cache = objc_cache_create_ex("walk_large", 1000, 0, NULL, NULL, OBJC_CACHE_OFFSLAB);
+  void *objs[64];
+  for (int i = 0; i < 64; i++)
+    objs[i] = objc_cache_alloc(cache);
+  for (int i = 0; i < 64; i += 2)
+    objc_free(cache, objs[i]);
+  objc_walk_t *walk = objc_walk_begin(cache);
+  void *chunk[64];
+  int got = objc_walk_next(walk, chunk, 64);
+  assert(got == 32 && objc_walk_next(walk, chunk, 64) == 0);
+  for (int i = 1; i < got; i++)
+    assert(chunk[i] > chunk[i - 1]);
+  objc_walk_end(walk);
+  objc_cache_destroy(cache);
+
+  printf("test_walk() success\n");
+}
+
+typedef struct movable {
+  int id;
+  int moves;
+  char pad[56];
+} movable_t;
+
+static movable_t *movable_refs[4096]; // the only reference to every live object
+static int movable_refuse = -1;       // id the callback refuses to move
+static int movable_freed = -1;        // id freed by its owner while the callback runs
+
+static objc_move_t movable_move(void *old_obj, void *new_obj, size_t size, void *arg) {
+  movable_t *old = old_obj;
+  if (old->id == movable_refuse)
+    return OBJC_MOVE_NO;
+  if (old->id == movable_freed) {
+    movable_refs[old->id] = NULL;
+    objc_free(arg, old);
+    return OBJC_MOVE_FREED;
+  }
+  memcpy(new_obj, old_obj, size);
+  ((movable_t *)new_obj)->moves++;
+  movable_refs[old->id] = new_obj;
+  return OBJC_MOVE_YES;
+}
+
+static void test_defrag(void) {
+  objc_cache_t *cache = objc_cache_create("movable", sizeof(movable_t), 0, NULL, NULL);
+  assert(objc_cache_defrag(cache, 0, 0) == 0);
+  assert(objc_cache_set_move(cache, movable_move, cache) == 0);
+  int per_slab = cache->total_buf, n = 6 * per_slab;
+  assert(n <= 4096);
+  for (int i = 0; i < n; i++) {
+    movable_refs[i] = objc_cache_alloc(cache);
+    movable_refs[i]->id = i;
+    movable_refs[i]->moves = 0;
+  }
+  assert(cache->slab_count == 6);
+  assert(objc_cache_set_move(cache, movable_move, cache) == -1);
+
+  /*Slab k keeps one object out of k + 1: 6 sparse slabs holding less than 3 slabs worth of objects.*/
+  int live = 0;
+  for (int i = 0; i < n; i++) {
+    int k = i / per_slab;
+    if (i % (k + 2) != 0) {
+      objc_free(cache, movable_refs[i]);
+      movable_refs[i] = NULL;
+    } else {
+      live++;
+    }
+  }
+
+  /*A budget of a single move.*/
+  assert(objc_cache_defrag(cache, 1, 0) == 0);
+  int moved = 0;
+  for (int i = 0; i < n; i++)
+    moved += movable_refs[i] && movable_refs[i]->moves;
+  assert(moved == 1);
+
+  /*The last object of the sparsest slab (slab 5) refuses to move and keeps its slab. An object of slab 4 is freed
+   * by its owner during the pass, its slab is released anyway.*/
+  for (int i = 6 * per_slab - 1; movable_refuse < 0; i--) {
+    if (movable_refs[i] && !movable_refs[i]->moves)
+      movable_refuse = i;
+  }
+  for (int i = 5 * per_slab - 1; movable_freed < 0; i--) {
+    if (movable_refs[i] && !movable_refs[i]->moves)
+      movable_freed = i;
+  }
+  movable_t *refused = movable_refs[movable_refuse];
+  size_t released = objc_cache_defrag(cache, 0, 0);
+  live--;
+  assert(released >= 2 * cache->slab_size && released % cache->slab_size == 0);
+  assert(cache->slab_count == 6 - released / cache->slab_size);
+  assert(movable_refs[movable_refuse] == refused && movable_refs[movable_freed] == NULL);
+  int count = 0;
+  for (int i = 0; i < n; i++) {
+    if (movable_refs[i]) {
+      assert(movable_refs[i]->id == i);
+      count++;
+    }
+  }
+  assert(count == live);
+  movable_refuse = movable_freed = -1;
+
+  /*Without the refusal another pass packs the last sparse slab too. A trace of the pass sees every move as the
+   * allocation of the new address followed by the free of the old one.*/
+  char path[] = "/tmp/objc_trace_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+  assert(objc_trace_start(path, 1024) == 0);
+  objc_cache_defrag(cache, 0, 0);
+  objc_trace_stop();
+  unsigned int needed = (live + per_slab - 1) / per_slab;
+  assert(cache->slab_count <= needed + 1);
+  size_t size;
+  objc_trace_hdr_t *hdr = trace_map(path, &size);
+  objc_trace_rec_t *recs = (objc_trace_rec_t *)((char *)hdr + hdr->rec_offset);
+  assert(hdr->head > 0 && hdr->head % 2 == 0 && hdr->head <= hdr->capacity);
+  for (uint64_t r = 0; r < hdr->head; r += 2) {
+    assert(recs[r].op == OBJC_TRACE_ALLOC && recs[r + 1].op == OBJC_TRACE_FREE);
+    int found = 0;
+    for (int i = 0; i < n && !found; i++)
+      found = movable_refs[i] && (uint64_t)(uintptr_t)movable_refs[i] == recs[r].obj;
+    assert(found);
+  }
+  munmap(hdr, size);
+  unlink(path);
+  for (int i = 0; i < n; i++) {
+    if (movable_refs[i])
+      objc_free(cache, movable_refs[i]);
+  }
+  printf("test_defrag() success\n");
+  objc_cache_destroy(cache);
+}
+
+typedef struct epoch_reader {
+  pthread_t tid;
+  _Atomic int state; // 1 once inside the read section, set to 2 to make it leave
+} epoch_reader_t;
+
+static void *epoch_block_reader(void *arg) {
+  epoch_reader_t *r = arg;
+  objc_read_enter();
+  atomic_store(&r->state, 1);
+  while (atomic_load(&r->state) != 2)
+    sched_yield();
+  objc_read_exit();
+  return NULL;
+}
+
+static test_t *_Atomic epoch_shared;
+static _Atomic int epoch_done;
+static _Atomic int epoch_bad;
+
+static void *epoch_reader(void *arg) {
+  while (!atomic_load(&epoch_done)) {
+    objc_read_enter();
+    test_t *t = atomic_load(&epoch_shared);
+    if (t && __atomic_load_n(&t->y, __ATOMIC_RELAXED) != 1)
+      atomic_store(&epoch_bad, 1);
+    objc_read_exit();
+  }
+  return NULL;
+}
+
+static void *epoch_writer(void *arg) {
+  objc_cache_t *cache = arg;
+  for (int i = 0; i < 20000; i++) {
+    /*A reused buffer goes through a state readers must never see.*/
+    test_t *t = objc_cache_alloc(cache);
+    for (int j = 0; j < 16; j++)
+      __atomic_store_n(&t->y, 2, __ATOMIC_RELAXED);
+    __atomic_store_n(&t->y, 1, __ATOMIC_RELAXED);
+    test_t *old = atomic_exchange(&epoch_shared, t);
+    if (old) {
+      objc_read_enter();
+      objc_free_deferred(cache, old);
+      objc_read_exit();
+    }
+  }
+  return NULL;
+}
+
+static void test_epoch(void) {
+  objc_cache_t *cache = objc_cache_create("epoch", sizeof(test_t), 0, c, NULL);
+  objc_epoch_stats_t st0 = objc_epoch_stats();
+
+  /*Nothing is freed while a reader that was there at retire time is still in its read section.*/
+  epoch_reader_t r = {0};
+  pthread_create(&r.tid, NULL, epoch_block_reader, &r);
+  while (atomic_load(&r.state) != 1)
+    sched_yield();
+  void *objs[200];
+  for (int i = 0; i < 200; i++)
+    objs[i] = objc_cache_alloc(cache);
+  for (int i = 0; i < 200; i++)
+    objc_free_deferred(cache, objs[i]);
+  objc_epoch_stats_t st = objc_epoch_stats();
+  assert(st.pending - st0.pending == 200 && st.retired - st0.retired == 200);
+  assert(st.epoch <= st0.epoch + 1);
+#ifdef OBJC_STATS
+  assert(objc_cache_stats(cache).inuse == 200);
+#endif
+  atomic_store(&r.state, 2);
+  pthread_join(r.tid, NULL);
+
+  objc_epoch_synchronize();
+  st = objc_epoch_stats();
+  assert(st.pending == st0.pending && st.reclaimed - st0.reclaimed == 200);
+  assert(st.epoch >= st0.epoch + 2 && st.peak_pending >= 200);
+#ifdef OBJC_STATS
+  assert(objc_cache_stats(cache).inuse == 0);
+#endif
+
+  /*Nested read sections, retiring from inside one.*/
+  void *obj = objc_cache_alloc(cache);
+  objc_read_enter();
+  objc_read_enter();
+  objc_free_deferred(cache, obj);
+  objc_read_exit();
+  objc_epoch_synchronize(); // no-op inside a read section
+  assert(objc_epoch_stats().pending == st0.pending + 1);
+  objc_read_exit();
+  objc_epoch_synchronize();
+  assert(objc_epoch_stats().pending == st0.pending);
+  objc_cache_destroy(cache);
+
+  /*Readers never see an object that was freed and reused under them. Writers exit with their deferred frees done.*/
+  cache = objc_cache_create("epoch_shared", sizeof(test_t), 0, c, NULL);
+  pthread_t readers[3], writers[2];
+  for (int i = 0; i < 3; i++)
+    pthread_create(&readers[i], NULL, epoch_reader, NULL);
+  for (int i = 0; i < 2; i++)
+    pthread_create(&writers[i], NULL, epoch_writer, cache);
+  for (int i = 0; i < 2; i++)
+    pthread_join(writers[i], NULL);
+  atomic_store(&epoch_done, 1);
+  for (int i = 0; i < 3; i++)
+    pthread_join(readers[i], NULL);
+  assert(!atomic_load(&epoch_bad));
+  assert(objc_epoch_stats().pending == st0.pending);
+#ifdef OBJC_STATS
+  assert(objc_cache_stats(cache).inuse == 1);
+#endif
+  objc_free(cache, atomic_load(&epoch_shared));
+  objc_cache_destroy(cache);
+  printf("test_epoch() success\n");
+}
+
+typedef struct pobj {
+  int x;
+  int constructed;
+  struct pobj *next;
+  char pad[48];
+} pobj_t;
+
+static int pctor_runs;
+
+static void pctor(void *p, size_t size) {
+  ((pobj_t *)p)->constructed = 1;
+  pctor_runs++;
+}
+
+static int pwalk_count(void *obj, void *arg) {
+  (*(int *)arg)++;
+  return 0;
+}
+
+static void test_persist(void) {
+  char path[] = "/tmp/objc_persistXXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+  size_t max_size = 16 << 20;
+
+  /*First run: build a list, free every other object, keep the head as the root.*/
+  objc_cache_t *cache = objc_cache_open("persist", path, sizeof(pobj_t), 0, pctor, NULL, max_size);
+  assert(cache && cache->idx_size);
+  assert(objc_cache_set_magsize(cache, 8) == 0);
+  int n = 3 * cache->total_buf;
+  pobj_t **objs = malloc(n * sizeof(pobj_t *));
+  for (int i = 0; i < n; i++) {
+    objs[i] = objc_cache_alloc(cache);
+    objs[i]->x = i;
+  }
+  assert(pctor_runs == n && cache->slab_count == 3);
+  for (int i = 0; i < n; i += 2)
+    objs[i]->next = i + 2 < n ? objs[i + 2] : NULL;
+  for (int i = 1; i < n; i += 2)
+    objc_free(cache, objs[i]);
+  objc_cache_set_root(cache, objs[0]);
+  assert(objc_cache_root(cache) == objs[0]);
+  /*The file is in use: opening it again is refused.*/
+  assert(objc_cache_open("persist", path, sizeof(pobj_t), 0, pctor, NULL, max_size) == NULL);
+  objc_cache_close(cache);
+
+  /*Restart: same slabs, same constructed objects, same live objects.*/
+  pctor_runs = 0;
+  cache = objc_cache_open("persist", path, sizeof(pobj_t), 0, pctor, NULL, max_size);
+  assert(cache && cache->slab_count == 3);
+  pobj_t *root = objc_cache_root(cache);
+  assert(root && root->x == 0 && root->constructed);
+  int live = 0;
+  assert(objc_cache_walk(cache, pwalk_count, &live) == 0 && live == (n + 1) / 2);
+  /*Mapped at the same address, the list is still linked.*/
+  if (root == objs[0]) {
+    int i = 0;
+    for (pobj_t *p = root; p; p = p->next, i += 2)
+      assert(p->x == i);
+    assert(i / 2 == live);
+  }
+  for (int i = 1; i < n; i += 2)
+    objs[i] = objc_cache_alloc(cache);
+  assert(pctor_runs == 0 && cache->slab_count == 3);
+  objc_cache_close(cache);
+
+  /*Torn or foreign state is refused.*/
+  assert(objc_cache_open("persist", path, sizeof(pobj_t) + 8, 0, pctor, NULL, max_size) == NULL);
+  fd = open(path, O_RDWR);
+  uint64_t bogus = 12345, saved;
+  assert(pread(fd, &saved, sizeof(saved), 32) == sizeof(saved));
+  assert(pwrite(fd, &bogus, sizeof(bogus), 32) == sizeof(bogus));
+  assert(objc_cache_open("persist", path, sizeof(pobj_t), 0, pctor, NULL, max_size) == NULL);
+  assert(pwrite(fd, &saved, sizeof(saved), 32) == sizeof(saved));
+  close(fd);
+
+  /*Destroying the cache empties the file.*/
+  cache = objc_cache_open("persist", path, sizeof(pobj_t), 0, pctor, NULL, max_size);
+  assert(cache && cache->slab_count == 3);
+  objc_cache_destroy(cache);
+  cache = objc_cache_open("persist", path, sizeof(pobj_t), 0, pctor, NULL, max_size);
+  assert(cache && cache->slab_count == 0 && objc_cache_root(cache) == NULL);
+  objc_cache_close(cache);
+
+  /*Large objects get the compact layout as well and come back the same.*/
+  typedef struct big {
+    int x;
+    char data[636];
+  } big_t;
+  unlink(path);
+  cache = objc_cache_open("persist_big", path, sizeof(big_t), 0, NULL, NULL, max_size);
+  assert(cache && cache->idx_size && !(cache->flags & OBJC_CACHE_OFFSLAB));
+  n = 2 * cache->total_buf + 1;
+  big_t **bigs = malloc(n * sizeof(big_t *));
+  for (int i = 0; i < n; i++) {
+    bigs[i] = objc_cache_alloc(cache);
+    bigs[i]->x = i;
+    memset(bigs[i]->data, i & 0xff, sizeof(bigs[i]->data));
+  }
+  objc_cache_set_root(cache, bigs[n - 1]);
+  objc_cache_close(cache);
+  cache = objc_cache_open("persist_big", path, sizeof(big_t), 0, NULL, NULL, max_size);
+  assert(cache && cache->slab_count == 3);
+  big_t *last = objc_cache_root(cache);
+  assert(last && last->x == n - 1 && last->data[sizeof(last->data) - 1] == (char)((n - 1) & 0xff));
+  live = 0;
+  assert(objc_cache_walk(cache, pwalk_count, &live) == 0 && live == n);
+  objc_cache_close(cache);
+  free(bigs);
+
+  /*Other caches ignore the root.*/
+  cache = objc_cache_create("not_persist", sizeof(pobj_t), 0, NULL, NULL);
+  objc_cache_set_root(cache, objs[0]);
+  assert(objc_cache_root(cache) == NULL);
+  objc_cache_close(cache);
+
+  unlink(path);
+  free(objs);
+  printf("test_persist() success\n");
+}
+
+static _Atomic int reserve_ctor_runs;
+
+static void reserve_ctor(void *p, size_t size) {
+  c(p, size);
+  atomic_fetch_add(&reserve_ctor_runs, 1);
+}
+
+static void test_reserve(void) {
+  objc_cache_t *cache = objc_cache_create("reserve", sizeof(test_t), 0, reserve_ctor, NULL);
+  int n = 10 * cache->total_buf + 1;
+  assert(objc_cache_reserve(cache, n, 4) == 0);
+  assert(cache->slab_count == 11 && cache->free_slabs == 11);
+  assert(reserve_ctor_runs == 11 * (int)cache->total_buf);
+  /*Already there, nothing to do.*/
+  assert(objc_cache_reserve(cache, n, 4) == 0 && cache->slab_count == 11);
+
+  /*The reaper leaves the reservation alone.*/
+  objc_reaper_run(0);
+  objc_reaper_run(0);
+  assert(cache->slab_count == 11);
+
+  void **objs = malloc(n * sizeof(void *));
+  for (int i = 0; i < n; i++) {
+    objs[i] = objc_cache_alloc(cache);
+    assert(((test_t *)objs[i])->x == 33);
+  }
+  assert(cache->slab_count == 11 && reserve_ctor_runs == 11 * (int)cache->total_buf);
+#ifdef OBJC_STATS
+  objc_cache_stats_t st = objc_cache_stats(cache);
+  assert(st.slabs_created == 11 && st.ctor_calls == 11 * cache->total_buf);
+#endif
+  for (int i = 0; i < n; i++)
+    objc_free(cache, objs[i]);
+
+  /*A smaller reservation lets the reaper trim the rest.*/
+  assert(objc_cache_reserve(cache, cache->total_buf, 1) == 0);
+  objc_reaper_run(0);
+  objc_reaper_run(0);
+  assert(cache->slab_count == 1);
+  objc_cache_destroy(cache);
+
+  /*A file with room for a few slabs: the reservation fails part way and only covers the slabs that exist.*/
+  char path[] = "/tmp/objc_reserveXXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+  unlink(path);
+  cache = objc_cache_open("reserve_file", path, sizeof(test_t), 0, reserve_ctor, NULL, 8 * PAGE_SIZE);
+  assert(cache);
+  assert(objc_cache_reserve(cache, 100 * cache->total_buf, 2) == -1);
+  assert(cache->slab_count > 0 && cache->slab_count < 100 && cache->reserve_slabs == cache->slab_count);
+  objc_cache_destroy(cache);
+  unlink(path);
+
+  /*Prototype caches only get their pages prefaulted.*/
+  test_t image = {.x = 7, .y = 8};
+  cache = objc_cache_create_proto("reserve_proto", sizeof(test_t), 0, &image, NULL, 0);
+  assert(objc_cache_reserve(cache, 100, 2) == 0 && cache->slab_count == 1);
+  test_t *t = objc_cache_alloc(cache);
+  assert(t->x == 7 && t->y == 8 && cache->slab_count == 1);
+  objc_free(cache, t);
+  objc_cache_destroy(cache);
+  free(objs);
+  printf("test_reserve() success\n");
+}
+
+static void *profile_worker(void *arg) {
+  objc_cache_t *cache = arg;
+  void *objs[256];
+  for (int r = 0; r < 100; r++) {
+    for (int i = 0; i < 256; i++)
+      objs[i] = objc_cache_alloc(cache);
+    for (int i = 0; i < 256; i++)
+      objc_free(cache, objs[i]);
+  }
+  return NULL;
+}
+
+__attribute__((noinline)) static void *profile_site_a(objc_cache_t *cache) { return objc_cache_alloc(cache); }
+
+__attribute__((noinline)) static void *profile_site_b(objc_cache_t *cache) { return objc_cache_alloc(cache); }
+
+static void test_profile(void) {
+  objc_cache_t *cache = objc_cache_create("profile", 64, 0, NULL, NULL);
+  assert(objc_profile_start(0) == -1);
+  /*Sampling every byte samples every allocation.*/
+  assert(objc_profile_start(1) == 0);
+  assert(objc_profile_start(1) == -1);
+  /*The thread notices the start within its idle countdown.*/
+  for (int i = 0; i < (1 << 20) / 64 + 1; i++)
+    objc_free(cache, objc_cache_alloc(cache));
+  objc_profile_stats_t st = objc_profile_stats();
+  assert(st.sample_bytes == 1 && st.samples > 0 && st.live == 0 && st.dropped == 0);
+
+  void *a[1000], *b[500];
+  uint64_t samples = st.samples;
+  for (int i = 0; i < 1000; i++)
+    a[i] = profile_site_a(cache);
+  for (int i = 0; i < 500; i++)
+    b[i] = profile_site_b(cache);
+  st = objc_profile_stats();
+  assert(st.samples == samples + 1500 && st.live == 1500);
+  for (int i = 0; i < 1000; i++)
+    objc_free(cache, a[i]);
+  assert(objc_profile_stats().live == 500);
+
+  /*Every sampled 64 byte object stands for 64 bytes, the 500 left come from a single site.*/
+  char *buf;
+  size_t len;
+  FILE *out = open_memstream(&buf, &len);
+  assert(objc_profile_dump(out, OBJC_PROFILE_FOLDED) == 0);
+  fclose(out);
+  assert(strstr(buf, ";[profile] 32000\n") && !strstr(buf, ";[profile] 64000\n"));
+  free(buf);
+  out = open_memstream(&buf, &len);
+  assert(objc_profile_dump(out, OBJC_PROFILE_FOLDED_ALLOC) == 0);
+  fclose(out);
+  assert(strstr(buf, ";[profile] 64000\n") && strstr(buf, ";[profile] 32000\n"));
+  free(buf);
+  out = open_memstream(&buf, &len);
+  assert(objc_profile_dump(out, OBJC_PROFILE_PPROF) == 0);
+  fclose(out);
+  assert(strncmp(buf, "heap profile: 500: 32000 [", 26) == 0 && strstr(buf, "@ heap_v2/1\n"));
+  assert(strstr(buf, "\n500: 32000 [500: 32000] @ 0x") && strstr(buf, "\n0: 0 [1000: 64000] @ 0x"));
+  assert(strstr(buf, "\nMAPPED_LIBRARIES:\n"));
+  free(buf);
+
+  /*Frees are followed after the stop.*/
+  objc_profile_stop();
+  for (int i = 0; i < 250; i++)
+    objc_free(cache, b[i]);
+  assert(objc_profile_stats().live == 250);
+
+  /*Dump on a signal.*/
+  char path[] = "/tmp/objc_profileXXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  assert(objc_profile_signal(SIGUSR2, path, OBJC_PROFILE_FOLDED) == 0);
+  raise(SIGUSR2);
+  char text[4096];
+  ssize_t n = 0;
+  for (int tries = 0; tries < 2000; tries++) {
+    n = pread(fd, text, sizeof(text) - 1, 0);
+    if (n > 0) {
+      text[n] = '\0';
+      if (strstr(text, ";[profile] 16000\n"))
+        break;
+    }
+    usleep(1000);
+  }
+  assert(n > 0 && strstr(text, ";[profile] 16000\n"));
+  close(fd);
+  unlink(path);
+
+  /*Starting again forgets the objects of the previous profile, their frees are ignored.*/
+  assert(objc_profile_start(256) == 0);
+  assert(objc_profile_stats().live == 0 && cache->prof_live == 0);
+  for (int i = 250; i < 500; i++)
+    objc_free(cache, b[i]);
+  pthread_t threads[4];
+  for (int i = 0; i < 4; i++)
+    pthread_create(&threads[i], NULL, profile_worker, cache);
+  for (int i = 0; i < 4; i++)
+    pthread_join(threads[i], NULL);
+  st = objc_profile_stats();
+  assert(st.samples > 0 && st.live == 0 && st.dropped == 0);
+
+  /*The sampled objects of a destroyed cache are no longer in use.*/
+  for (int i = 0; i < 1000; i++)
+    a[i] = objc_cache_alloc(cache);
+  assert(objc_profile_stats().live > 0);
+  objc_cache_destroy(cache);
+  assert(objc_profile_stats().live == 0);
+  objc_profile_stop();
+  printf("test_profile() success\n");
+}
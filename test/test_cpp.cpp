@@ -0,0 +1,187 @@
+#include "objcache.hpp"
+#include <cassert>
+#include <cstdio>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+static void test_layout();
+static void test_typed_cache();
+static void test_resource();
+static void test_allocator();
+
+int main() {
+  test_layout();
+
+  test_typed_cache();
+
+  test_resource();
+
+  test_allocator();
+
+  return 0;
+}
+
+struct small {
+  int x, y;
+  char t;
+};
+
+struct alignas(64) line {
+  long v;
+};
+
+/*The layout computed at compile time should match the one the C library picks at runtime.*/
+static void test_layout() {
+  static_assert(objc::cache<small>::slab.buffer_size == 16 && objc::cache<small>::slab.idx_size == 1);
+  static_assert(objc::cache<line>::slab.buffer_size == 64);
+  static_assert(objc::cache<small, OBJC_CACHE_BUFCTL>::slab.buffer_size == 24);
+  static_assert(objc::cache_layout(3, 3).total_buf == 0);
+
+  std::size_t sizes[] = {1, 3, 8, 12, 24, 40, 64, 100, 200, 256, 500, 511, 512, 700, 1024, 3000, 4096, 10000, 70000};
+  int aligns[] = {0, 8, 16, 64, 256, 4096};
+  unsigned int flags[] = {0, OBJC_CACHE_BUFCTL, OBJC_CACHE_ISOLATE, OBJC_CACHE_ORDER(0), OBJC_CACHE_ORDER(3),
+                          OBJC_CACHE_BUFCTL | OBJC_CACHE_ORDER(1), OBJC_CACHE_OFFSLAB};
+  for (std::size_t size : sizes) {
+    for (int align : aligns) {
+      for (unsigned int f : flags) {
+        objc::layout l = objc::cache_layout(size, align, f);
+        objc_cache_t *cache = objc_cache_create_ex((char *)"layout", size, align, nullptr, nullptr, f);
+        if (!cache) {
+          assert(l.total_buf == 0);
+          continue;
+        }
+        objc_cache_info_t info = objc_cache_info(cache);
+        assert(l.total_buf == info.total_buf);
+        assert(l.buffer_size == info.buffer_size);
+        assert(l.slab_size == info.slab_size);
+        assert(l.unused == info.unused);
+        assert(l.align == info.align);
+        objc_cache_destroy(cache);
+      }
+    }
+  }
+  printf("test_layout() success\n");
+}
+
+struct counted {
+  static inline int ctors, dtors;
+  std::string name = "fresh";
+  std::vector<int> data = std::vector<int>(16, 7);
+  counted() { ctors++; }
+  ~counted() { dtors++; }
+};
+
+/*Objects come out constructed, are constructed once per buffer and destroyed when their slab is released.
+ * Handles give their object back on scope exit.*/
+static void test_typed_cache() {
+  {
+    objc::cache<counted> cache("counted");
+    counted *a = cache.alloc();
+    assert(a->name == "fresh" && a->data.size() == 16 && counted::ctors == 1);
+    a->name = "used";
+    cache.free(a);
+    counted *b = cache.alloc();
+    assert(b == a && b->name == "used" && counted::ctors == 1);
+    cache.free(b);
+
+    {
+      auto h = cache.make();
+      assert(h.get() == a && counted::ctors == 1);
+      auto h2 = cache.make();
+      assert(h2.get() != a && counted::ctors == 2);
+    }
+    assert(cache.alloc() == a);
+    cache.free(a);
+    objc_cache_reap(cache.get(), 0);
+    assert(counted::dtors == 2);
+  }
+
+  /*Trivial types need no constructor and keep the C alignment rules.*/
+  objc::cache<line> lines("lines");
+  std::vector<objc::cache<line>::handle> hs;
+  for (int i = 0; i < 100; i++) {
+    hs.push_back(lines.make());
+    assert(((uintptr_t)hs.back().get() & 63) == 0);
+  }
+  hs.clear();
+#ifdef OBJC_STATS
+  assert(objc_cache_stats(lines.get()).live == 0);
+#endif
+  printf("test_typed_cache() success\n");
+}
+
+/*Upstream resource counting what reaches it.*/
+struct counting_resource : std::pmr::memory_resource {
+  int allocs = 0, frees = 0;
+  void *do_allocate(std::size_t bytes, std::size_t align) override {
+    allocs++;
+    return std::pmr::new_delete_resource()->allocate(bytes, align);
+  }
+  void do_deallocate(void *p, std::size_t bytes, std::size_t align) override {
+    frees++;
+    std::pmr::new_delete_resource()->deallocate(p, bytes, align);
+  }
+  bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+};
+
+/*Small blocks come from the size class caches, large or over-aligned ones from upstream.*/
+static void test_resource() {
+  static_assert(objc::resource::size_class(1) == 0 && objc::resource::size_class(16) == 0);
+  static_assert(objc::resource::size_class(17) == 1 && objc::resource::size_class(256) == 15);
+  static_assert(objc::resource::size_class(257) == 16 && objc::resource::class_size(16) == 320);
+
+  counting_resource upstream;
+  {
+    objc::resource res(&upstream);
+    std::pmr::list<int> l(&res);
+    for (int i = 0; i < 1000; i++)
+      l.push_back(i);
+    std::pmr::map<int, int> m(&res);
+    for (int i = 0; i < 1000; i++)
+      m[i] = i;
+    assert(upstream.allocs == 0);
+
+    objc_cache_t *list_cache = res.cache(sizeof(int) + 2 * sizeof(void *));
+    assert(list_cache);
+#ifdef OBJC_STATS
+    assert(objc_cache_stats(list_cache).live >= 1000);
+#endif
+
+    void *big = res.allocate(4096);
+    void *aligned = res.allocate(64, 64);
+    assert(upstream.allocs == 2 && ((uintptr_t)aligned & 63) == 0);
+    res.deallocate(big, 4096);
+    res.deallocate(aligned, 64, 64);
+    assert(upstream.frees == 2);
+
+    l.clear();
+    m.clear();
+#ifdef OBJC_STATS
+    assert(objc_cache_stats(list_cache).live == 0);
+#endif
+  }
+  printf("test_resource() success\n");
+}
+
+/*Node-based containers with the STL allocator.*/
+static void test_allocator() {
+  std::unordered_map<int, std::string, std::hash<int>, std::equal_to<int>,
+                     objc::allocator<std::pair<const int, std::string>>>
+      um;
+  for (int i = 0; i < 1000; i++)
+    um.emplace(i, std::to_string(i));
+  assert(um.size() == 1000 && um[500] == "500");
+
+  std::list<long, objc::allocator<long>> l(objc::allocator<long>{});
+  for (int i = 0; i < 1000; i++)
+    l.push_back(i);
+  assert(l.get_allocator() == objc::allocator<int>());
+
+  objc::resource res;
+  assert(objc::allocator<int>(&res) != objc::allocator<int>());
+  printf("test_allocator() success\n");
+}
@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+#include "objc_internal.h"
+#include "objcache.h"
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*Replays an allocation trace recorded with `objc_trace_start` against fresh caches built like the recorded ones
+ * and reports how long it took, the peak number of slabs of every cache and how fragmented the caches are at the
+ * end of the trace.
+ *
+ * Every free is matched with the alloc of the same address before it. Frees of objects allocated before the start
+ * of the trace (or before the oldest record kept by the ring) have no match and are skipped. In multi-threaded
+ * mode every recorded thread is replayed by its own thread and a free waits until the thread that owns the alloc
+ * has done it. Recorded time deltas are ignored, the trace is replayed as fast as possible.
+ *
+ * Usage: objc_replay [-t] [-m magsize] [-p lifo|dense] trace*/
+
+typedef struct replay_cache {
+  objc_cache_t *cache;
+  size_t size;
+  _Atomic unsigned int peak_slabs;
+  uint64_t live, peak_live; // from the trace, not from the replay
+} replay_cache_t;
+
+static objc_trace_hdr_t *hdr;
+static objc_trace_rec_t *recs; // in trace order
+static size_t nrecs;
+static int64_t *match; // for a free, index of its alloc or -1
+static void *_Atomic *ptrs; // object returned by the replay of each alloc
+static replay_cache_t caches[OBJC_TRACE_MAX_CACHES];
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*Copies the records of the ring out in trace order.*/
+static int load(const char *path) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(objc_trace_hdr_t)) {
+    fprintf(stderr, "%s: can't open trace\n", path);
+    return -1;
+  }
+  hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (hdr == MAP_FAILED || hdr->magic != OBJC_TRACE_MAGIC || hdr->version != OBJC_TRACE_VERSION ||
+      hdr->rec_size != sizeof(objc_trace_rec_t) || hdr->ncaches > OBJC_TRACE_MAX_CACHES ||
+      hdr->rec_offset + hdr->capacity * hdr->rec_size > (uint64_t)st.st_size) {
+    fprintf(stderr, "%s: not an objcache trace\n", path);
+    return -1;
+  }
+  objc_trace_rec_t *ring = (objc_trace_rec_t *)((char *)hdr + hdr->rec_offset);
+  uint64_t head = hdr->head;
+  uint64_t first = head > hdr->capacity ? head - hdr->capacity : 0;
+  nrecs = head - first;
+  recs = malloc(nrecs * sizeof(objc_trace_rec_t));
+  for (uint64_t i = first; i < head; i++)
+    recs[i - first] = ring[i % hdr->capacity];
+  return 0;
+}
+
+/*Matches every free with its alloc through an open addressing table of the live addresses.*/
+static void match_frees(void) {
+  size_t cap = 16;
+  while (cap < 2 * nrecs)
+    cap <<= 1;
+  uint64_t *keys = calloc(cap, sizeof(uint64_t));
+  int64_t *vals = malloc(cap * sizeof(int64_t));
+  match = malloc(nrecs * sizeof(int64_t));
+
+  for (size_t i = 0; i < nrecs; i++) {
+    objc_trace_rec_t *r = &recs[i];
+    match[i] = -1;
+    if (!r->cache || r->cache > hdr->ncaches)
+      continue;
+    size_t h = (r->obj * 0x9e3779b97f4a7c15ULL) >> 20 & (cap - 1);
+    while (keys[h] && keys[h] != r->obj)
+      h = (h + 1) & (cap - 1);
+    replay_cache_t *rc = &caches[r->cache - 1];
+    if (r->op == OBJC_TRACE_ALLOC) {
+      keys[h] = r->obj;
+      vals[h] = i;
+      if (++rc->live > rc->peak_live)
+        rc->peak_live = rc->live;
+    } else if (keys[h] && vals[h] >= 0) {
+      match[i] = vals[h];
+      vals[h] = -1;
+      caches[recs[match[i]].cache - 1].live--;
+    }
+  }
+  free(keys);
+  free(vals);
+}
+
+static inline void replay_one(size_t i) {
+  objc_trace_rec_t *r = &recs[i];
+  if (r->op == OBJC_TRACE_ALLOC) {
+    if (!r->cache || r->cache > hdr->ncaches)
+      return;
+    replay_cache_t *rc = &caches[r->cache - 1];
+    void *obj = objc_cache_alloc(rc->cache);
+    atomic_store_explicit(&ptrs[i], obj, memory_order_release);
+    /*The slab count is read without the lock of the cache, good enough for a peak.*/
+    unsigned int slabs = objc_cache_info(rc->cache).slab_count;
+    unsigned int peak = atomic_load_explicit(&rc->peak_slabs, memory_order_relaxed);
+    while (slabs > peak && !atomic_compare_exchange_weak(&rc->peak_slabs, &peak, slabs))
+      ;
+  } else if (match[i] >= 0) {
+    void *obj;
+    while (!(obj = atomic_load_explicit(&ptrs[match[i]], memory_order_acquire)))
+      sched_yield();
+    objc_free(caches[recs[match[i]].cache - 1].cache, obj);
+  }
+}
+
+typedef struct replay_thread {
+  pthread_t tid;
+  uint8_t id;
+} replay_thread_t;
+
+static void *replay_thread(void *arg) {
+  replay_thread_t *t = arg;
+  for (size_t i = 0; i < nrecs; i++) {
+    if (recs[i].thread == t->id)
+      replay_one(i);
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int threaded = 0, mag_size = 0;
+  objc_slab_policy_t policy = OBJC_SLAB_LIFO;
+  int opt;
+  while ((opt = getopt(argc, argv, "tm:p:")) != -1) {
+    switch (opt) {
+    case 't':
+      threaded = 1;
+      break;
+    case 'm':
+      mag_size = atoi(optarg);
+      break;
+    case 'p':
+      policy = strcmp(optarg, "dense") == 0 ? OBJC_SLAB_DENSE : OBJC_SLAB_LIFO;
+      break;
+    default:
+      optind = argc;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-t] [-m magsize] [-p lifo|dense] trace\n", argv[0]);
+    return 1;
+  }
+  if (load(argv[optind]) != 0)
+    return 1;
+
+  for (uint32_t i = 0; i < hdr->ncaches; i++) {
+    objc_trace_cache_t *tc = &hdr->caches[i];
+    caches[i].size = tc->size;
+    caches[i].cache = objc_cache_create_ex((char *)tc->name, tc->size, tc->align, NULL, NULL, tc->flags);
+    if (!caches[i].cache) {
+      fprintf(stderr, "can't create cache %s\n", tc->name);
+      return 1;
+    }
+    if (mag_size)
+      objc_cache_set_magsize(caches[i].cache, mag_size);
+    objc_cache_set_policy(caches[i].cache, policy);
+  }
+  match_frees();
+  ptrs = calloc(nrecs, sizeof(void *));
+
+  int nthreads = 0;
+  for (size_t i = 0; i < nrecs; i++) {
+    if (recs[i].thread > nthreads)
+      nthreads = recs[i].thread;
+  }
+  uint64_t start = now_ns();
+  if (threaded && nthreads > 1) {
+    replay_thread_t *threads = calloc(nthreads, sizeof(replay_thread_t));
+    for (int i = 0; i < nthreads; i++) {
+      threads[i].id = i + 1;
+      pthread_create(&threads[i].tid, NULL, replay_thread, &threads[i]);
+    }
+    for (int i = 0; i < nthreads; i++)
+      pthread_join(threads[i].tid, NULL);
+    free(threads);
+  } else {
+    for (size_t i = 0; i < nrecs; i++)
+      replay_one(i);
+  }
+  double secs = (now_ns() - start) / 1e9;
+
+  printf("records %zu (of %llu), threads %d replayed by %d, %.3f ms, %.0f ops/s\n", nrecs,
+         (unsigned long long)hdr->head, nthreads, threaded ? nthreads : 1, secs * 1e3, nrecs / secs);
+  printf("%-24s %8s %10s %10s %10s %8s %12s %12s\n", "cache", "size", "peak_live", "live", "peak_slabs", "slabs",
+         "utilization", "partial_occ");
+  for (uint32_t i = 0; i < hdr->ncaches; i++) {
+    replay_cache_t *rc = &caches[i];
+    objc_cache_info_t info = objc_cache_info(rc->cache);
+    objc_cache_stats_t st = objc_cache_stats(rc->cache);
+    /*Bytes of live objects over the bytes of the slabs held by the cache.*/
+    double util = info.slab_count ? (double)rc->live * rc->size / ((double)info.slab_count * info.slab_size) : 0;
+    printf("%-24s %8zu %10llu %10llu %10u %8u %12.4f %12.4f\n", hdr->caches[i].name, rc->size,
+           (unsigned long long)rc->peak_live, (unsigned long long)rc->live, atomic_load(&rc->peak_slabs), info.slab_count, util,
+           st.partial_occupancy);
+  }
+
+  free(ptrs);
+  for (uint32_t i = 0; i < hdr->ncaches; i++)
+    objc_cache_destroy(caches[i].cache);
+  free(match);
+  free(recs);
+  return 0;
+}